@@ -30,6 +30,7 @@
 
 #include "config.h"
 #include "1035.h"
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -154,16 +155,16 @@ static int _label(struct message *m, unsigned char **bufp, char **namep)
 	return 0;
 }
 
-/* Internal label matching */
+/* Internal label matching, for compression when building a message */
 static int _lmatch(const struct message *m, const char *l1, const char *l2)
 {
 	int len;
 
 	/* Always ensure we get called w/o a pointer */
 	if (*l1 & 0xc0)
-		return _lmatch(m, (char *)m->_buf + _ldecomp(l1), l2);
+		return _lmatch(m, (char *)m->_packet + _ldecomp(l1), l2);
 	if (*l2 & 0xc0)
-		return _lmatch(m, l1, (char *)m->_buf + _ldecomp(l2));
+		return _lmatch(m, l1, (char *)m->_packet + _ldecomp(l2));
 
 	/* Same already? */
 	if (l1 == l2)
@@ -195,11 +196,34 @@ static int _lmatch(const struct message *m, const char *l1, const char *l2)
 	return _lmatch(m, l1, l2);
 }
 
-/* Nasty, convert host into label using compression */
-static int _host(struct message *m, unsigned char **bufp, const char *name)
+/*
+ * Compression pointers we write must stay below this offset, message_parse()
+ * clamps anything beyond it.  Only matters for frames larger than 4k.
+ */
+#define MAX_LABEL_OFFSET 4095
+
+/* Fingerprint of a label and the suffix following it */
+static unsigned int _lfp(const unsigned char *label, unsigned int tail)
+{
+	unsigned int h = tail ^ 2166136261u;	/* FNV-1a */
+	int i;
+
+	for (i = 0; i <= label[0]; i++) {
+		h ^= label[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/*
+ * Encode name to uncompressed wire format in w, which must have room for
+ * WIRE_NAME_MAX bytes.  Returns the number of bytes used, 0 on error.
+ */
+static size_t _wire(struct wire_name *w, const char *name)
 {
-	char label[256], *l;
-	int len = 0, x = 1, y = 0, last = 0;
+	unsigned char label[256], off[128];
+	int x = 1, y = 0, last = 0, n = 0, len;
 
 	if (name == 0)
 		return 0;
@@ -209,10 +233,10 @@ static int _host(struct message *m, unsigned char **bufp, const char *name)
 		if (name[y] == '.') {
 			if (!name[y + 1])
 				break;
-			label[last] = (char)(x - (last + 1));
+			label[last] = (unsigned char)(x - (last + 1));
 			last = x;
 		} else {
-			label[x] = name[y];
+			label[x] = (unsigned char)name[y];
 		}
 
 		if (x++ == 255)
@@ -221,45 +245,110 @@ static int _host(struct message *m, unsigned char **bufp, const char *name)
 		y++;
 	}
 
-	label[last] = (char)(x - (last + 1));
+	label[last] = (unsigned char)(x - (last + 1));
 	if (x == 1)
 		x--;		/* Special case, bad names, but handle correctly */
-	len = x + 1;
 	label[x] = 0;		/* Always terminate w/ a 0 */
 
-	/* Double-loop checking each label against all m->_labels for match */
-	for (x = 0; label[x]; x += label[x] + 1) {
-		for (y = 0; y < MAX_NUM_LABELS && m->_labels[y]; y++) {
-			if (_lmatch(m, label + x, m->_labels[y])) {
-				/* Matching label, set up pointer */
-				l = label + x;
-				short2net((unsigned char *)m->_labels[y] - m->_packet, (unsigned char **)&l);
-				label[x] |= '\xc0';
-				len = x + 2;
+	for (x = 0; label[x]; x += label[x] + 1)
+		off[n++] = (unsigned char)x;
+	len = x + 1;
+
+	w->len   = (unsigned short)len;
+	w->n     = (unsigned char)n;
+	w->fp    = (unsigned int *)(w + 1);
+	w->label = (unsigned char *)(w->fp + n);
+	w->off   = w->label + len;
+	memcpy(w->label, label, len);
+	memcpy(w->off, off, n);
+
+	/* Suffix fingerprints, from the root up */
+	for (x = n - 1; x >= 0; x--)
+		w->fp[x] = _lfp(w->label + off[x], x + 1 < n ? w->fp[x + 1] : 0);
+
+	return sizeof(*w) + n * (sizeof(unsigned int) + 1) + len;
+}
+
+/*
+ * Append name to the packet, compressed against the names already in it.
+ * The fingerprints narrow down the dictionary search to (most likely) the
+ * one entry that matches, _lmatch() only confirms it.
+ */
+static int _put(struct message *m, unsigned char **bufp, const struct wire_name *w)
+{
+	unsigned char *l, *p;
+	int k, y, len;
+
+	for (k = 0; k < w->n; k++) {
+		for (y = 0; y < m->_label; y++) {
+			if (m->_lfp[y] != w->fp[k])
+				continue;
+			if ((unsigned char *)m->_labels[y] - m->_packet > MAX_LABEL_OFFSET)
+				continue;
+			if (_lmatch(m, (char *)w->label + w->off[k], m->_labels[y]))
 				break;
-			}
 		}
-	
-		if (label[x] & 0xc0)
+
+		if (y < m->_label)
 			break;
 	}
 
-	/* Copy into buffer, point there now */
-	memcpy(*bufp, label, len);
-	l = (char *)*bufp;
+	/* Copy into buffer, ending in a pointer to the matching suffix */
+	l = *bufp;
+	if (k < w->n) {
+		memcpy(l, w->label, w->off[k]);
+		p = l + w->off[k];
+		short2net(0xc000 | ((unsigned char *)m->_labels[y] - m->_packet), &p);
+		len = w->off[k] + 2;
+	} else {
+		memcpy(l, w->label, w->len);
+		len = w->len;
+	}
 	*bufp += len;
 
 	/* For each new label, store it's location for future compression */
-	for (x = 0; l[x] && m->_label < MAX_NUM_LABELS; x += l[x] + 1) {
-		if (l[x] & 0xc0)
-			break;
-
-		m->_labels[m->_label++] = l + x;
+	for (y = 0; y < k && m->_label < MAX_NUM_LABELS; y++) {
+		m->_labels[m->_label] = (char *)l + w->off[y];
+		m->_lfp[m->_label++]  = w->fp[y];
 	}
 
 	return len;
 }
 
+/* Nasty, convert host into label using compression */
+static int _host(struct message *m, unsigned char **bufp, const char *name)
+{
+	union {
+		struct wire_name w;
+		unsigned char buf[WIRE_NAME_MAX];
+	} u;
+
+	if (!_wire(&u.w, name))
+		return 0;
+
+	return _put(m, bufp, &u.w);
+}
+
+struct wire_name *message_name_new(const char *name)
+{
+	union {
+		struct wire_name w;
+		unsigned char buf[WIRE_NAME_MAX];
+	} u;
+	struct wire_name *w;
+	size_t len;
+
+	len = _wire(&u.w, name);
+	if (!len)
+		return NULL;
+
+	w = malloc(len);
+	if (w)
+		_wire(w, name);
+
+	return w;
+}
+
 static int _rrparse(struct message *m, struct resource *rr, int count, unsigned char **bufp)
 {
 	int i;
@@ -409,6 +498,8 @@ int message_parse(struct message *m, unsigned char *packet)
 			return 1;
 		m->qd[i].type  = net2short(&buf);
 		m->qd[i].class = net2short(&buf);
+		m->qd[i].unicast = (m->qd[i].class & QCLASS_QU) ? 1 : 0;
+		m->qd[i].class &= ~QCLASS_QU;
 	}
 
 	/* Process rrs */
@@ -445,6 +536,34 @@ static void _rrappend(struct message *m, char *name, unsigned short int type, un
 	long2net(ttl, &(m->_buf));
 }
 
+static void _rrappend_wire(struct message *m, const struct wire_name *name, unsigned short int type, unsigned short int class, unsigned long int ttl)
+{
+	if (m->_buf == 0)
+		m->_buf = m->_packet + 12;
+	_put(m, &(m->_buf), name);
+	short2net(type, &(m->_buf));
+	short2net(class, &(m->_buf));
+	long2net(ttl, &(m->_buf));
+}
+
+void message_an_wire(struct message *m, const struct wire_name *name, unsigned short int type, unsigned short int class, unsigned long int ttl)
+{
+	m->ancount++;
+	_rrappend_wire(m, name, type, class, ttl);
+}
+
+void message_ns_wire(struct message *m, const struct wire_name *name, unsigned short int type, unsigned short int class, unsigned long int ttl)
+{
+	m->nscount++;
+	_rrappend_wire(m, name, type, class, ttl);
+}
+
+void message_ar_wire(struct message *m, const struct wire_name *name, unsigned short int type, unsigned short int class, unsigned long int ttl)
+{
+	m->arcount++;
+	_rrappend_wire(m, name, type, class, ttl);
+}
+
 void message_an(struct message *m, char *name, unsigned short int type, unsigned short int class, unsigned long int ttl)
 {
 	m->ancount++;
@@ -502,15 +621,54 @@ void message_rdata_srv(struct message *m, unsigned short int priority, unsigned
 	short2net(_host(m, &(m->_buf), name) + 6, &mybuf);
 }
 
+void message_rdata_wire(struct message *m, const unsigned char *prefix, unsigned short int len, const struct wire_name *name)
+{
+	unsigned char *mybuf = m->_buf;
+
+	m->_buf += 2;
+	if (len) {
+		memcpy(m->_buf, prefix, len);
+		m->_buf += len;
+	}
+	short2net(_put(m, &(m->_buf), name) + len, &mybuf);
+}
+
 void message_rdata_raw(struct message *m, unsigned char *rdata, unsigned short int rdlength)
 {
-	if ((m->_buf - m->_packet) + rdlength > 4096)
+	if ((m->_buf - m->_packet) + 2 + rdlength > MAX_PACKET_LEN)
 		rdlength = 0;
 	short2net(rdlength, &(m->_buf));
 	memcpy(m->_buf, rdata, rdlength);
 	m->_buf += rdlength;
 }
 
+void message_mark(struct message *m, struct message_mark *mk)
+{
+	if (m->_buf == 0)
+		m->_buf = m->_packet + 12;
+
+	mk->buf     = m->_buf;
+	mk->label   = m->_label;
+	mk->qdcount = m->qdcount;
+	mk->ancount = m->ancount;
+	mk->nscount = m->nscount;
+	mk->arcount = m->arcount;
+}
+
+void message_rewind(struct message *m, struct message_mark *mk)
+{
+	/* Forget labels past the mark, the compression search stops at NULL */
+	while (m->_label > mk->label)
+		m->_labels[--m->_label] = NULL;
+
+	memset(mk->buf, 0, m->_buf - mk->buf);
+	m->_buf    = mk->buf;
+	m->qdcount = mk->qdcount;
+	m->ancount = mk->ancount;
+	m->nscount = mk->nscount;
+	m->arcount = mk->arcount;
+}
+
 unsigned char *message_packet(struct message *m)
 {
 	unsigned char c, *buf = m->_buf;
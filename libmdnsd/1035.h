@@ -55,11 +55,18 @@
 #define MAX_PACKET_LEN 65535
 #define MAX_NUM_LABELS 512
 
+/* Largest mDNS packet we send, even on jumbo frame links, RFC 6762 §17 */
+#define MAX_FRAME_LEN  9000
+
 struct question {
 	char *name;
 	unsigned short int type, class;
+	unsigned char unicast;	/* QU bit, split off class */
 };
 
+/* Top bit of a question's class, unicast response wanted, RFC 6762 §5.4 */
+#define QCLASS_QU    0x8000
+
 #define QTYPE_A      1
 #define QTYPE_NS     2
 #define QTYPE_CNAME  5
@@ -100,6 +107,22 @@ struct resource {
 	} known;
 };
 
+/*
+ * A name in uncompressed wire format, with a fingerprint of each of its
+ * suffixes, for quick lookups in the compression dictionary.  Encode it
+ * once with message_name_new(), free() it when done.
+ */
+struct wire_name {
+	unsigned short int len;	/* Bytes in label[], root label included */
+	unsigned char n;	/* Number of labels, root excluded */
+	unsigned int *fp;	/* Fingerprint of the suffix at each label */
+	unsigned char *label;	/* Wire format */
+	unsigned char *off;	/* Offset of each label in label[] */
+};
+
+/* Largest allocation a wire_name can need */
+#define WIRE_NAME_MAX (sizeof(struct wire_name) + 128 * (sizeof(unsigned int) + 1) + 256)
+
 struct message {
 	/* External data */
 	unsigned short int id;
@@ -113,6 +136,7 @@ struct message {
 	/* Internal variables */
 	unsigned char *_buf;
 	char *_labels[MAX_NUM_LABELS];
+	unsigned int _lfp[MAX_NUM_LABELS];
 	int _len, _label;
 
 	/* Packet acts as padding, easier mem management */
@@ -155,6 +179,14 @@ void message_an(struct message *m, char *name, unsigned short int type, unsigned
 void message_ns(struct message *m, char *name, unsigned short int type, unsigned short int class, unsigned long int ttl);
 void message_ar(struct message *m, char *name, unsigned short int type, unsigned short int class, unsigned long int ttl);
 
+/**
+ * Same, with a pre-encoded name from message_name_new()
+ */
+struct wire_name *message_name_new(const char *name);
+void message_an_wire(struct message *m, const struct wire_name *name, unsigned short int type, unsigned short int class, unsigned long int ttl);
+void message_ns_wire(struct message *m, const struct wire_name *name, unsigned short int type, unsigned short int class, unsigned long int ttl);
+void message_ar_wire(struct message *m, const struct wire_name *name, unsigned short int type, unsigned short int class, unsigned long int ttl);
+
 /**
  * Append various special types of resource data blocks
  */
@@ -165,6 +197,22 @@ void message_rdata_name (struct message *m, char *name);
 void message_rdata_srv  (struct message *m, unsigned short int priority, unsigned short int weight,
 			 unsigned short int port, char *name);
 void message_rdata_raw  (struct message *m, unsigned char *rdata, unsigned short int rdlength);
+/* len bytes of fixed rdata, e.g. SRV priority/weight/port, then a name */
+void message_rdata_wire (struct message *m, const unsigned char *prefix, unsigned short int len,
+			 const struct wire_name *name);
+
+/**
+ * Remember the current end of the message, and roll back to it, e.g. to
+ * back out a record that turned out not to fit in the frame
+ */
+struct message_mark {
+	unsigned char *buf;
+	int label;
+	unsigned short int qdcount, ancount, nscount, arcount;
+};
+
+void message_mark  (struct message *m, struct message_mark *mk);
+void message_rewind(struct message *m, struct message_mark *mk);
 
 /**
  * Return the wire format (and length) of the message, just free message
@@ -65,3 +65,17 @@ const char *inet_ntop2(const inet_addr_t *ss, char *buf, size_t len)
 #endif
 	return inet_ntop(AF_INET, &((const struct sockaddr_in *)ss)->sin_addr, buf, len);
 }
+
+int inet_same_addr(const inet_addr_t *a, const inet_addr_t *b)
+{
+	if (a->ss_family != b->ss_family)
+		return 0;
+
+#ifdef ENABLE_IPV6
+	if (a->ss_family == AF_INET6)
+		return IN6_ARE_ADDR_EQUAL(&((const struct sockaddr_in6 *)a)->sin6_addr,
+					  &((const struct sockaddr_in6 *)b)->sin6_addr);
+#endif
+	return ((const struct sockaddr_in *)a)->sin_addr.s_addr ==
+		((const struct sockaddr_in *)b)->sin_addr.s_addr;
+}
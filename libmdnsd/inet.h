@@ -32,4 +32,7 @@ void        inet_anyaddr(sa_family_t family, in_port_t port, inet_addr_t *ss);
 /* Presentation string of the address in @ss, e.g. for logging */
 const char *inet_ntop2(const inet_addr_t *ss, char *buf, size_t len);
 
+/* True if @a and @b hold the same host address, the port is ignored */
+int         inet_same_addr(const inet_addr_t *a, const inet_addr_t *b);
+
 #endif /* MDNSD_INET_H_ */
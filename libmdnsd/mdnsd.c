@@ -29,6 +29,8 @@
 
 #include "config.h"
 #include "mdnsd.h"
+#include "siphash.h"
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -39,6 +41,7 @@
 
 #define SPRIME 109		/* Size of query/publish hashes */
 #define LPRIME 1009		/* Size of cache hash */
+#define STPRIME 1009		/* Size of the shared record store */
 
 #define GC 86400                /* Brute force garbage cleanup
 				 * frequency, rarely needed (daily
@@ -47,6 +50,35 @@
 /* Interval for refreshing cached local interface addresses (seconds) */
 #define LOCAL_ADDR_REFRESH_INTERVAL 5
 
+/*
+ * RFC 6762 §7.2: hold answers to a truncated (TC) query 400-500 msec,
+ * while the querier sends the rest of its known answers.
+ */
+#define TC_DEFER_MIN 400000
+#define TC_DEFER_RND 100000
+
+/* RFC 6762 §6: least time between multicasts of a record, usec */
+#define RATE_LIMIT   1000000
+#define RATE_PROBE   250000
+
+/*
+ * Serialized responses are memoized per question set, so a storm of
+ * identical queries does not rebuild the same packet every time.
+ */
+#define RCACHE       32		/* Slots, least recently used replaced */
+#define RCACHE_MAX   16		/* Max answers in a memoized response */
+
+/* Records not fitting in a packet, before calling it full, see _plan() */
+#define PLAN_MISSES  8
+
+/* Counting bloom filter over our names, see _bloom_has() */
+#define BLOOM_SIZE   8192
+#define BLOOM_K      3
+
+/* Per-source ingress accounting, see mdnsd_admit() */
+#define SRC_SLOTS    64		/* Sources tracked */
+#define SRC_PROBE    4		/* Slots searched, then the oldest goes */
+
 /**
  * Messy, but it's the best/simplest balance I can find at the moment
  *
@@ -61,29 +93,68 @@
 
 struct query {
 	char *name;
+	unsigned int hash;	/* _namehash(name) */
 	int type;
 	unsigned long int nexttry;
 	int tries;
 	int (*answer)(mdns_answer_t *, void *);
 	void *arg;
+	int kasent;		/* Known answers sent so far this round */
+	char kamore;		/* More known answers for a follow-on packet */
+	char asked;		/* Sent at least once, no more QU */
 	struct query *next, *list;
 };
 
 struct unicast {
 	int id;
+	char qu;		/* Reply to a QU question, else legacy unicast */
 	inet_addr_t to;
 	mdns_record_t *r;
 	struct unicast *next;
 };
 
+/* Answer to a truncated query, held back until the source's known answers are in */
+struct deferred {
+	inet_addr_t from;
+	struct timeval when;
+	mdns_record_t *r;
+	struct deferred *next;
+};
+
+/*
+ * A cached answer is a single allocation: the fixed part holds only what
+ * all types share, the rest is a union tagged by type, followed by the
+ * name, rdata and rdname inline.  See _c_view() for the mdns_answer_t
+ * handed to the API.
+ */
 struct cached {
-	struct mdns_answer rr;
-	struct query *q;
 	struct cached *next;
+	struct query *q;
+	unsigned long int ttl;	/* Expires, tv_sec, see _cache() */
+	struct timeval rcvd;	/* Last time it was on the wire */
+	unsigned int hash;	/* _namehash(name) */
+	struct source *src;	/* Counted against its record quota */
+	unsigned short type;
+	unsigned short rdlen;
+	unsigned short rdata;	/* Offset in name[] */
+	unsigned short rdname;	/* Offset in name[], 0: none */
+	unsigned char v6;	/* NS/CNAME/PTR responder is in u.ip6 */
+	unsigned char seen;	/* Transports heard on, see _c_transport() */
+	union {
+		struct in_addr ip;	/* A, or NS/CNAME/PTR responder */
+		struct in6_addr ip6;	/* AAAA, or NS/CNAME/PTR responder */
+		struct {
+			unsigned short priority, weight, port;
+		} srv;			/* SRV */
+	} u;
+	char name[];		/* name, rdata, rdname */
 };
 
 struct mdns_record {
 	struct mdns_answer rr;
+	unsigned int hash;		/* _namehash(rr.name) */
+	struct wire_name *wname;	/* rr.name, pre-encoded */
+	struct wire_name *wrdname;	/* rr.rdname, pre-encoded, if any */
 	char unique;		/* # of checks performed to ensure */
 	int modified;		/* Ignore conflicts after update at runtime */
 	int tries;
@@ -91,17 +162,73 @@ struct mdns_record {
 	void *arg;
 	struct timeval last_sent;
 	struct mdns_record *next, *list;
+
+	/* RFC 6763 §12 record graph, see _r_link() */
+	struct mdns_record *same;	/* Ring of records with the same name */
+	struct mdns_record *target;	/* A record named rr.rdname, if any */
+	struct mdns_record *lnext;	/* Next record with an rdname */
+
+	/* Additional records, see struct answered */
+	struct mdns_record *pnext;	/* Next in the packet */
+	unsigned long stamp;		/* Packet last added to */
+};
+
+/*
+ * A host on the link, its token bucket and what it has in our cache.  A
+ * slot is not reused while any cache entry counts against it.
+ */
+struct source {
+	unsigned int key;	/* _src_key(), 0 for a free slot */
+	inet_addr_t addr;
+	long tokens;		/* Packets, in 1/1000 */
+	struct timeval last;	/* Last refill */
+	time_t seen;		/* Last heard from, 0 for a free slot */
+	unsigned long packets, dropped, declined;
+	unsigned int records;	/* Cache entries */
+	char shedding;
+};
+
+/* A memoized response, valid for one generation of published records */
+struct response {
+	unsigned int key;	/* Question set and known answers */
+	unsigned long gen, used;
+	char due;		/* Queued: 1 asap, 2 after d->pause */
+	int nan, n;		/* Answers, then additional records */
+	mdns_record_t **rec;
+	unsigned short ancount, arcount;
+	unsigned char *packet;	/* Everything after the header */
+	int len;
 };
 
 struct mdns_daemon {
-	char shutdown, disco;
+	char shutdown, disco, kamore, qu;
 	unsigned long int expireall, checkqlist;
 	struct timeval now, sleep, pause, probe, publish;
-	int class, frame;
-	struct cached *cache[LPRIME];
+	int class, frame, mtu;
+	struct cached **cache;		/* LPRIME buckets, shared with the peer */
+	mdns_daemon_t *peer;		/* Other transport on the link, if sharing */
+	struct cached *lcur;		/* mdnsd_list() cursor, and its view */
+	mdns_answer_t lview;
 	struct mdns_record *published[SPRIME], *probing, *a_now, *a_pause, *a_publish;
+	struct mdns_record *referrers;	/* PTR, SRV, etc. see _r_link() */
+	unsigned char bloom[BLOOM_SIZE];	/* Published and queried names */
+	unsigned long stamp;		/* Packets built, see struct answered */
 	struct unicast *uanswers;
+	struct deferred *deferred;
 	struct query *queries[SPRIME], *qlist;
+	unsigned long int cflush;	/* Cache-flushed entries expire, tv_sec */
+	mdnsd_cache_policy_t cpolicy;	/* What _cache() admits */
+	size_t cbudget;			/* Max cache bytes, 0: unlimited */
+	struct source src[SRC_SLOTS];
+	struct source spill;		/* One bucket for sources not tracked */
+	unsigned int srate, sburst;	/* Packets/sec per source, 0: unlimited */
+	unsigned int srecords;		/* Cache entries per source, 0: unlimited */
+	struct response rcache[RCACHE];
+	unsigned long gen;		/* Bumped on any change to published records */
+	unsigned long rused;		/* Memoized response lookups, for LRU */
+	int rpending;			/* Memoized responses queued */
+	mdnsd_stats_t stats;
+	mdnsd_store_t *store;		/* Names and rdata, see mdnsd_set_store() */
 
 	sa_family_t family;		/* transport: AF_INET or AF_INET6 */
 	struct in_addr addr;
@@ -115,83 +242,125 @@ struct mdns_daemon {
 	void *received_callback_data;
 };
 
-static int _namehash(const char *s)
+static void _rc_stale(mdns_daemon_t *d);
+
+/*
+ * Keyed hash of a name, for all tables and the bloom filter.  Computed
+ * once per name and kept with it, the seed is random per process so no
+ * one on the link can make names collide.
+ */
+static unsigned int _namehash(const char *s)
 {
-	const unsigned char *name = (const unsigned char *)s;
-	unsigned long h = 0, g;
+	return strhash(s);
+}
 
-	while (*name) {		/* do some fancy bitwanking on the string */
-		h = (h << 4) + (unsigned long)(*name++);
-		if ((g = (h & 0xF0000000UL)) != 0)
-			h ^= (g >> 24);
-		h &= ~g;
-	}
+/*
+ * Counting bloom filter over the names we publish or query, so traffic
+ * about other names is turned away after one hash, not a walk of the
+ * hash tables.  Counters saturate, and then stay.
+ */
+static void _bloom_update(mdns_daemon_t *d, unsigned int h, int delta)
+{
+	unsigned int step = (h >> 16) | (h << 16) | 1;
+	int i;
 
-	return (int)h;
+	for (i = 0; i < BLOOM_K; i++, h += step) {
+		unsigned char *c = &d->bloom[h % BLOOM_SIZE];
+
+		if (*c == 255)
+			continue;
+		if (delta > 0)
+			(*c)++;
+		else if (*c)
+			(*c)--;
+	}
 }
 
-/* Basic linked list and hash primitives */
-static struct query *_q_next(mdns_daemon_t *d, struct query *q, const char *host, int type)
+/* Might we publish or query the name hashed, false means certainly not */
+static int _bloom_has(mdns_daemon_t *d, unsigned int h)
 {
-	if (!q)
-		q = d->queries[_namehash(host) % SPRIME];
-	else
-		q = q->next;
+	unsigned int step = (h >> 16) | (h << 16) | 1;
+	int i;
+
+	for (i = 0; i < BLOOM_K; i++, h += step) {
+		if (!d->bloom[h % BLOOM_SIZE])
+			return 0;
+	}
+
+	return 1;
+}
 
+/*
+ * Basic linked list and hash primitives.  The _next() ones start over with
+ * NULL, the _next_h() ones start with the name's hash @h already at hand.
+ */
+static struct query *_q_scan(struct query *q, unsigned int h, const char *host, int type)
+{
 	for (; q != 0; q = q->next) {
-		if (q->type == type && strcmp(q->name, host) == 0)
+		if (q->hash == h && q->type == type && strcmp(q->name, host) == 0)
 			return q;
 	}
 
 	return NULL;
 }
 
-static struct cached *_c_next(mdns_daemon_t *d, struct cached *c,const char *host, int type)
+static struct query *_q_next_h(mdns_daemon_t *d, unsigned int h, const char *host, int type)
 {
-	if (!c)
-		c = d->cache[_namehash(host) % LPRIME];
-	else
-		c = c->next;
+	return _q_scan(d->queries[h % SPRIME], h, host, type);
+}
+
+static struct query *_q_next(mdns_daemon_t *d, struct query *q, const char *host, int type)
+{
+	if (!q)
+		return _q_next_h(d, _namehash(host), host, type);
+
+	return _q_scan(q->next, q->hash, host, type);
+}
 
+static struct cached *_c_scan(struct cached *c, unsigned int h, const char *host, int type)
+{
 	for (; c != 0; c = c->next) {
-		if ((type == c->rr.type || type == QTYPE_ANY) && strcmp(c->rr.name, host) == 0)
+		if (c->hash == h && (type == c->type || type == QTYPE_ANY) && strcmp(c->name, host) == 0)
 			return c;
 	}
 
 	return NULL;
 }
 
-static mdns_record_t *_r_next(mdns_daemon_t *d, mdns_record_t *r, const char *host, int type)
+static struct cached *_c_next_h(mdns_daemon_t *d, unsigned int h, const char *host, int type)
 {
-	if (!r)
-		r = d->published[_namehash(host) % SPRIME];
-	else
-		r = r->next;
+	return _c_scan(d->cache[h % LPRIME], h, host, type);
+}
 
+static struct cached *_c_next(mdns_daemon_t *d, struct cached *c, const char *host, int type)
+{
+	if (!c)
+		return _c_next_h(d, _namehash(host), host, type);
+
+	return _c_scan(c->next, c->hash, host, type);
+}
+
+static mdns_record_t *_r_scan(mdns_record_t *r, unsigned int h, const char *host, int type)
+{
 	for (; r != NULL; r = r->next) {
-		if ((type == r->rr.type || type == QTYPE_ANY) && strcmp(r->rr.name, host) == 0)
+		if (r->hash == h && (type == r->rr.type || type == QTYPE_ANY) && strcmp(r->rr.name, host) == 0)
 			return r;
 	}
 
 	return NULL;
 }
 
-static size_t _rr_len(mdns_answer_t *rr)
+static mdns_record_t *_r_next_h(mdns_daemon_t *d, unsigned int h, const char *host, int type)
 {
-	size_t len = 12;		/* name is always compressed (dup of earlier), plus normal stuff */
+	return _r_scan(d->published[h % SPRIME], h, host, type);
+}
 
-	if (rr->rdata)
-		len += rr->rdlen;
-	if (rr->rdname)
-		len += strlen(rr->rdname); /* worst case */
-	if (rr->ip.s_addr)
-		len += 4;
-	if (! IN6_IS_ADDR_UNSPECIFIED(&(rr->ip6)))
-		len += 16;
-	if (rr->type == QTYPE_PTR)
-		len += 6;	/* srv record stuff */
+static mdns_record_t *_r_next(mdns_daemon_t *d, mdns_record_t *r, const char *host, int type)
+{
+	if (!r)
+		return _r_next_h(d, _namehash(host), host, type);
 
-	return len;
+	return _r_scan(r->next, r->hash, host, type);
 }
 
 /* Compares new rdata with known a, painfully */
@@ -294,6 +463,7 @@ static void _r_push(mdns_record_t **list, mdns_record_t *r)
 /* Force any r out right away, if valid */
 static void _r_publish(mdns_daemon_t *d, mdns_record_t *r)
 {
+	_rc_stale(d);
 	r->modified = 1;
 
 	if (r->unique && r->unique < 5)
@@ -308,44 +478,131 @@ static void _r_publish(mdns_daemon_t *d, mdns_record_t *r)
 	_r_push(&d->a_publish, r);
 }
 
-/* send r out asap */
-static void _r_send(mdns_daemon_t *d, mdns_record_t *r)
+/*
+ * RFC 6762 §6: multicast a record at most once per @usec, one second
+ * normally, 250 msec when defending it against a probe.  Goodbyes are
+ * never held back.
+ */
+static int _r_recent(mdns_daemon_t *d, mdns_record_t *r, long usec)
+{
+	if (!r->rr.ttl || !r->last_sent.tv_sec)
+		return 0;
+
+	return _tvdiff(r->last_sent, d->now) < usec;
+}
+
+/* Set d->pause.tv_usec to random 20-120 msec */
+static void _r_pause(mdns_daemon_t *d)
+{
+	d->pause.tv_sec = d->now.tv_sec;
+	d->pause.tv_usec = d->now.tv_usec + (d->now.tv_usec % 100) + 20;
+}
+
+/* send r out asap, unless just sent, then returns 1 */
+static int _r_send(mdns_daemon_t *d, mdns_record_t *r, int probe)
 {
 	/* Being published, make sure that happens soon */
 	if (r->tries < 4) {
 		d->publish.tv_sec = d->now.tv_sec;
 		d->publish.tv_usec = d->now.tv_usec;
-		return;
+		return 0;
 	}
 
+	if (_r_recent(d, r, probe ? RATE_PROBE : RATE_LIMIT))
+		return 1;
+
 	/* Known unique ones can be sent asap */
 	if (r->unique) {
 		/* check if r already in other lists. If yes, remove it from there */
 		_r_remove_lists(d, r, &d->a_now);
 		_r_push(&d->a_now, r);
-		return;
+		return 0;
 	}
 
-	/* Set d->pause.tv_usec to random 20-120 msec */
-	d->pause.tv_sec = d->now.tv_sec;
-	d->pause.tv_usec = d->now.tv_usec + (d->now.tv_usec % 100) + 20;
+	_r_pause(d);
 
 	/* check if r already in other lists. If yes, remove it from there */
 	_r_remove_lists(d, r, &d->a_pause);
 	_r_push(&d->a_pause, r);
+
+	return 0;
+}
+
+/*
+ * Published records changed, memoized responses no longer hold.  Queued
+ * ones go out the regular way instead.
+ */
+static void _rc_stale(mdns_daemon_t *d)
+{
+	int i, j;
+
+	d->gen++;
+	for (i = 0; d->rpending && i < RCACHE; i++) {
+		struct response *e = &d->rcache[i];
+
+		if (!e->due)
+			continue;
+
+		e->due = 0;
+		d->rpending--;
+		for (j = 0; j < e->nan; j++)
+			_r_send(d, e->rec[j], 0);
+	}
+}
+
+/* r is being freed, unqueue any memoized response answering with it */
+static void _rc_forget(mdns_daemon_t *d, mdns_record_t *r)
+{
+	int i, j;
+
+	d->gen++;
+	for (i = 0; d->rpending && i < RCACHE; i++) {
+		struct response *e = &d->rcache[i];
+
+		for (j = 0; e->due && j < e->nan; j++) {
+			if (e->rec[j] != r)
+				continue;
+
+			e->due = 0;
+			d->rpending--;
+		}
+	}
+}
+
+/* Forget queued responses, for when all records go at once */
+static void _rc_drop(mdns_daemon_t *d)
+{
+	int i;
+
+	d->gen++;
+	d->rpending = 0;
+	for (i = 0; i < RCACHE; i++)
+		d->rcache[i].due = 0;
 }
 
 /* Create generic unicast response struct */
-static void _u_push(mdns_daemon_t *d, mdns_record_t *r, int id, const inet_addr_t *to)
+static int _u_same(const inet_addr_t *a, const inet_addr_t *b)
+{
+	return inet_same_addr(a, b) && inet_port(a) == inet_port(b);
+}
+
+static void _u_push(mdns_daemon_t *d, mdns_record_t *r, int id, const inet_addr_t *to, int qu)
 {
 	struct unicast *u;
 
+	/* Already on its way to this querier */
+	for (u = d->uanswers; qu && u; u = u->next) {
+		if (u->qu && u->r == r && _u_same(&u->to, to))
+			return;
+	}
+
 	u = calloc(1, sizeof(struct unicast));
 	if (!u)
 		return;
 
 	u->r = r;
 	u->id = id;
+	u->qu = qu;
 	u->to = *to;
 	u->next = d->uanswers;
 	d->uanswers = u;
@@ -372,6 +629,184 @@ static void _u_remove(mdns_daemon_t *d, mdns_record_t *r)
 	}
 }
 
+/* Set @tv to a random 400-500 msec from now, the known-answer window */
+static void _tc_window(mdns_daemon_t *d, struct timeval *tv)
+{
+	tv->tv_sec = d->now.tv_sec;
+	tv->tv_usec = d->now.tv_usec + TC_DEFER_MIN + randhash() % TC_DEFER_RND;
+	while (tv->tv_usec >= 1000000) {
+		tv->tv_sec++;
+		tv->tv_usec -= 1000000;
+	}
+}
+
+/*
+ * Hold r for a truncated query from @from.  All of a source's answers are
+ * released together, 400-500 msec after its first truncated query.
+ */
+static void _tc_defer(mdns_daemon_t *d, mdns_record_t *r, const inet_addr_t *from)
+{
+	struct deferred *dr, *first = NULL;
+
+	for (dr = d->deferred; dr; dr = dr->next) {
+		if (!inet_same_addr(&dr->from, from))
+			continue;
+		if (dr->r == r)
+			return;
+		first = dr;
+	}
+
+	dr = calloc(1, sizeof(struct deferred));
+	if (!dr) {
+		_r_send(d, r, 0);
+		return;
+	}
+
+	dr->r = r;
+	dr->from = *from;
+	if (first)
+		dr->when = first->when;
+	else
+		_tc_window(d, &dr->when);
+	dr->next = d->deferred;
+	d->deferred = dr;
+}
+
+/*
+ * Follow-on known answers from @from, drop any held answers they already
+ * have.  If this packet is truncated too, more are coming, so the hold on
+ * the rest is extended by another window, RFC 6762 §7.2.
+ */
+static void _tc_known(mdns_daemon_t *d, struct message *m, const inet_addr_t *from)
+{
+	struct deferred *dr, *prev = NULL;
+	struct timeval when;
+	int j;
+
+	if (m->header.tc)
+		_tc_window(d, &when);
+
+	for (dr = d->deferred; dr;) {
+		struct deferred *next = dr->next;
+
+		if (inet_same_addr(&dr->from, from)) {
+			for (j = 0; j < m->ancount; j++) {
+				if (m->an[j].name && _a_match(&m->an[j], &dr->r->rr))
+					break;
+			}
+
+			if (j < m->ancount) {
+				INFO("Known answer %s, type %d, dropping held answer", dr->r->rr.name, dr->r->rr.type);
+				if (prev)
+					prev->next = next;
+				else
+					d->deferred = next;
+				free(dr);
+				dr = next;
+				continue;
+			}
+
+			if (m->header.tc)
+				dr->when = when;
+		}
+
+		prev = dr;
+		dr = next;
+	}
+}
+
+/* Release held answers whose known-answer window has closed */
+static void _tc_release(mdns_daemon_t *d)
+{
+	struct deferred *dr, *prev = NULL;
+
+	for (dr = d->deferred; dr;) {
+		struct deferred *next = dr->next;
+
+		if (_tvdiff(d->now, dr->when) > 0) {
+			prev = dr;
+			dr = next;
+			continue;
+		}
+
+		if (prev)
+			prev->next = next;
+		else
+			d->deferred = next;
+
+		/* Already waited, so skip the shared record 20-120 msec pause */
+		if (dr->r->tries < 4) {
+			_r_send(d, dr->r, 0);
+		} else if (!_r_recent(d, dr->r, RATE_LIMIT)) {
+			_r_remove_lists(d, dr->r, &d->a_now);
+			_r_push(&d->a_now, dr->r);
+		}
+		free(dr);
+		dr = next;
+	}
+}
+
+/* Usec until the first held answer is due, or -1 if none */
+static long _tc_next(mdns_daemon_t *d)
+{
+	struct deferred *dr;
+	long usec = -1;
+
+	for (dr = d->deferred; dr; dr = dr->next) {
+		long diff = _tvdiff(d->now, dr->when);
+
+		if (diff < 0)
+			diff = 0;
+		if (usec < 0 || diff < usec)
+			usec = diff;
+	}
+
+	return usec;
+}
+
+/* Drop any held answers referring to r, which is being freed */
+static void _tc_remove(mdns_daemon_t *d, mdns_record_t *r)
+{
+	struct deferred *dr = d->deferred, *prev = NULL;
+
+	while (dr) {
+		struct deferred *next = dr->next;
+
+		if (dr->r == r) {
+			if (prev)
+				prev->next = next;
+			else
+				d->deferred = next;
+			free(dr);
+		} else {
+			prev = dr;
+		}
+		dr = next;
+	}
+}
+
+/*
+ * Queue r in answer to a question in m.  A QU question gets a unicast
+ * reply, unless r has not been multicast within a quarter of its TTL,
+ * then everyone may as well hear it, RFC 6762 §5.4.
+ */
+static void _r_answer(mdns_daemon_t *d, struct message *m, mdns_record_t *r, const inet_addr_t *from, int qu)
+{
+	if (m->header.tc) {
+		_tc_defer(d, r, from);
+		return;
+	}
+
+	if (qu && r->tries >= 4 && r->last_sent.tv_sec &&
+	    _tvdiff(r->last_sent, d->now) < (long)r->rr.ttl * 250000) {
+		_u_push(d, r, 0, from, 1);
+		return;
+	}
+
+	if (_r_send(d, r, m->nscount > 0))
+		d->stats.ratelimited++;
+}
+
 static void _q_reset(mdns_daemon_t *d, struct query *q)
 {
 	struct cached *cur = 0;
@@ -380,23 +815,37 @@ static void _q_reset(mdns_daemon_t *d, struct query *q)
 	q->tries = 0;
 
 	while ((cur = _c_next(d, cur, q->name, q->type))) {
-		if (q->nexttry == 0 || cur->rr.ttl - 7 < q->nexttry)
-			q->nexttry = cur->rr.ttl - 7;
+		if (q->nexttry == 0 || cur->ttl - 7 < q->nexttry)
+			q->nexttry = cur->ttl - 7;
 	}
 
 	if (q->nexttry != 0 && q->nexttry < d->checkqlist)
 		d->checkqlist = q->nexttry;
 }
 
+/*
+ * The query is going away, hand its cached entries to the peer's query
+ * for the same name and type, if any.  Entries of a shared cache belong
+ * to the query of the context that cached them.
+ */
+static void _c_orphan(mdns_daemon_t *d, struct query *q)
+{
+	struct cached *c = NULL;
+
+	while ((c = _c_next(d, c, q->name, q->type))) {
+		if (c->q == q)
+			c->q = d->peer ? _q_next(d->peer, NULL, q->name, q->type) : NULL;
+	}
+}
+
 /* No more queries, update all its cached entries, remove from lists */
 static void _q_done(mdns_daemon_t *d, struct query *q)
 {
-	struct cached *c = 0;
 	struct query *cur;
-	int i = _namehash(q->name) % SPRIME;
+	int i = q->hash % SPRIME;
 
-	while ((c = _c_next(d, c, q->name, q->type)))
-		c->q = 0;
+	_c_orphan(d, q);
+	_bloom_update(d, q->hash, -1);
 
 	if (d->qlist == q) {
 		d->qlist = q->list;
@@ -420,76 +869,260 @@ static void _q_done(mdns_daemon_t *d, struct query *q)
 
 static void _free_cached(struct cached *c)
 {
-	if (!c)
-		return;
-
-	if (c->rr.name) {
-		free(c->rr.name);
-		c->rr.name = NULL;
-	}
-	if (c->rr.rdata) {
-		free(c->rr.rdata);
-		c->rr.rdata = NULL;
-	}
-	if (c->rr.rdname) {
-		free(c->rr.rdname);
-		c->rr.rdname = NULL;
-	}
 	free(c);
 }
 
-static void _free_record(mdns_record_t *r)
+/* Materialize the public view of a cached entry, valid as long as it is */
+static mdns_answer_t *_c_view(struct cached *c, mdns_answer_t *a)
 {
-	if (!r)
-		return;
+	memset(a, 0, sizeof(*a));
+	a->name  = c->name;
+	a->type  = c->type;
+	a->ttl   = c->ttl;
+	a->rdlen = c->rdlen;
+	if (c->rdlen)
+		a->rdata = (unsigned char *)c->name + c->rdata;
+	if (c->rdname)
+		a->rdname = c->name + c->rdname;
 
-	if (r->rr.name) {
-		free(r->rr.name);
-		r->rr.name = NULL;
-	}
-	if (r->rr.rdata) {
-		free(r->rr.rdata);
-		r->rr.rdata = NULL;
-	}
-	if (r->rr.rdname) {
-		free(r->rr.rdname);
-		r->rr.rdname = NULL;
-	}
-	free(r);
-}
+	switch (c->type) {
+	case QTYPE_A:
+		a->ip = c->u.ip;
+		break;
 
-/* buh-bye, remove from hash and free */
-static void _r_done(mdns_daemon_t *d, mdns_record_t *r)
-{
-	mdns_record_t *cur = 0;
-	int i;
+	case QTYPE_AAAA:
+		a->ip6 = c->u.ip6;
+		break;
 
-	if (!r || !r->rr.name)
-		return;
+	case QTYPE_NS:
+	case QTYPE_CNAME:
+	case QTYPE_PTR:
+		if (c->v6)
+			a->ip6 = c->u.ip6;
+		else
+			a->ip = c->u.ip;
+		break;
 
-	i = _namehash(r->rr.name) % SPRIME;
-	if (d->published[i] == r) {
-		d->published[i] = r->next;
-	} else {
-		for (cur = d->published[i]; cur && cur->next != r; cur = cur->next)
-			;
-		if (cur)
-			cur->next = r->next;
+	case QTYPE_SRV:
+		a->srv.priority = c->u.srv.priority;
+		a->srv.weight   = c->u.srv.weight;
+		a->srv.port     = c->u.srv.port;
+		break;
 	}
 
-	/* A queued unicast answer may still point at r; drop it first. */
-	_u_remove(d, r);
-
-	_free_record(r);
+	return a;
 }
 
-/* Call the answer function with this cached entry */
-static void _q_answer(mdns_daemon_t *d, struct cached *c)
-{
-	if (c->rr.ttl <= (unsigned long)d->now.tv_sec)
-		c->rr.ttl = 0;
-	if (c->q->answer(&c->rr, c->q->arg) == -1)
-		_q_done(d, c->q);
+/*
+ * Names and rdata of published records, interned and reference counted.
+ * Contexts attached to the same store share one copy of each, with its
+ * wire form.  Only the data is shared, each context still has its own
+ * records, and an update is made, and announced, in every context.  A
+ * context with no store keeps its own copies, outside any table.
+ */
+struct blob {
+	struct blob *next;
+	unsigned int hash;
+	unsigned int refs;
+	struct wire_name *wire;	/* Names only, pre-encoded */
+	unsigned short len;
+	char data[];		/* NUL terminated, for names */
+};
+
+struct mdnsd_store {
+	unsigned int refs;	/* Attached contexts, and the creator */
+	size_t count;		/* Blobs in the table */
+	struct blob *tab[STPRIME];
+};
+
+#define _s_blob(p) ((struct blob *)((char *)(p) - offsetof(struct blob, data)))
+
+/* A reference to @len bytes at @data with hash @h, a name if @name */
+static char *_s_get(mdnsd_store_t *s, const void *data, unsigned short len, unsigned int h, int name)
+{
+	struct blob *b;
+
+	if (s) {
+		for (b = s->tab[h % STPRIME]; b; b = b->next) {
+			if (b->hash == h && b->len == len && !b->wire == !name && !memcmp(b->data, data, len)) {
+				b->refs++;
+				return b->data;
+			}
+		}
+	}
+
+	b = malloc(sizeof(struct blob) + len + 1);
+	if (!b)
+		return NULL;
+
+	memcpy(b->data, data, len);
+	b->data[len] = 0;
+	b->wire = NULL;
+	if (name) {
+		b->wire = message_name_new(b->data);
+		if (!b->wire) {
+			free(b);
+			return NULL;
+		}
+	}
+	b->hash = h;
+	b->refs = 1;
+	b->len = len;
+	b->next = NULL;
+
+	if (s) {
+		b->next = s->tab[h % STPRIME];
+		s->tab[h % STPRIME] = b;
+		s->count++;
+	}
+
+	return b->data;
+}
+
+/* Drop a reference from _s_get(), the last one frees it */
+static void _s_put(mdnsd_store_t *s, const void *data)
+{
+	struct blob *b, **prev;
+
+	if (!data)
+		return;
+
+	b = _s_blob(data);
+	if (--b->refs)
+		return;
+
+	if (s) {
+		for (prev = &s->tab[b->hash % STPRIME]; *prev != b; prev = &(*prev)->next)
+			;
+		*prev = b->next;
+		s->count--;
+	}
+
+	free(b->wire);
+	free(b);
+}
+
+static void _free_record(mdns_daemon_t *d, mdns_record_t *r)
+{
+	if (!r)
+		return;
+
+	_s_put(d->store, r->rr.name);
+	_s_put(d->store, r->rr.rdata);
+	_s_put(d->store, r->rr.rdname);
+	free(r);
+}
+
+/*
+ * RFC 6763 §12 record graph.  Records with the same name form a ring, and
+ * records with an rdname (PTR, SRV, ...) point at one record of the ring
+ * named by it.  So a PTR leads to the instance's SRV and TXT, and a SRV to
+ * its host's A and AAAA, without searching the published hash.
+ */
+static int _r_referrer(int type)
+{
+	return type == QTYPE_PTR || type == QTYPE_SRV || type == QTYPE_NS || type == QTYPE_CNAME;
+}
+
+/* New record r, join the ring of its name, call before adding r to the hash */
+static void _r_link(mdns_daemon_t *d, mdns_record_t *r)
+{
+	mdns_record_t *x;
+
+	x = _r_next(d, NULL, r->rr.name, QTYPE_ANY);
+	if (x) {
+		r->same = x->same;
+		x->same = r;
+	} else {
+		/* First of its name, what any dangling referrers are looking for */
+		r->same = r;
+		for (x = d->referrers; x; x = x->lnext) {
+			if (!x->target && x->rr.rdname && !strcmp(x->rr.rdname, r->rr.name))
+				x->target = r;
+		}
+	}
+
+	if (_r_referrer(r->rr.type)) {
+		r->lnext = d->referrers;
+		d->referrers = r;
+	}
+}
+
+/* Point r at the records named by its (new) rdname */
+static void _r_retarget(mdns_daemon_t *d, mdns_record_t *r)
+{
+	r->target = r->rr.rdname ? _r_next(d, NULL, r->rr.rdname, QTYPE_ANY) : NULL;
+}
+
+/* Record r is being freed, leave the ring and move referrers on */
+static void _r_unlink(mdns_daemon_t *d, mdns_record_t *r)
+{
+	mdns_record_t *x, **xp, *next = NULL;
+
+	if (!r->same)
+		return;
+
+	if (r->same != r) {
+		next = r->same;
+		for (x = next; x->same != r; x = x->same)
+			;
+		x->same = next;
+	}
+	r->same = NULL;
+
+	for (xp = &d->referrers; (x = *xp);) {
+		if (x == r) {
+			*xp = x->lnext;
+			continue;
+		}
+		if (x->target == r)
+			x->target = next;
+		xp = &x->lnext;
+	}
+}
+
+/* buh-bye, remove from hash and free */
+static void _r_done(mdns_daemon_t *d, mdns_record_t *r)
+{
+	mdns_record_t *cur = 0;
+	int i;
+
+	if (!r || !r->rr.name)
+		return;
+
+	i = r->hash % SPRIME;
+	if (d->published[i] == r) {
+		d->published[i] = r->next;
+	} else {
+		for (cur = d->published[i]; cur && cur->next != r; cur = cur->next)
+			;
+		if (cur)
+			cur->next = r->next;
+	}
+
+	/* A queued unicast, held, or memoized answer may still point at r; drop it first. */
+	_u_remove(d, r);
+	_tc_remove(d, r);
+	_rc_forget(d, r);
+	_r_unlink(d, r);
+	_bloom_update(d, r->hash, -1);
+
+	_free_record(d, r);
+}
+
+/* Call the answer function with this cached entry */
+static void _q_answer(mdns_daemon_t *d, struct cached *c)
+{
+	mdns_answer_t a;
+
+	if (c->ttl <= (unsigned long)d->now.tv_sec)
+		c->ttl = 0;
+	if (c->q->answer(_c_view(c, &a), c->q->arg) == -1) {
+		/* The query may be the peer's, in a shared cache */
+		if (d->peer && _q_next(d, NULL, c->q->name, c->q->type) != c->q)
+			d = d->peer;
+		_q_done(d, c->q);
+	}
 }
 
 static void _conflict(mdns_daemon_t *d, mdns_record_t *r)
@@ -498,6 +1131,91 @@ static void _conflict(mdns_daemon_t *d, mdns_record_t *r)
 	mdnsd_done(d, r);
 }
 
+/* Hash of the host address, never 0 */
+static unsigned int _src_key(const inet_addr_t *from)
+{
+	unsigned int h;
+
+	if (inet_family(from) == AF_INET6)
+		h = memhash(&((const struct sockaddr_in6 *)from)->sin6_addr, sizeof(struct in6_addr));
+	else
+		h = memhash(&((const struct sockaddr_in *)from)->sin_addr, sizeof(struct in_addr));
+
+	return h ? h : 1;
+}
+
+/*
+ * Look up, or start tracking, the source of a packet.  The table is
+ * bounded: a new source takes a free slot, else the one of its slots
+ * heard from least recently, so sources age out.  Slots with entries in
+ * the cache are kept, if all are taken the source is not tracked, NULL.
+ *
+ * A source taking over a slot starts with one second's worth of tokens,
+ * not a full burst, or spoofing new addresses would refill the bucket.
+ */
+static struct source *_src_get(mdns_daemon_t *d, const inet_addr_t *from, struct timeval *now)
+{
+	unsigned int key = _src_key(from);
+	struct source *s, *old = NULL;
+	long tokens;
+	int i;
+
+	for (i = 0; i < SRC_PROBE; i++) {
+		s = &d->src[(key + i) % SRC_SLOTS];
+		if (s->key == key && inet_same_addr(&s->addr, from)) {
+			s->seen = now->tv_sec;
+			return s;
+		}
+
+		if (s->records)
+			continue;
+		if (!old || s->seen < old->seen)
+			old = s;
+	}
+
+	if (!old)
+		return NULL;
+
+	tokens = d->sburst * 1000L;
+	if (old->key && d->srate < d->sburst)
+		tokens = d->srate * 1000L;
+
+	s = old;
+	memset(s, 0, sizeof(*s));
+	s->key = key;
+	s->addr = *from;
+	s->tokens = tokens;
+	s->last = *now;
+	s->seen = now->tv_sec;
+
+	return s;
+}
+
+/* Cache entries from d's sources are no longer counted */
+static void _src_forget(mdns_daemon_t *d)
+{
+	struct cached *c;
+	int i;
+
+	for (i = 0; i < LPRIME; i++) {
+		for (c = d->cache[i]; c; c = c->next) {
+			if (c->src >= d->src && c->src < d->src + SRC_SLOTS)
+				c->src = NULL;
+		}
+	}
+}
+
+/* Bytes held by a cache entry, not counting allocator overhead */
+static size_t _c_size(struct cached *c)
+{
+	size_t len = sizeof(*c) + c->rdata + c->rdlen;
+
+	if (c->rdname)
+		len += strlen(c->name + c->rdname) + 1;
+
+	return len;
+}
+
 /* Expire any old entries in this list */
 static void _c_expire(mdns_daemon_t *d, struct cached **list)
 {
@@ -508,7 +1226,7 @@ static void _c_expire(mdns_daemon_t *d, struct cached **list)
 	while (cur) {
 		next = cur->next;
 
-		if ((unsigned long)d->now.tv_sec >= cur->rr.ttl) {
+		if ((unsigned long)d->now.tv_sec >= cur->ttl) {
 			if (last)
 				last->next = next;
 
@@ -519,6 +1237,17 @@ static void _c_expire(mdns_daemon_t *d, struct cached **list)
 			if (cur->q)
 				_q_answer(d, cur);
 
+			if (cur->src && cur->src->records)
+				cur->src->records--;
+
+			if (d->lcur == cur)
+				d->lcur = NULL;
+			d->stats.cache_bytes -= _c_size(cur);
+			if (d->peer) {
+				if (d->peer->lcur == cur)
+					d->peer->lcur = NULL;
+				d->peer->stats.cache_bytes -= _c_size(cur);
+			}
 			_free_cached(cur);
 		} else {
 			last = cur;
@@ -540,26 +1269,185 @@ static void _gc(mdns_daemon_t *d)
 	d->expireall = (unsigned long)(d->now.tv_sec + GC);
 }
 
-static int _cache(mdns_daemon_t *d, struct resource *r, const inet_addr_t *from)
+/* Earlier answer in m already flushed this (name, type) */
+static int _c_flushed(struct message *m, int i)
 {
-	unsigned long int ttl;
-	struct cached *c = 0;
-	int i = _namehash(r->name) % LPRIME;
+	struct resource *r = &m->an[i];
+	int j;
+
+	for (j = 0; j < i; j++) {
+		if (m->an[j].type == r->type && m->an[j].class == r->class &&
+		    m->an[j].ttl && m->an[j].name && !strcmp(m->an[j].name, r->name))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * RFC 6762 §10.2: a record with the cache-flush bit set replaces what we
+ * have for its (name, type).  Instead of dropping everything at once, and
+ * firing expire/add callbacks for records the same packet carries again,
+ * entries not received in the last second expire in one second.  The rest
+ * of the set is refreshed by then, only the stale ones actually go.  The
+ * cache counts whole seconds, so round up to at least one second.
+ */
+static void _c_flush(mdns_daemon_t *d, struct resource *r, unsigned int h)
+{
+	unsigned long int ttl = (unsigned long)d->now.tv_sec + 2;
+	struct cached *c;
+
+	for (c = _c_next_h(d, h, r->name, r->type); c; c = _c_next(d, c, r->name, r->type)) {
+		if (_tvdiff(c->rcvd, d->now) < 1000000)
+			continue;
+		if (c->ttl <= ttl)
+			continue;
+
+		c->ttl = ttl;
+		if (!d->cflush || ttl < d->cflush)
+			d->cflush = ttl;
+	}
+}
+
+/* Expire cache-flushed entries when their second is up */
+static void _c_sweep(mdns_daemon_t *d)
+{
+	int i;
+
+	if (!d->cflush || (unsigned long)d->now.tv_sec < d->cflush)
+		return;
 
-	/* Cache flush for unique entries */
-	if (r->class == 32768 + d->class) {
-		while ((c = _c_next(d, c, r->name, r->type)))
-			c->rr.ttl = 0;
-		_c_expire(d, &d->cache[i]);
+	d->cflush = 0;
+	for (i = 0; i < LPRIME; i++) {
+		if (d->cache[i])
+			_c_expire(d, &d->cache[i]);
+	}
+}
+
+/* Eviction order: unqueried first, then nearest expiry, then least recently heard */
+static int _c_evict_cmp(const void *a, const void *b)
+{
+	const struct cached *x = *(struct cached * const *)a;
+	const struct cached *y = *(struct cached * const *)b;
+
+	if (!x->q != !y->q)
+		return x->q ? 1 : -1;
+	if (x->ttl != y->ttl)
+		return x->ttl < y->ttl ? -1 : 1;
+	if (x->rcvd.tv_sec != y->rcvd.tv_sec)
+		return x->rcvd.tv_sec < y->rcvd.tv_sec ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Make room for @need more bytes within the cache budget.  Evicts down
+ * to 7/8 of the budget, so a flood of new names costs one sort per many
+ * entries, not a scan per entry.  Returns non-zero if there is no room.
+ */
+static int _c_evict(mdns_daemon_t *d, size_t need)
+{
+	size_t target = d->cbudget - d->cbudget / 8, freed = 0, n = 0, i;
+	struct cached **all, *c;
+	int j;
+
+	if (!d->cbudget || d->stats.cache_bytes + need <= d->cbudget)
+		return 0;
+	if (need > target)
+		return 1;
+
+	for (j = 0; j < LPRIME; j++) {
+		for (c = d->cache[j]; c; c = c->next)
+			n++;
+	}
+	all = malloc(n * sizeof(*all));
+	if (!all)
+		return 1;
+
+	n = 0;
+	for (j = 0; j < LPRIME; j++) {
+		for (c = d->cache[j]; c; c = c->next)
+			all[n++] = c;
+	}
+	qsort(all, n, sizeof(*all), _c_evict_cmp);
+
+	/* Mark victims expired, then let _c_expire() tell their queries */
+	for (i = 0; i < n && d->stats.cache_bytes - freed + need > target; i++) {
+		freed += _c_size(all[i]);
+		all[i]->ttl = 0;
+		d->stats.cache_evictions++;
 	}
+	free(all);
+
+	for (j = 0; j < LPRIME; j++) {
+		if (d->cache[j])
+			_c_expire(d, &d->cache[j]);
+	}
+
+	return 0;
+}
+
+/* Bit of the transport @d runs on, in struct cached seen */
+static unsigned char _c_transport(mdns_daemon_t *d)
+{
+	return d->family == AF_INET6 ? 2 : 1;
+}
 
-	/* Process deletes */
+/* The query for a cached entry, ours or the peer's in a shared cache */
+static struct query *_c_query(mdns_daemon_t *d, const char *name, int type)
+{
+	struct query *q;
+
+	q = _q_next(d, NULL, name, type);
+	if (!q && d->peer)
+		q = _q_next(d->peer, NULL, name, type);
+
+	return q;
+}
+
+/* Is a new record worth caching, see mdnsd_set_cache_policy() */
+static int _c_wanted(mdns_daemon_t *d, struct resource *r, unsigned int h)
+{
+	/* Neither published nor queried */
+	if (!_bloom_has(d, h))
+		return 0;
+
+	if (d->cpolicy == MDNSD_CACHE_OWN)
+		return _r_next_h(d, h, r->name, r->type) != NULL;
+
+	return _q_next_h(d, h, r->name, r->type) || _q_next_h(d, h, r->name, QTYPE_ANY);
+}
+
+static int _c_admit(mdns_daemon_t *d, struct resource *r, unsigned int h)
+{
+	if (d->cpolicy == MDNSD_CACHE_ALL)
+		return 1;
+
+	return _c_wanted(d, r, h) || (d->peer && _c_wanted(d->peer, r, h));
+}
+
+/* Cache r, with h its _namehash() */
+static int _cache(mdns_daemon_t *d, struct resource *r, unsigned int h, const inet_addr_t *from)
+{
+	struct source *src = NULL;
+	unsigned long int ttl;
+	size_t len;
+	struct cached *c = 0;
+	int i = h % LPRIME;
+	const char *rdname = NULL;
+	size_t nlen;
+	mdns_answer_t a;
+
+	/* Process deletes, gone when gone from all transports it was on */
 	if (r->ttl == 0) {
-		while ((c = _c_next(d, c, r->name, r->type))) {
-			if (_a_match(r, &c->rr)) {
-				c->rr.ttl = 0;
+		for (c = _c_next_h(d, h, r->name, r->type); c; c = _c_next(d, c, r->name, r->type)) {
+			if (_a_match(r, _c_view(c, &a))) {
+				c->seen &= ~_c_transport(d);
+				if (c->seen)
+					continue;
+				c->ttl = 0;
 				_c_expire(d, &d->cache[i]);
-				c = NULL;
+				break;
 			}
 		}
 
@@ -567,7 +1455,7 @@ static int _cache(mdns_daemon_t *d, struct resource *r, const inet_addr_t *from)
 	}
 
 	/*
-	 * XXX: The c->rr.ttl is a hack for now, BAD SPEC, start
+	 * XXX: The c->ttl is a hack for now, BAD SPEC, start
 	 *      retrying just after half-waypoint, then expire
 	 */
 	ttl = (unsigned long)d->now.tv_sec + (r->ttl / 2) + 8;
@@ -577,79 +1465,119 @@ static int _cache(mdns_daemon_t *d, struct resource *r, const inet_addr_t *from)
 	 * the rdata, not only name+type: a host can have several A/AAAA
 	 * records (e.g. a link-local and a global address), each its own entry.
 	 */
-	c = NULL;
-	while ((c = _c_next(d, c, r->name, r->type))) {
-		if (!_a_match(r, &c->rr))
+	for (c = _c_next_h(d, h, r->name, r->type); c; c = _c_next(d, c, r->name, r->type)) {
+		if (!_a_match(r, _c_view(c, &a)))
 			continue;
-		c->rr.ttl = ttl;
+		c->ttl = ttl;
+		c->rcvd = d->now;
+		c->seen |= _c_transport(d);
 		return 0;
 	}
 
-	/* New entry, cache it */
-	c = calloc(1, sizeof(struct cached));
-	if (!c)
-		return 1;
+	/* New entry, cache it, if it is of any use to us */
+	if (!_c_admit(d, r, h)) {
+		d->stats.cache_declined++;
+		return 0;
+	}
 
-	c->rr.name = strdup(r->name);
-	if (!c->rr.name) {
-		free(c);
-		return 1;
+	/* One host may not fill the cache */
+	if (d->srecords) {
+		src = _src_get(d, from, &d->now);
+		if (!src || src->records >= d->srecords) {
+			if (src)
+				src->declined++;
+			d->stats.cache_declined++;
+			return 0;
+		}
 	}
-	c->rr.type = r->type;
-	c->rr.ttl = ttl;
-	c->rr.rdlen = r->rdlength;
-	if (r->rdlength && !r->rdata) {
-//		ERR("rdlength is %d but rdata is NULL for domain name %s, type: %d, ttl: %ld", r->rdlength, r->name, r->type, r->ttl);
-		free(c->rr.name);
-		free(c);
+
+	if (r->rdlength && !r->rdata)
 		return 1;
+
+	switch (r->type) {
+	case QTYPE_NS:
+	case QTYPE_CNAME:
+	case QTYPE_PTR:
+		rdname = r->known.ns.name;
+		break;
+
+	case QTYPE_SRV:
+		rdname = r->known.srv.name;
+		break;
 	}
-	if (r->rdlength) {
-		c->rr.rdata = malloc(r->rdlength);
-		if (!c->rr.rdata) {
-			free(c->rr.name);
-			free(c);
-			return 1;
-		}
-		memcpy(c->rr.rdata, r->rdata, r->rdlength);
-	} else {
-		c->rr.rdata = NULL;
+
+	/* Offsets in name[] are 16 bits, plenty for anything off the wire */
+	nlen = strlen(r->name) + 1;
+	len  = sizeof(*c) + nlen + r->rdlength;
+	if (rdname)
+		len += strlen(rdname) + 1;
+
+	c = calloc(1, len);
+	if (!c)
+		return 1;
+
+	c->hash  = h;
+	c->type  = r->type;
+	c->seen  = _c_transport(d);
+	c->ttl   = ttl;
+	c->rcvd  = d->now;
+	c->rdlen = r->rdlength;
+	c->rdata = nlen;
+	memcpy(c->name, r->name, nlen);
+	if (r->rdlength)
+		memcpy(c->name + c->rdata, r->rdata, r->rdlength);
+	if (rdname) {
+		c->rdname = c->rdata + c->rdlen;
+		strcpy(c->name + c->rdname, rdname);
 	}
 
 	switch (r->type) {
 	case QTYPE_A:
-		c->rr.ip = r->known.a.ip;
+		c->u.ip = r->known.a.ip;
 		break;
 
 	case QTYPE_AAAA:
-		c->rr.ip6 = r->known.aaaa.ip6;
+		c->u.ip6 = r->known.aaaa.ip6;
 		break;
 
 	case QTYPE_NS:
 	case QTYPE_CNAME:
 	case QTYPE_PTR:
-		c->rr.rdname = strdup(r->known.ns.name);
 		/* Stash the responder address for mquery's device view */
 #ifdef ENABLE_IPV6
-		if (inet_family(from) == AF_INET6)
-			c->rr.ip6 = ((const struct sockaddr_in6 *)from)->sin6_addr;
-		else
+		if (inet_family(from) == AF_INET6) {
+			c->u.ip6 = ((const struct sockaddr_in6 *)from)->sin6_addr;
+			c->v6 = 1;
+		} else
 #endif
-			c->rr.ip = ((const struct sockaddr_in *)from)->sin_addr;
+			c->u.ip = ((const struct sockaddr_in *)from)->sin_addr;
 		break;
 
 	case QTYPE_SRV:
-		c->rr.rdname = strdup(r->known.srv.name);
-		c->rr.srv.port = r->known.srv.port;
-		c->rr.srv.weight = r->known.srv.weight;
-		c->rr.srv.priority = r->known.srv.priority;
+		c->u.srv.port = r->known.srv.port;
+		c->u.srv.weight = r->known.srv.weight;
+		c->u.srv.priority = r->known.srv.priority;
 		break;
 	}
 
+	/* Stay within budget, making room first */
+	if (_c_evict(d, len)) {
+		d->stats.cache_declined++;
+		_free_cached(c);
+		return 0;
+	}
+	d->stats.cache_bytes += len;
+	if (d->peer)
+		d->peer->stats.cache_bytes += len;
+	if (src) {
+		c->src = src;
+		src->records++;
+	}
+
 	c->next = d->cache[i];
 	d->cache[i] = c;
 
-	if ((c->q = _q_next(d, 0, r->name, r->type)))
+	if ((c->q = _c_query(d, r->name, r->type)))
 		_q_answer(d, c);
 
 	return 0;
@@ -684,33 +1612,106 @@ static void _a_copy(struct message *m, mdns_answer_t *a)
 }
 
 /*
- * RFC 6763 §12: when answering a PTR or SRV query, add the related SRV,
- * TXT and address records to the additional section so a client need not
- * query again.  See issue #76.  Records answered this round are tracked so
- * we never repeat one of them as an additional record.
+ * Append a record to a section of m, backing it out again if the packet
+ * outgrows the frame.  Record size depends on what the packet already
+ * holds for compression, so the encoder is the only exact measure.
+ * Returns 0 if appended, -1 if it did not fit.
  */
-#define ADDITIONAL_MAX 64
-struct answered {
-	mdns_record_t *rec[ADDITIONAL_MAX];
-	int n;
-};
-
-static void _answered_add(struct answered *a, mdns_record_t *r)
+static int _rr_put(mdns_daemon_t *d, struct message *m,
+		   void (*section)(struct message *, char *, unsigned short, unsigned short, unsigned long),
+		   char *name, unsigned short type, unsigned short class, unsigned long ttl, mdns_answer_t *a)
 {
-	if (a->n < ADDITIONAL_MAX)
-		a->rec[a->n++] = r;
+	struct message_mark mk;
+
+	message_mark(m, &mk);
+	section(m, name, type, class, ttl);
+	_a_copy(m, a);
+	if (message_packet_len(m) <= d->frame)
+		return 0;
+
+	message_rewind(m, &mk);
+	return -1;
 }
 
-static int _answered(const struct answered *a, const mdns_record_t *r)
+/* Copy the data bits of a published record, names pre-encoded */
+static void _r_copy(struct message *m, mdns_record_t *r)
 {
-	int i;
+	unsigned char srv[6], *p = srv;
 
-	for (i = 0; i < a->n; i++) {
-		if (a->rec[i] == r)
-			return 1;
+	if (!r->wrdname || !r->rr.rdname) {
+		_a_copy(m, &r->rr);
+		return;
 	}
 
-	return 0;
+	if (r->rr.type == QTYPE_SRV) {
+		short2net(r->rr.srv.priority, &p);
+		short2net(r->rr.srv.weight, &p);
+		short2net(r->rr.srv.port, &p);
+		message_rdata_wire(m, srv, sizeof(srv), r->wrdname);
+		return;
+	}
+
+	message_rdata_wire(m, NULL, 0, r->wrdname);
+}
+
+/* Like _rr_put(), for our own records */
+static int _r_put(mdns_daemon_t *d, struct message *m,
+		  void (*section)(struct message *, const struct wire_name *, unsigned short, unsigned short, unsigned long),
+		  mdns_record_t *r)
+{
+	struct message_mark mk;
+
+	message_mark(m, &mk);
+	section(m, r->wname, r->rr.type, d->class + (r->unique ? 32768 : 0), r->rr.ttl);
+	_r_copy(m, r);
+	if (message_packet_len(m) <= d->frame)
+		return 0;
+
+	message_rewind(m, &mk);
+	return -1;
+}
+
+/* Nothing but the header in m yet */
+static int _empty(struct message *m)
+{
+	return message_packet_len(m) <= 12;
+}
+
+/*
+ * RFC 6763 §12: when answering a PTR or SRV query, add the related SRV,
+ * TXT and address records to the additional section so a client need not
+ * query again.  See issue #76.  Records in the packet are chained in the
+ * order added and stamped with the packet, so we never repeat one of them
+ * as an additional record.
+ */
+struct answered {
+	unsigned long stamp;
+	mdns_record_t *head, *tail;
+	int n;
+};
+
+/* Start a new packet */
+static void _answered_init(mdns_daemon_t *d, struct answered *a)
+{
+	memset(a, 0, sizeof(*a));
+	a->stamp = ++d->stamp;
+}
+
+static void _answered_add(struct answered *a, mdns_record_t *r)
+{
+	r->stamp = a->stamp;
+	r->pnext = NULL;
+	if (a->tail)
+		a->tail->pnext = r;
+	else
+		a->head = r;
+	a->tail = r;
+	a->n++;
+}
+
+static int _answered(const struct answered *a, const mdns_record_t *r)
+{
+	return r->stamp == a->stamp;
 }
 
 /* Append one additional record, unless already in the packet or out of room */
@@ -718,88 +1719,219 @@ static void _ar(mdns_daemon_t *d, struct message *m, mdns_record_t *r, struct an
 {
 	if (_answered(seen, r))
 		return;
-	if (message_packet_len(m) + (int)_rr_len(&r->rr) >= d->frame)
+	if (_r_put(d, m, message_ar_wire, r))
 		return;
 
-	message_ar(m, r->rr.name, r->rr.type, d->class + (r->unique ? 32768 : 0), r->rr.ttl);
-	_a_copy(m, &r->rr);
 	_answered_add(seen, r);
 }
 
-/* Append the A/AAAA records for host to the additional section */
-static void _ar_addr(mdns_daemon_t *d, struct message *m, char *host, struct answered *seen)
+/* Append the A/AAAA records for the target host of srv */
+static void _ar_addr(mdns_daemon_t *d, struct message *m, mdns_record_t *srv, struct answered *seen)
 {
-	mdns_record_t *r;
+	mdns_record_t *r, *first = srv->target;
 
-	if (!host)
+	if (!(r = first))
 		return;
 
-	for (r = mdnsd_get_published(d, host); r; r = r->next) {
-		if (strcmp(r->rr.name, host))
-			continue;
+	do {
 		if (r->rr.type == QTYPE_A || r->rr.type == QTYPE_AAAA)
 			_ar(d, m, r, seen);
-	}
+		r = r->same;
+	} while (r != first);
 }
 
 /* RFC 6763 §12 additional records for an answered PTR or SRV record */
 static void _additional(mdns_daemon_t *d, struct message *m, mdns_record_t *ans, struct answered *seen)
 {
-	mdns_record_t *r;
+	mdns_record_t *r, *first = ans->target;
 
 	if (ans->rr.type == QTYPE_SRV) {
-		_ar_addr(d, m, ans->rr.rdname, seen);
+		_ar_addr(d, m, ans, seen);
 		return;
 	}
 
-	if (ans->rr.type != QTYPE_PTR || !ans->rr.rdname || !strcmp(ans->rr.name, DISCO_NAME))
+	if (ans->rr.type != QTYPE_PTR || !first || !strcmp(ans->rr.name, DISCO_NAME))
 		return;
 
-	for (r = mdnsd_get_published(d, ans->rr.rdname); r; r = r->next) {
-		if (strcmp(r->rr.name, ans->rr.rdname))
-			continue;
-
+	r = first;
+	do {
 		if (r->rr.type == QTYPE_SRV) {
 			_ar(d, m, r, seen);
-			_ar_addr(d, m, r->rr.rdname, seen);
+			_ar_addr(d, m, r, seen);
 		} else if (r->rr.type == QTYPE_TXT) {
 			_ar(d, m, r, seen);
 		}
+		r = r->same;
+	} while (r != first);
+}
+
+/* Expand the answers in the packet, not the additionals _ar() appends */
+static void _additionals(mdns_daemon_t *d, struct message *m, struct answered *seen)
+{
+	mdns_record_t *r = seen->head;
+	int i, n = seen->n;
+
+	for (i = 0; i < n; i++, r = r->pnext)
+		_additional(d, m, r, seen);
+}
+
+/*
+ * Reply to QU questions from one querier: no question and ID zero, like
+ * any mDNS response, with everything else queued for the same querier
+ * that fits, RFC 6762 §6.
+ */
+static void _u_out(mdns_daemon_t *d, struct message *m, struct unicast *u, struct answered *seen)
+{
+	struct unicast **up = &d->uanswers, *next;
+	mdns_record_t *r = u->r;
+
+	if (!_r_put(d, m, message_an_wire, r))
+		_answered_add(seen, r);
+
+	while ((next = *up) != NULL) {
+		if (!next->qu || !_u_same(&next->to, &u->to)) {
+			up = &next->next;
+			continue;
+		}
+
+		/* Full, the rest goes in the next packet */
+		r = next->r;
+		if (_r_put(d, m, message_an_wire, r))
+			break;
+
+		_answered_add(seen, r);
+		*up = next->next;
+		free(next);
 	}
 }
 
-/* Copy a published record into an outgoing message */
-static int _r_out(mdns_daemon_t *d, struct message *m, mdns_record_t **list, struct answered *seen)
+/*
+ * Output planner.  Pending records are ordered by the name they are about,
+ * compared label by label from the root, so a service type's PTRs, its
+ * instances' SRV and TXT, and each host's addresses go out together and
+ * compress against each other.  Packets are then filled first-fit, with
+ * exact sizes from the encoder, a record that does not fit is left for
+ * the next packet while smaller ones may still go in this one.
+ */
+static const struct wire_name *_plan_name(const mdns_record_t *r)
+{
+	if (r->rr.type == QTYPE_PTR && r->wrdname)
+		return r->wrdname;
+
+	return r->wname;
+}
+
+static int _plan_cmp(const mdns_record_t *ra, const mdns_record_t *rb)
+{
+	const struct wire_name *a = _plan_name(ra), *b = _plan_name(rb);
+	int i = a->n, j = b->n;
+
+	while (i > 0 && j > 0) {
+		const unsigned char *la = a->label + a->off[--i];
+		const unsigned char *lb = b->label + b->off[--j];
+		int rc;
+
+		rc = memcmp(la + 1, lb + 1, la[0] < lb[0] ? la[0] : lb[0]);
+		if (rc)
+			return rc;
+		if (la[0] != lb[0])
+			return la[0] - lb[0];
+	}
+
+	return i - j;
+}
+
+/* Stable merge sort of a ->list linked list */
+static mdns_record_t *_plan_sort(mdns_record_t *head, int n)
+{
+	mdns_record_t *a, *b, *r, **tail = &head;
+	int i;
+
+	if (n < 2) {
+		if (head)
+			head->list = NULL;
+		return head;
+	}
+
+	for (i = 1, r = head; i < n / 2; i++)
+		r = r->list;
+	b = r->list;
+	a = _plan_sort(head, n / 2);
+	b = _plan_sort(b, n - n / 2);
+
+	while (a && b) {
+		if (_plan_cmp(a, b) <= 0) {
+			*tail = a;
+			a = a->list;
+		} else {
+			*tail = b;
+			b = b->list;
+		}
+		tail = &(*tail)->list;
+	}
+	*tail = a ? a : b;
+
+	return head;
+}
+
+/* Order a list for output, unless already in order */
+static void _plan(mdns_record_t **list)
 {
 	mdns_record_t *r;
-	int ret = 0;
+	int n = 1, sorted = 1;
 
-	while ((r = *list) != NULL && message_packet_len(m) + (int)_rr_len(&r->rr) < d->frame) {
-		if (r != r->list)
-			*list = r->list;
-		else
-			*list = NULL;
+	if (!*list)
+		return;
 
-		/* Service enumeration/discovery, drop non-PTR replies */
-		if (d->disco) {
-			if (r->rr.type != QTYPE_PTR)
-				continue;
+	for (r = *list; r->list && r->list != r; r = r->list) {
+		if (sorted && _plan_cmp(r, r->list) > 0)
+			sorted = 0;
+		n++;
+	}
+	if (!sorted)
+		*list = _plan_sort(*list, n);
+}
 
-			if (strcmp(r->rr.name, DISCO_NAME))
+/* Copy published records from a list into an outgoing message */
+static int _r_out(mdns_daemon_t *d, struct message *m, mdns_record_t **list, struct answered *seen)
+{
+	mdns_record_t *r, **rp = list;
+	int ret = 0, misses = 0;
+
+	_plan(list);
+	while ((r = *rp) != NULL) {
+		int skip = 0;
+
+		/* Service enumeration/discovery, drop non-PTR replies */
+		if (d->disco && (r->rr.type != QTYPE_PTR || strcmp(r->rr.name, DISCO_NAME)))
+			skip = 1;
+		/* Went out some other way while queued */
+		else if (_r_recent(d, r, RATE_PROBE))
+			skip = 1;
+		else if (_r_put(d, m, message_an_wire, r)) {
+			/* Leave it for the next packet, unless it never fits */
+			if (!_empty(m)) {
+				if (++misses >= PLAN_MISSES || r == r->list)
+					break;
+				rp = &r->list;
 				continue;
+			}
+			WARN("Record %s type %d too large for %d byte frame, dropping.",
+			     r->rr.name, r->rr.type, d->frame);
+			skip = 1;
 		}
 
+		if (r != r->list)
+			*rp = r->list;
+		else
+			*rp = NULL;
+		if (skip)
+			continue;
+
 		INFO("Appending name: %s, type %d to outbound message ...", r->rr.name, r->rr.type);
 		ret++;
-
-		if (r->unique)
-			message_an(m, r->rr.name, r->rr.type, d->class + 32768, r->rr.ttl);
-		else
-			message_an(m, r->rr.name, r->rr.type, d->class, r->rr.ttl);
 		r->last_sent = d->now;
 
-		_a_copy(m, &r->rr);
-
 		r->modified = 0; /* If updated we've now sent the update. */
 		if (r->rr.ttl == 0) {
 			/*
@@ -816,6 +1948,355 @@ static int _r_out(mdns_daemon_t *d, struct message *m, mdns_record_t **list, str
 	return ret;
 }
 
+/*
+ * Append known answers for q, skipping the first @skip already sent.  If
+ * they do not all fit, set TC and leave the rest for a follow-on packet,
+ * RFC 6762 §7.2.  Returns the number of known answers appended.
+ */
+static int _ka_out(mdns_daemon_t *d, struct message *m, struct query *q, int skip)
+{
+	struct cached *c = NULL;
+	mdns_answer_t a;
+	int n = 0;
+
+	q->kamore = 0;
+	q->kasent = skip;
+	while ((c = _c_next(d, c, q->name, q->type)) != NULL) {
+		if (c->ttl <= (unsigned long)d->now.tv_sec + 8)
+			continue;
+		if (skip > 0) {
+			skip--;
+			continue;
+		}
+
+		if (_rr_put(d, m, message_an, q->name, (unsigned short)q->type, (unsigned short)d->class,
+			    c->ttl - (unsigned long)d->now.tv_sec, _c_view(c, &a))) {
+			/* Too big even for an empty packet, never going to fit */
+			if (_empty(m)) {
+				q->kasent++;
+				continue;
+			}
+
+			m->header.tc = 1;
+			q->kamore = 1;
+			d->kamore = 1;
+			break;
+		}
+
+		INFO("Add known answer: Name: %s, Type: %d", c->name, c->type);
+		q->kasent++;
+		n++;
+	}
+
+	return n;
+}
+
+/* Follow-on packet with known answers left over from a truncated query */
+static int _ka_more(mdns_daemon_t *d, struct message *m)
+{
+	struct query *q;
+	int ret = 0;
+
+	d->kamore = 0;
+	for (q = d->qlist; q != NULL; q = q->list) {
+		if (!q->kamore)
+			continue;
+
+		ret += _ka_out(d, m, q, q->kasent);
+		if (q->kamore)
+			break;
+	}
+
+	/* Unable to add anything, drop the rest rather than loop */
+	if (!ret) {
+		for (q = d->qlist; q != NULL; q = q->list)
+			q->kamore = 0;
+		d->kamore = 0;
+		m->header.tc = 0;
+	}
+
+	return ret;
+}
+
+/* Records a multicast query asks for, see _rc_answer() */
+struct rset {
+	mdns_record_t *rec[RCACHE_MAX];
+	int n, over;
+};
+
+/* Collect r for a memoized response, or answer it the regular way */
+static void _r_want(mdns_daemon_t *d, struct message *m, struct rset *set,
+		    mdns_record_t *r, const inet_addr_t *from, int qu)
+{
+	int i;
+
+	if (!set) {
+		_r_answer(d, m, r, from, qu);
+		return;
+	}
+
+	for (i = 0; i < set->n; i++) {
+		if (set->rec[i] == r)
+			return;
+	}
+
+	if (set->n < RCACHE_MAX) {
+		set->rec[set->n++] = r;
+		return;
+	}
+
+	set->over = 1;
+	_r_answer(d, m, r, from, qu);
+}
+
+static unsigned int _rc_hash(unsigned int h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/* Key for the questions in m, and the known answers they come with */
+static unsigned int _rc_key(struct message *m)
+{
+	unsigned int h = 2166136261u;	/* FNV-1a */
+	int i;
+
+	for (i = 0; i < m->qdcount; i++) {
+		h = _rc_hash(h, m->qd[i].name, strlen(m->qd[i].name) + 1);
+		h = _rc_hash(h, &m->qd[i].type, sizeof(m->qd[i].type));
+	}
+
+	for (i = 0; m->an && i < m->ancount; i++) {
+		struct resource *r = &m->an[i];
+
+		if (!r->name)
+			continue;
+
+		h = _rc_hash(h, r->name, strlen(r->name) + 1);
+		h = _rc_hash(h, &r->type, sizeof(r->type));
+		switch (r->type) {
+		case QTYPE_SRV:
+			if (r->known.srv.name)
+				h = _rc_hash(h, r->known.srv.name, strlen(r->known.srv.name));
+			h = _rc_hash(h, &r->known.srv.port, sizeof(r->known.srv.port));
+			break;
+
+		case QTYPE_PTR:
+		case QTYPE_NS:
+		case QTYPE_CNAME:
+			if (r->known.ns.name)
+				h = _rc_hash(h, r->known.ns.name, strlen(r->known.ns.name));
+			break;
+
+		default:
+			h = _rc_hash(h, r->rdata, r->rdlength);
+			break;
+		}
+	}
+
+	return h;
+}
+
+/* Serialize the answers in set, and their additional records, into e */
+static int _rc_build(mdns_daemon_t *d, struct response *e, struct rset *set)
+{
+	struct answered seen;
+	struct message *m;
+	mdns_record_t **rec, *r;
+	int i, len;
+
+	m = malloc(sizeof(*m));
+	if (!m)
+		return -1;
+	memset(m, 0, offsetof(struct message, _packet) + 12);
+
+	_answered_init(d, &seen);
+	for (i = 0; i < set->n; i++) {
+		if (_r_put(d, m, message_an_wire, set->rec[i])) {
+			free(m);
+			return -1;	/* Takes more than one packet */
+		}
+		_answered_add(&seen, set->rec[i]);
+	}
+	_additionals(d, m, &seen);
+
+	/* One allocation, records first, then the packet */
+	len = message_packet_len(m) - 12;
+	rec = malloc(seen.n * sizeof(*rec) + len);
+	if (!rec) {
+		free(m);
+		return -1;
+	}
+	for (i = 0, r = seen.head; r; r = r->pnext)
+		rec[i++] = r;
+	e->packet = (unsigned char *)(rec + seen.n);
+	memcpy(e->packet, m->_packet + 12, len);
+
+	free(e->rec);
+	e->rec = rec;
+	e->nan = set->n;
+	e->n = seen.n;
+	e->len = len;
+	e->ancount = m->ancount;
+	e->arcount = m->arcount;
+	e->gen = d->gen;
+	free(m);
+
+	return 0;
+}
+
+/*
+ * Answer a multicast query from its memoized response, keyed by the
+ * question set and known answers, built on first use.  Anything out of
+ * the ordinary, e.g., records still being announced or recently sent,
+ * takes the regular path.  Returns 0 if memoized, -1 if regular.
+ */
+static int _rc_answer(mdns_daemon_t *d, struct message *m, struct rset *set, const inet_addr_t *from)
+{
+	struct response *e = NULL;
+	unsigned int key;
+	int i, unique = 1;
+
+	for (i = 0; !set->over && i < set->n; i++) {
+		mdns_record_t *r = set->rec[i];
+
+		if (r->tries < 4 || !r->rr.ttl || _r_recent(d, r, RATE_LIMIT))
+			break;
+		if (!r->unique)
+			unique = 0;
+	}
+	if (set->over || i < set->n)
+		goto regular;
+
+	key = _rc_key(m);
+	for (i = 0; i < RCACHE; i++) {
+		struct response *c = &d->rcache[i];
+
+		if (c->rec && c->gen == d->gen && c->key == key) {
+			e = c;
+			break;
+		}
+		/* Replace a stale one, else the least recently used */
+		if (c->due)
+			continue;
+		if (!e || (e->rec && e->gen == d->gen && (c->gen != d->gen || c->used < e->used)))
+			e = c;
+	}
+	if (!e)
+		goto regular;	/* All queued */
+
+	if (e->key == key && e->gen == d->gen && e->nan == set->n &&
+	    !memcmp(e->rec, set->rec, set->n * sizeof(set->rec[0]))) {
+		d->stats.response_hits++;
+	} else {
+		d->stats.response_misses++;
+		if (e->due)
+			goto regular;	/* Other answers on their way, leave it be */
+		e->key = key;
+		if (_rc_build(d, e, set)) {
+			e->gen = d->gen - 1;
+			goto regular;
+		}
+	}
+	e->used = ++d->rused;
+
+	if (e->due)
+		return 0;	/* Already on its way */
+
+	if (unique) {
+		e->due = 1;
+	} else {
+		e->due = 2;
+		_r_pause(d);
+	}
+	d->rpending++;
+	return 0;
+
+regular:
+	for (i = 0; i < set->n; i++)
+		_r_answer(d, m, set->rec[i], from, 0);
+
+	return -1;
+}
+
+/* Next memoized response due, if any, into m */
+static int _rc_out(mdns_daemon_t *d, struct message *m)
+{
+	int i, j;
+
+	for (i = 0; i < RCACHE; i++) {
+		struct response *e = &d->rcache[i];
+
+		if (!e->due || (e->due == 2 && _tvdiff(d->now, d->pause) > 0))
+			continue;
+
+		e->due = 0;
+		d->rpending--;
+
+		/* Some went out another way meanwhile, send the rest regularly */
+		for (j = 0; j < e->nan; j++) {
+			if (_r_recent(d, e->rec[j], RATE_PROBE))
+				break;
+		}
+		if (j < e->nan) {
+			for (j = 0; j < e->nan; j++) {
+				mdns_record_t *r = e->rec[j];
+
+				if (_r_recent(d, r, RATE_PROBE))
+					continue;
+				_r_remove_lists(d, r, &d->a_now);
+				_r_push(&d->a_now, r);
+			}
+			continue;
+		}
+
+		INFO("Send memoized response, %d answers, %d additional", e->ancount, e->arcount);
+		memcpy(m->_packet + 12, e->packet, e->len);
+		m->_buf = m->_packet + 12 + e->len;
+		m->ancount = e->ancount;
+		m->arcount = e->arcount;
+
+		for (j = 0; j < e->nan; j++) {
+			mdns_record_t *r = e->rec[j];
+
+			r->last_sent = d->now;
+			if (d->a_now)
+				_r_remove_list(&d->a_now, r);
+			if (d->a_pause)
+				_r_remove_list(&d->a_pause, r);
+		}
+
+		return e->ancount;
+	}
+
+	return 0;
+}
+
+/* Usec until the first memoized response is due, or -1 if none */
+static long _rc_next(mdns_daemon_t *d)
+{
+	long usec = -1;
+	int i;
+
+	for (i = 0; d->rpending && i < RCACHE; i++) {
+		if (d->rcache[i].due == 1)
+			return 0;
+		if (d->rcache[i].due == 2) {
+			usec = _tvdiff(d->now, d->pause);
+			if (usec < 0)
+				usec = 0;
+		}
+	}
+
+	return usec;
+}
+
 /* Refresh the cached local interface addresses if needed (every ~5s) */
 static void _refresh_local_addrs(mdns_daemon_t *d, bool force)
 {
@@ -901,42 +2382,251 @@ static void mdns_mcast(inet_addr_t *to, sa_family_t family)
 	memset(to, 0, sizeof(*to));
 	to->ss_family = family;
 
-#ifdef ENABLE_IPV6
-	if (family == AF_INET6) {
-		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)to;
+#ifdef ENABLE_IPV6
+	if (family == AF_INET6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)to;
+
+		inet_pton(AF_INET6, "ff02::fb", &sin6->sin6_addr);
+		sin6->sin6_port = htons(5353);
+		return;
+	}
+#endif
+	((struct sockaddr_in *)to)->sin_addr.s_addr = inet_addr("224.0.0.251");
+	((struct sockaddr_in *)to)->sin_port        = htons(5353);
+}
+
+mdns_daemon_t *mdnsd_new(int class, int frame)
+{
+	mdns_daemon_t *d;
+
+	d = calloc(1, sizeof(struct mdns_daemon));
+	if (!d)
+		return NULL;
+
+	d->cache = calloc(LPRIME, sizeof(struct cached *));
+	if (!d->cache) {
+		free(d);
+		return NULL;
+	}
+
+	gettimeofday(&d->now, 0);
+	d->expireall = (unsigned long)d->now.tv_sec + GC;
+	d->class = class;
+	d->frame = frame;
+	d->family = AF_INET;
+	d->received_callback = NULL;
+	d->local_ifaddrs = NULL;
+	d->local_addrs_refreshed = 0;
+
+	return d;
+}
+
+void mdnsd_set_family(mdns_daemon_t *d, sa_family_t family)
+{
+	d->family = family;
+	if (d->mtu)
+		mdnsd_set_mtu(d, d->mtu);
+}
+
+void mdnsd_set_mtu(mdns_daemon_t *d, int mtu)
+{
+	int frame;
+
+	if (mtu <= 0)		/* Unknown, keep frame from mdnsd_new() */
+		return;
+	d->mtu = mtu;
+
+	/* Room for the IP and UDP headers */
+	frame = mtu - (d->family == AF_INET6 ? 40 : 20) - 8;
+	if (frame > MAX_FRAME_LEN)
+		frame = MAX_FRAME_LEN;
+	if (frame < 512)	/* RFC 1035, §2.3.4 */
+		frame = 512;
+
+	if (frame != d->frame)
+		DBG("Frame size %d => %d bytes, MTU %d", d->frame, frame, mtu);
+	d->frame = frame;
+}
+
+int mdnsd_get_frame(mdns_daemon_t *d)
+{
+	return d->frame;
+}
+
+void mdnsd_set_unicast_query(mdns_daemon_t *d, bool enable)
+{
+	d->qu = enable;
+}
+
+void mdnsd_set_cache_policy(mdns_daemon_t *d, mdnsd_cache_policy_t policy)
+{
+	d->cpolicy = policy;
+}
+
+void mdnsd_set_cache_budget(mdns_daemon_t *d, size_t bytes)
+{
+	d->cbudget = bytes;
+	_c_evict(d, 0);
+}
+
+int mdnsd_share_cache(mdns_daemon_t *d, mdns_daemon_t *peer)
+{
+	int i;
+
+	if (d == peer || d->peer || peer->peer) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < LPRIME; i++) {
+		if (d->cache[i]) {
+			errno = EBUSY;
+			return -1;
+		}
+	}
+
+	free(d->cache);
+	d->cache = peer->cache;
+	d->stats.cache_bytes = peer->stats.cache_bytes;
+	d->peer = peer;
+	peer->peer = d;
+
+	return 0;
+}
+
+mdnsd_store_t *mdnsd_store_new(void)
+{
+	mdnsd_store_t *s;
+
+	s = calloc(1, sizeof(*s));
+	if (s)
+		s->refs = 1;
+
+	return s;
+}
+
+void mdnsd_store_free(mdnsd_store_t *s)
+{
+	if (!s || --s->refs)
+		return;
+
+	free(s);
+}
+
+int mdnsd_set_store(mdns_daemon_t *d, mdnsd_store_t *s)
+{
+	int i;
+
+	/* Their names and rdata are in the old one */
+	for (i = 0; i < SPRIME; i++) {
+		if (d->published[i]) {
+			errno = EBUSY;
+			return -1;
+		}
+	}
+
+	if (s)
+		s->refs++;
+	mdnsd_store_free(d->store);
+	d->store = s;
+
+	return 0;
+}
+
+void mdnsd_set_source_limit(mdns_daemon_t *d, unsigned int rate, unsigned int burst, unsigned int records)
+{
+	d->srate = rate;
+	d->sburst = burst > 0 ? burst : 1;
+	d->srecords = records;
+	_src_forget(d);
+	memset(d->src, 0, sizeof(d->src));
+	memset(&d->spill, 0, sizeof(d->spill));
+}
+
+bool mdnsd_admit(mdns_daemon_t *d, const inet_addr_t *from)
+{
+	struct timeval now;
+	struct source *s;
+	long ms;
+
+	if (!d->srate)
+		return true;
+
+	gettimeofday(&now, NULL);
+	s = _src_get(d, from, &now);
+	if (!s)
+		s = &d->spill;
+	s->packets++;
+
+	/* Refill, rate tokens/sec is rate 1/1000 tokens per msec */
+	ms = (now.tv_sec - s->last.tv_sec) * 1000 + (now.tv_usec - s->last.tv_usec) / 1000;
+	if (ms > 0) {
+		s->tokens += ms * d->srate;
+		if (s->tokens >= d->sburst * 1000L) {
+			s->tokens = d->sburst * 1000L;
+			s->shedding = 0;	/* Calmed down, log next time */
+		}
+		s->last = now;
+	}
+
+	if (s->tokens >= 1000) {
+		s->tokens -= 1000;
+		return true;
+	}
+
+	s->dropped++;
+	d->stats.shed++;
+	if (!s->shedding) {
+		char buf[INET_ADDRSTR_LEN];
+
+		s->shedding = 1;
+		NOTE("Shedding packets from %s, over %u/sec", inet_ntop2(from, buf, sizeof(buf)), d->srate);
+	}
+
+	return false;
+}
+
+static int _src_cmp(const void *a, const void *b)
+{
+	const mdnsd_source_t *x = a, *y = b;
+	unsigned long nx = x->dropped + x->declined, ny = y->dropped + y->declined;
+
+	if (nx != ny)
+		return nx > ny ? -1 : 1;
 
-		inet_pton(AF_INET6, "ff02::fb", &sin6->sin6_addr);
-		sin6->sin6_port = htons(5353);
-		return;
-	}
-#endif
-	((struct sockaddr_in *)to)->sin_addr.s_addr = inet_addr("224.0.0.251");
-	((struct sockaddr_in *)to)->sin_port        = htons(5353);
+	return 0;
 }
 
-mdns_daemon_t *mdnsd_new(int class, int frame)
+int mdnsd_get_offenders(mdns_daemon_t *d, mdnsd_source_t *list, int max)
 {
-	mdns_daemon_t *d;
+	mdnsd_source_t all[SRC_SLOTS];
+	int i, n = 0;
 
-	d = calloc(1, sizeof(struct mdns_daemon));
-	if (!d)
-		return NULL;
+	for (i = 0; i < SRC_SLOTS; i++) {
+		struct source *s = &d->src[i];
 
-	gettimeofday(&d->now, 0);
-	d->expireall = (unsigned long)d->now.tv_sec + GC;
-	d->class = class;
-	d->frame = frame;
-	d->family = AF_INET;
-	d->received_callback = NULL;
-	d->local_ifaddrs = NULL;
-	d->local_addrs_refreshed = 0;
+		if (!s->key || (!s->dropped && !s->declined))
+			continue;
 
-	return d;
+		all[n].addr     = s->addr;
+		all[n].packets  = s->packets;
+		all[n].dropped  = s->dropped;
+		all[n].declined = s->declined;
+		all[n].records  = s->records;
+		n++;
+	}
+	qsort(all, n, sizeof(all[0]), _src_cmp);
+
+	if (n > max)
+		n = max;
+	memcpy(list, all, n * sizeof(all[0]));
+
+	return n;
 }
 
-void mdnsd_set_family(mdns_daemon_t *d, sa_family_t family)
+void mdnsd_get_stats(mdns_daemon_t *d, mdnsd_stats_t *stats)
 {
-	d->family = family;
+	*stats = d->stats;
 }
 
 void mdnsd_set_address(mdns_daemon_t *d, struct in_addr addr)
@@ -946,6 +2636,8 @@ void mdnsd_set_address(mdns_daemon_t *d, struct in_addr addr)
 	if (!memcmp(&d->addr, &addr, sizeof(d->addr)))
 		return;		/* No change */
 
+	_rc_stale(d);
+
 	for (i = 0; i < SPRIME; i++) {
 		mdns_record_t *r, *next;
 
@@ -982,6 +2674,8 @@ void mdnsd_set_ipv6_address(mdns_daemon_t *d, struct in6_addr addr)
 	if (!memcmp(&d->addr_v6, &addr, sizeof(d->addr_v6)))
 		return;		/* No change */
 
+	_rc_stale(d);
+
 	for (i = 0; i < SPRIME; i++) {
 		mdns_record_t *r, *next;
 
@@ -1020,6 +2714,7 @@ void mdnsd_shutdown(mdns_daemon_t *d)
 	if (!d)
 		return;
 
+	_rc_drop(d);
 	d->a_now = 0;
 	for (i = 0; i < SPRIME; i++) {
 		for (cur = d->published[i]; cur != 0;) {
@@ -1051,16 +2746,29 @@ void mdnsd_free(mdns_daemon_t *d)
 	if (!d)
 		return;
 
-	for (size_t i = 0; i< LPRIME; i++) {
-		struct cached *cur = d->cache[i];
+	/* A shared cache stays with the peer, less our queries and transport */
+	if (d->peer) {
+		_src_forget(d);
+		for (struct query *q = d->qlist; q; q = q->list)
+			_c_orphan(d, q);
+		for (size_t i = 0; i < LPRIME; i++) {
+			for (struct cached *cur = d->cache[i]; cur; cur = cur->next)
+				cur->seen &= ~_c_transport(d);
+		}
+		d->peer->peer = NULL;
+	} else {
+		for (size_t i = 0; i< LPRIME; i++) {
+			struct cached *cur = d->cache[i];
 
-		while (cur) {
-			struct cached *next = cur->next;
+			while (cur) {
+				struct cached *next = cur->next;
 
-			cur->next = NULL;
-			_free_cached(cur);
-			cur = next;
+				cur->next = NULL;
+				_free_cached(cur);
+				cur = next;
+			}
 		}
+		free(d->cache);
 	}
 
 	for (size_t i = 0; i< SPRIME; i++) {
@@ -1071,7 +2779,7 @@ void mdnsd_free(mdns_daemon_t *d)
 			struct mdns_record *next = cur->next;
 
 			cur->next = NULL;
-			_free_record(cur);
+			_free_record(d, cur);
 			cur = next;
 		}
 
@@ -1095,9 +2803,20 @@ void mdnsd_free(mdns_daemon_t *d)
 		u = next;
 	}
 
+	while (d->deferred) {
+		struct deferred *next = d->deferred->next;
+
+		free(d->deferred);
+		d->deferred = next;
+	}
+
+	for (size_t i = 0; i < RCACHE; i++)
+		free(d->rcache[i].rec);
+
 	if (d->local_ifaddrs)
 		freeifaddrs(d->local_ifaddrs);
 
+	mdnsd_store_free(d->store);
 	free(d);
 }
 
@@ -1111,7 +2830,9 @@ void mdnsd_register_receive_callback(mdns_daemon_t *d, mdnsd_record_received_cal
 int mdnsd_in(mdns_daemon_t *d, struct message *m, const inet_addr_t *from)
 {
 	mdns_record_t *r = NULL;
-	int i, j;
+	struct rset rs, *set = NULL;
+	int i, j, qu, disco = 0;
+	unsigned int h;
 	bool did_addr_refresh = false;
 
 	if (d->shutdown)
@@ -1124,6 +2845,25 @@ int mdnsd_in(mdns_daemon_t *d, struct message *m, const inet_addr_t *from)
 		return 0;
 
 	if (m->header.qr == 0) {
+		/* Known answers continuing a truncated query, RFC 6762 §7.2 */
+		if (m->qdcount == 0) {
+			if (m->an && m->ancount)
+				_tc_known(d, m, from);
+			return 0;
+		}
+
+		/* Plain multicast queries can be answered from memoized responses */
+		if (!m->header.tc && !m->nscount && inet_port(from) == 5353) {
+			for (i = 0; m->qd && i < m->qdcount; i++) {
+				if (m->qd[i].unicast)
+					break;
+			}
+			if (i == m->qdcount) {
+				memset(&rs, 0, sizeof(rs));
+				set = &rs;
+			}
+		}
+
 		/* Process each query */
 		for (i = 0; i < m->qdcount; i++) {
 			mdns_record_t *r_start, *r_next;
@@ -1131,18 +2871,22 @@ int mdnsd_in(mdns_daemon_t *d, struct message *m, const inet_addr_t *from)
 
 			if (!m->qd || m->qd[i].class != d->class)
 				continue;
+			h = _namehash(m->qd[i].name);
+			if (!_bloom_has(d, h))
+				continue;
+			qu = m->qd[i].unicast;
 
 			INFO("Query for %s of type %d ...", m->qd[i].name, m->qd[i].type);
-			r = _r_next(d, NULL, m->qd[i].name, m->qd[i].type);
+			r = _r_next_h(d, h, m->qd[i].name, m->qd[i].type);
 			if (!r)
 				continue;
 
 			/* Service enumeration/discovery prepare to send all matching records */
 			if (!strcmp(m->qd[i].name, DISCO_NAME)) {
-				d->disco = 1;
+				disco = 1;
 				while (r) {
 					if (!strcmp(r->rr.name, DISCO_NAME))
-						_r_send(d, r);
+						_r_want(d, m, set, r, from, qu);
 					r = _r_next(d, r, m->qd[i].name, m->qd[i].type);
 				}
 
@@ -1196,15 +2940,21 @@ int mdnsd_in(mdns_daemon_t *d, struct message *m, const inet_addr_t *from)
 				INFO("Should we send answer? j: %d, m->ancount: %d", j, m->ancount);
 				if (j == m->ancount) {
 					INFO("Yes we should, enquing %s for outbound", r->rr.name);
-					_r_send(d, r);
+					_r_want(d, m, set, r, from, qu);
 				}
 			}
 
 			/* Send the matching unicast reply */
 			if (!has_conflict && inet_port(from) != 5353)
-				_u_push(d, r_start, m->id, from);
+				_u_push(d, r_start, m->id, from, 0);
 		}
 
+		if (set && set->n && !_rc_answer(d, m, set, from))
+			disco = 0;
+		/* Regular answers to service enumeration/discovery, PTR only */
+		if (disco)
+			d->disco = 1;
+
 		return 0;
 	}
 
@@ -1220,7 +2970,8 @@ int mdnsd_in(mdns_daemon_t *d, struct message *m, const inet_addr_t *from)
 		}
 
 		INFO("Got Answer: Name: %s, Type: %d", m->an[i].name, m->an[i].type);
-		r = _r_next(d, NULL, m->an[i].name, m->an[i].type);
+		h = _namehash(m->an[i].name);
+		r = _bloom_has(d, h) ? _r_next_h(d, h, m->an[i].name, m->an[i].type) : NULL;
 		if (r && r->unique && r->modified && _a_match(&m->an[i], &r->rr)) {
 			/* double check, is this actually from us, looped back? */
 			if (!did_addr_refresh) {
@@ -1235,7 +2986,11 @@ int mdnsd_in(mdns_daemon_t *d, struct message *m, const inet_addr_t *from)
 		if (d->received_callback)
 			d->received_callback(&m->an[i], d->received_callback_data);
 
-		if (_cache(d, &m->an[i], from) != 0) {
+		/* Cache flush for unique entries, once per (name, type) in m */
+		if (m->an[i].class == 32768 + d->class && m->an[i].ttl && !_c_flushed(m, i))
+			_c_flush(d, &m->an[i], h);
+
+		if (_cache(d, &m->an[i], h, from) != 0) {
 			ERR("Failed caching answer, possibly too long packet, skipping.");
 			continue;
 		}
@@ -1247,18 +3002,26 @@ int mdnsd_in(mdns_daemon_t *d, struct message *m, const inet_addr_t *from)
 int mdnsd_out(mdns_daemon_t *d, struct message *m, inet_addr_t *to)
 {
 	mdns_record_t *r;
-	struct answered seen = { 0 };
+	struct answered seen;
 	int ret = 0;
 
 	gettimeofday(&d->now, 0);
-	memset(m, 0, sizeof(struct message));
+	/* The encoder writes everything past the header, no need to clear it */
+	memset(m, 0, offsetof(struct message, _packet) + 12);
+
+	/* Cache-flushed entries due to expire */
+	_c_sweep(d);
 
 	/* Defaults, multicast */
 	mdns_mcast(to, d->family);
 	m->header.qr = 1;
 	m->header.aa = 1;
+	_answered_init(d, &seen);
 
-	/* Send out individual unicast answers */
+	/*
+	 * Send out unicast answers.  Note, last_sent tracks multicast only,
+	 * it is what decides if a QU question can be answered by unicast.
+	 */
 	if (d->uanswers) {
 		struct unicast *u = d->uanswers;
 
@@ -1266,32 +3029,71 @@ int mdnsd_out(mdns_daemon_t *d, struct message *m, inet_addr_t *to)
 
 		d->uanswers = u->next;
 		*to = u->to;
-		m->id = u->id;
-		message_qd(m, u->r->rr.name, u->r->rr.type, d->class);
-		message_an(m, u->r->rr.name, u->r->rr.type, d->class, u->r->rr.ttl);
-		u->r->last_sent = d->now;
-		_a_copy(m, &u->r->rr);
-
-		/* RFC 6763 §12 additional records for the unicast answer */
-		_answered_add(&seen, u->r);
-		_additional(d, m, u->r, &seen);
+		if (u->qu) {
+			_u_out(d, m, u, &seen);
+		} else {
+			/* Legacy unicast, echo ID and question, RFC 6762 §6.7 */
+			m->id = u->id;
+			message_qd(m, u->r->rr.name, u->r->rr.type, d->class);
+			message_an_wire(m, u->r->wname, u->r->rr.type, d->class, u->r->rr.ttl);
+			_r_copy(m, u->r);
+			_answered_add(&seen, u->r);
+		}
 		free(u);
 
+		/* RFC 6763 §12 additional records for the unicast answers */
+		_additionals(d, m, &seen);
+
 		return 1;
 	}
 
+	/* Answers held for truncated queries, now due */
+	if (d->deferred)
+		_tc_release(d);
+
+	/* Memoized responses, already complete packets */
+	if (d->rpending && !d->shutdown && (ret = _rc_out(d, m)))
+		return ret;
+
 	/* Accumulate any immediate responses */
 	if (d->a_now)
 		ret += _r_out(d, m, &d->a_now, &seen);
 
-	/* Check if it's time to send the publish retries (unlink if done) */
+	/*
+	 * Check if it's time to send the publish retries (unlink if done).
+	 * A round spans as many back-to-back packets as it takes to send
+	 * every record once, records sent since d->publish are skipped.
+	 */
 	if (!d->probing && d->a_publish && _tvdiff(d->now, d->publish) <= 0) {
-		mdns_record_t *cur = d->a_publish;
-		mdns_record_t *last = NULL;
-		mdns_record_t *next;
+		mdns_record_t *cur, *last = NULL, *next;
+		int full = 0, misses = 0;
+
+		_plan(&d->a_publish);
+		cur = d->a_publish;
+		while (cur) {
+			int drop = 0;
+
+			next = cur->list;
+			if (_tvdiff(d->publish, cur->last_sent) >= 0 || _r_recent(d, cur, RATE_LIMIT)) {
+				last = cur;
+				cur = next;
+				continue;
+			}
 
-		while (cur && message_packet_len(m) + (int)_rr_len(&cur->rr) < d->frame) {
-			if (cur->rr.type == QTYPE_PTR) {
+			if (_r_put(d, m, message_an_wire, cur)) {
+				/* Next packet, smaller ones may still fit in this one */
+				if (!_empty(m)) {
+					full = 1;
+					if (++misses >= PLAN_MISSES)
+						break;
+					last = cur;
+					cur = next;
+					continue;
+				}
+				WARN("Record %s type %d too large for %d byte frame, not announced.",
+				     cur->rr.name, cur->rr.type, d->frame);
+				drop = 1;
+			} else if (cur->rr.type == QTYPE_PTR) {
 				INFO("Send Publish PTR: Name: %s, rdlen: %d, rdata: %s, rdname: %s", cur->rr.name,cur->rr.rdlen, cur->rr.rdata, cur->rr.rdname);
 			} else if (cur->rr.type == QTYPE_SRV) {
 				INFO("Send Publish SRV: Name: %s, rdlen: %d, rdata: %s, rdname: %s, port: %d, prio: %d, weight: %d", cur->rr.name,cur->rr.rdlen, cur->rr.rdname, cur->rr.rdata, cur->rr.srv.port, cur->rr.srv.priority, cur->rr.srv.weight);
@@ -1299,20 +3101,15 @@ int mdnsd_out(mdns_daemon_t *d, struct message *m, inet_addr_t *to)
 				INFO("Send Publish: Name: %s, Type: %d, rdname: %s", cur->rr.name, cur->rr.type, cur->rr.rdname);
 			}
 
-			next = cur->list;
-			ret++;
-			cur->tries++;
-
-			if (cur->unique)
-				message_an(m, cur->rr.name, cur->rr.type, d->class + 32768, cur->rr.ttl);
-			else
-				message_an(m, cur->rr.name, cur->rr.type, d->class, cur->rr.ttl);
-			_a_copy(m, &cur->rr);
-			cur->last_sent = d->now;
-			if (cur->rr.ttl != 0)
-				_answered_add(&seen, cur);
+			if (!drop) {
+				ret++;
+				cur->tries++;
+				cur->last_sent = d->now;
+				if (cur->rr.ttl != 0)
+					_answered_add(&seen, cur);
+			}
 
-			if (cur->rr.ttl != 0 && cur->tries < 4) {
+			if (!drop && cur->rr.ttl != 0 && cur->tries < 4) {
 				last = cur;
 				cur = next;
 				continue;
@@ -1328,7 +3125,7 @@ int mdnsd_out(mdns_daemon_t *d, struct message *m, inet_addr_t *to)
 			cur = next;
 		}
 
-		if (d->a_publish) {
+		if (d->a_publish && !full) {
 			d->publish.tv_sec = d->now.tv_sec + 2;
 			d->publish.tv_usec = d->now.tv_usec;
 		}
@@ -1342,9 +3139,8 @@ int mdnsd_out(mdns_daemon_t *d, struct message *m, inet_addr_t *to)
 	if (d->a_pause && _tvdiff(d->now, d->pause) <= 0)
 		ret += _r_out(d, m, &d->a_pause, &seen);
 
-	/* RFC 6763 §12: expand the answers, not the additionals _ar() appends */
-	for (int i = 0, n = seen.n; i < n; i++)
-		_additional(d, m, seen.rec[i], &seen);
+	/* RFC 6763 §12 additional records */
+	_additionals(d, m, &seen);
 
 	/* Now process questions */
 	if (ret)
@@ -1353,6 +3149,10 @@ int mdnsd_out(mdns_daemon_t *d, struct message *m, inet_addr_t *to)
 	m->header.qr = 0;
 	m->header.aa = 0;
 
+	/* Known answers that did not fit the previous query packet */
+	if (d->kamore && (ret = _ka_more(d, m)))
+		return ret;
+
 	if (d->probing && _tvdiff(d->now, d->probe) <= 0) {
 		mdns_record_t *last = 0;
 
@@ -1377,19 +3177,21 @@ int mdnsd_out(mdns_daemon_t *d, struct message *m, inet_addr_t *to)
 			INFO("Send Probing: Name: %s, Type: %d", r->rr.name, r->rr.type);
 
 			message_qd(m, r->rr.name, r->rr.type, (unsigned short)d->class);
-			r->last_sent = d->now;
 			last = r;
 			r = r->list;
 		}
 
-		/* Scan probe list again to append our to-be answers */
+		/*
+		 * Scan probe list again to append our to-be answers.  Probes do
+		 * not count toward the multicast rate limit, last_sent is left
+		 * alone so the first announcement follows at once, RFC 6762 §8.3
+		 */
 		for (r = d->probing; r != 0; r = r->list) {
 			r->unique++;
 
 			INFO("Send Answer in Probe: Name: %s, Type: %d", r->rr.name, r->rr.type);
-			message_ns(m, r->rr.name, r->rr.type, (unsigned short)d->class, r->rr.ttl);
-			_a_copy(m, &r->rr);
-			r->last_sent = d->now;
+			message_ns_wire(m, r->wname, r->rr.type, (unsigned short)d->class, r->rr.ttl);
+			_r_copy(m, r);
 			ret++;
 		}
 
@@ -1404,14 +3206,15 @@ int mdnsd_out(mdns_daemon_t *d, struct message *m, inet_addr_t *to)
 	/* Process qlist for retries or expirations */
 	if (d->checkqlist && (unsigned long)d->now.tv_sec >= d->checkqlist) {
 		struct query *q;
-		struct cached *c;
 		unsigned long int nextbest = 0;
 
 		/* Ask questions first, track nextbest time */
 		for (q = d->qlist; q != 0; q = q->list) {
-			if (q->nexttry > 0 && q->nexttry <= (unsigned long)d->now.tv_sec && q->tries < 3)
-				message_qd(m, q->name, q->type, d->class);
-			else if (q->nexttry > 0 && (nextbest == 0 || q->nexttry < nextbest))
+			if (q->nexttry > 0 && q->nexttry <= (unsigned long)d->now.tv_sec && q->tries < 3) {
+				/* Only the first one, later ones refresh everyone's caches */
+				message_qd(m, q->name, q->type, d->class | (d->qu && !q->asked ? QCLASS_QU : 0));
+				q->asked = 1;
+			} else if (q->nexttry > 0 && (nextbest == 0 || q->nexttry < nextbest))
 				nextbest = q->nexttry;
 		}
 
@@ -1422,7 +3225,7 @@ int mdnsd_out(mdns_daemon_t *d, struct message *m, inet_addr_t *to)
 
 			/* Done retrying, expire and reset */
 			if (q->tries == 3) {
-				_c_expire(d, &d->cache[_namehash(q->name) % LPRIME]);
+				_c_expire(d, &d->cache[q->hash % LPRIME]);
 				_q_reset(d, q);
 				continue;
 			}
@@ -1432,14 +3235,12 @@ int mdnsd_out(mdns_daemon_t *d, struct message *m, inet_addr_t *to)
 			if (nextbest == 0 || q->nexttry < nextbest)
 				nextbest = q->nexttry;
 
-			/* If room, add all known good entries */
-			c = 0;
-			while ((c = _c_next(d, c, q->name, q->type)) != 0 && c->rr.ttl > (unsigned long)d->now.tv_sec + 8 &&
-				message_packet_len(m) + (int)_rr_len(&c->rr) < d->frame) {
-
-				INFO("Add known answer: Name: %s, Type: %d", c->rr.name, c->rr.type);
-				message_an(m, q->name, (unsigned short)q->type, (unsigned short)d->class, c->rr.ttl - (unsigned long)d->now.tv_sec);
-				_a_copy(m, &c->rr);
+			/* Add all known good entries, the rest in follow-on packets */
+			if (d->kamore) {
+				q->kamore = 1;
+				q->kasent = 0;
+			} else {
+				_ka_out(d, m, q, 0);
 			}
 		}
 		d->checkqlist = nextbest;
@@ -1463,34 +3264,52 @@ int mdnsd_out(mdns_daemon_t *d, struct message *m, inet_addr_t *to)
 struct timeval *mdnsd_sleep(mdns_daemon_t *d)
 {
 	time_t expire;
-	long usec;
+	long usec, held;
 
 	d->sleep.tv_sec = d->sleep.tv_usec = 0;
 
 	/* First check for any immediate items to handle */
-	if (d->uanswers || d->a_now)
+	if (d->uanswers || d->a_now || d->kamore)
 		return &d->sleep;
 
 	gettimeofday(&d->now, 0);
 
+	/* Held and memoized answers, and cache flushes, cap all waits below */
+	held = _tc_next(d);
+	usec = _rc_next(d);
+	if (usec >= 0 && (held < 0 || usec < held))
+		held = usec;
+	if (d->cflush) {
+		usec = ((long)d->cflush - d->now.tv_sec) * 1000000 - d->now.tv_usec;
+		if (usec < 0)
+			usec = 0;
+		if (held < 0 || usec < held)
+			held = usec;
+	}
+
 	/* Then check for paused answers or nearly expired records */
 	if (d->a_pause) {
 		if ((usec = _tvdiff(d->now, d->pause)) > 0)
-			d->sleep.tv_usec = usec;
+			d->sleep.tv_usec = held >= 0 && held < usec ? held : usec;
 		RET;
 	}
 
 	/* Now check for probe retries */
 	if (d->probing) {
 		if ((usec = _tvdiff(d->now, d->probe)) > 0)
-			d->sleep.tv_usec = usec;
+			d->sleep.tv_usec = held >= 0 && held < usec ? held : usec;
 		RET;
 	}
 
 	/* Now check for publish retries */
 	if (d->a_publish) {
 		if ((usec = _tvdiff(d->now, d->publish)) > 0)
-			d->sleep.tv_usec = usec;
+			d->sleep.tv_usec = held >= 0 && held < usec ? held : usec;
+		RET;
+	}
+
+	if (held >= 0) {
+		d->sleep.tv_usec = held;
 		RET;
 	}
 
@@ -1535,10 +3354,10 @@ struct timeval *mdnsd_sleep(mdns_daemon_t *d)
 void mdnsd_query(mdns_daemon_t *d, const char *host, int type, int (*answer)(mdns_answer_t *a, void *arg), void *arg)
 {
 	struct query *q;
-	struct cached *cur = 0;
-	int i = _namehash(host) % SPRIME;
+	struct cached *cur;
+	unsigned int h = _namehash(host);
 
-	if (!(q = _q_next(d, 0, host, type))) {
+	if (!(q = _q_next_h(d, h, host, type))) {
 		if (!answer)
 			return;
 
@@ -1550,14 +3369,18 @@ void mdnsd_query(mdns_daemon_t *d, const char *host, int type, int (*answer)(mdn
 			free(q);
 			return;
 		}
+		q->hash = h;
 		q->type = type;
-		q->next = d->queries[i];
+		q->next = d->queries[h % SPRIME];
 		q->list = d->qlist;
-		d->qlist = d->queries[i] = q;
+		d->qlist = d->queries[h % SPRIME] = q;
+		_bloom_update(d, h, 1);
 
-		/* Any cached entries should be associated */
-		while ((cur = _c_next(d, cur, q->name, q->type)))
-			cur->q = q;
+		/* Any cached entries should be associated, unless the peer's */
+		for (cur = _c_next_h(d, h, q->name, q->type); cur; cur = _c_next(d, cur, q->name, q->type)) {
+			if (!cur->q)
+				cur->q = q;
+		}
 		_q_reset(d, q);
 
 		/* New question, immediately send out */
@@ -1576,7 +3399,19 @@ void mdnsd_query(mdns_daemon_t *d, const char *host, int type, int (*answer)(mdn
 
 mdns_answer_t *mdnsd_list(mdns_daemon_t *d,const char *host, int type, mdns_answer_t *last)
 {
-	return (mdns_answer_t *)_c_next(d, (struct cached *)last, host, type);
+	struct cached *c = NULL;
+
+	if (last) {
+		if (last != &d->lview || !d->lcur)
+			return NULL;
+		c = d->lcur;
+	}
+
+	d->lcur = _c_next(d, c, host, type);
+	if (!d->lcur)
+		return NULL;
+
+	return _c_view(d->lcur, &d->lview);
 }
 
 mdns_record_t *mdnsd_record_next(const mdns_record_t* r)
@@ -1589,25 +3424,47 @@ const mdns_answer_t *mdnsd_record_data(const mdns_record_t* r)
 	return &r->rr;
 }
 
+mdns_record_t *mdnsd_record_iterator(mdns_daemon_t *d, const mdns_record_t *r)
+{
+	int i = 0;
+
+	if (r) {
+		if (r->next)
+			return r->next;
+		i = r->hash % SPRIME + 1;
+	}
+
+	for (; i < SPRIME; i++) {
+		if (d->published[i])
+			return d->published[i];
+	}
+
+	return NULL;
+}
+
 mdns_record_t *mdnsd_shared(mdns_daemon_t *d, const char *host, unsigned short type, unsigned long ttl)
 {
-	int i = _namehash(host) % SPRIME;
+	unsigned int h = _namehash(host);
 	mdns_record_t *r;
 
 	r = calloc(1, sizeof(struct mdns_record));
 	if (!r)
 		return NULL;
 
-	r->rr.name = strdup(host);
+	r->rr.name = _s_get(d->store, host, strlen(host), h, 1);
 	if (!r->rr.name) {
 		free(r);
 		return NULL;
 	}
 
+	r->wname = _s_blob(r->rr.name)->wire;
+	r->hash = h;
 	r->rr.type = type;
 	r->rr.ttl = ttl;
-	r->next = d->published[i];
-	d->published[i] = r;
+	_r_link(d, r);
+	_bloom_update(d, h, 1);
+	r->next = d->published[h % SPRIME];
+	d->published[h % SPRIME] = r;
 
 	return r;
 }
@@ -1673,6 +3530,7 @@ void mdnsd_done(mdns_daemon_t *d, mdns_record_t *r)
 {
 	mdns_record_t *cur;
 
+	_rc_stale(d);
 	if (r->unique && r->unique < 5) {
 		/* Probing yet, zap from that list first! */
 		if (d->probing == r) {
@@ -1688,30 +3546,34 @@ void mdnsd_done(mdns_daemon_t *d, mdns_record_t *r)
 	}
 
 	r->rr.ttl = 0;
-	_r_send(d, r);
+	_r_send(d, r, 0);
 }
 
 void mdnsd_set_raw(mdns_daemon_t *d, mdns_record_t *r, const char *data, unsigned short len)
 {
-	if (r->rr.rdata)
-		free(r->rr.rdata);
+	unsigned char *rdata;
 
-	r->rr.rdata = malloc(len);
-	if (r->rr.rdata) {
-		memcpy(r->rr.rdata, data, len);
-		r->rr.rdlen = len;
-	}
+	/* Take the new one first, it may well be the same */
+	rdata = (unsigned char *)_s_get(d->store, data, len, memhash(data, len), 0);
+	_s_put(d->store, r->rr.rdata);
+	r->rr.rdata = rdata;
+	r->rr.rdlen = rdata ? len : 0;
 	_r_publish(d, r);
 }
 
 void mdnsd_set_host(mdns_daemon_t *d, mdns_record_t *r, const char *name)
 {
+	char *rdname;
+
 	if (!r)
 		return;
 
-	if (r->rr.rdname)
-		free(r->rr.rdname);
-	r->rr.rdname = strdup(name);
+	rdname = _s_get(d->store, name, strlen(name), _namehash(name), 1);
+	_s_put(d->store, r->rr.rdname);
+	r->rr.rdname = rdname;
+	r->wrdname = rdname ? _s_blob(rdname)->wire : NULL;
+	_r_retarget(d, r);
+
 	_r_publish(d, r);
 }
 
@@ -1735,110 +3597,267 @@ void mdnsd_set_srv(mdns_daemon_t *d, mdns_record_t *r, unsigned short priority,
 	mdnsd_set_host(d, r, name);
 }
 
-/* Internal helper: update set of addresses for given host & type (A/AAAA) */
-static int _update_addresses_for_host(mdns_daemon_t *d, const char *host, unsigned short type, const void *addrs, size_t count)
+/* Address records by name, then type, then address */
+static int _addr_cmp(const void *a, const void *b)
 {
-	mdns_record_t *r;
-	mdns_record_t *cur;
+	const mdns_record_t *x = *(mdns_record_t * const *)a;
+	const mdns_record_t *y = *(mdns_record_t * const *)b;
+	int rc;
+
+	rc = strcmp(x->rr.name, y->rr.name);
+	if (rc)
+		return rc;
+	if (x->rr.type != y->rr.type)
+		return x->rr.type < y->rr.type ? -1 : 1;
+	if (x->rr.type == QTYPE_A)
+		return memcmp(&x->rr.ip, &y->rr.ip, sizeof(x->rr.ip));
+
+	return memcmp(&x->rr.ip6, &y->rr.ip6, sizeof(x->rr.ip6));
+}
+
+/*
+ * Merge the records of one host and type, sorted, with the wanted
+ * addresses, also sorted: add what is missing and leave the stale ones
+ * in @rec for the caller to remove.  Kept records are cleared in @rec.
+ */
+static void _addr_merge(mdns_daemon_t *d, const char *host, unsigned short type,
+			mdns_record_t **rec, size_t num, const void *addrs, size_t count)
+{
+	size_t len = type == QTYPE_A ? sizeof(struct in_addr) : sizeof(struct in6_addr);
 	unsigned long ttl = 120; /* default TTL if none exists */
-	char buf6[INET6_ADDRSTRLEN];
+	char buf[INET6_ADDRSTRLEN];
+	size_t i = 0, j = 0;
 
-	if (!d || !host)
-		return -1;
+	if (num && rec[0]->rr.ttl)
+		ttl = rec[0]->rr.ttl;
 
-	/* Determine TTL from any existing record of this type */
-	r = mdnsd_find(d, host, type);
-	if (r) {
-		const mdns_answer_t *data = mdnsd_record_data(r);
-		if (data && data->ttl)
-			ttl = data->ttl;
-	}
+	while (i < num || j < count) {
+		const void *want = (const char *)addrs + j * len;
+		mdns_record_t *r;
+		int rc;
 
-	/* For each desired address, check if there's a matching existing record */
-	for (size_t i = 0; i < count; i++) {
-		bool found = false;
-		cur = mdnsd_get_published(d, host);
-		while (cur) {
-			const mdns_answer_t *data = mdnsd_record_data(cur);
-			if (data->type == type && strcmp(data->name, host) == 0) {
-				if (type == QTYPE_A) {
-					const struct in_addr *a = (const struct in_addr *)addrs;
-					if (data->ip.s_addr == a[i].s_addr) {
-						found = true;
-						INFO("Found A record for %s addr %s", host, inet_ntoa(a[i]));
-						break;
-					}
-				} else if (type == QTYPE_AAAA) {
-					const struct in6_addr *a6 = (const struct in6_addr *)addrs;
-					if (memcmp(&data->ip6, &a6[i], sizeof(struct in6_addr)) == 0) {
-						found = true;
-						INFO("Found AAAA record for %s addr %s", host, inet_ntop(AF_INET6, &a6[i], buf6, sizeof(buf6)));
-						break;
-					}
-				}
-			}
-			cur = mdnsd_record_next(cur);
+		if (i == num)
+			rc = 1;
+		else if (j == count)
+			rc = -1;
+		else if (type == QTYPE_A)
+			rc = memcmp(&rec[i]->rr.ip, want, len);
+		else
+			rc = memcmp(&rec[i]->rr.ip6, want, len);
+
+		if (rc < 0) {
+			i++;	/* Stale, or a duplicate */
+			continue;
 		}
-		if (!found) {
-			/* Create new record for this address */
-			mdns_record_t *nr = mdnsd_shared(d, host, type, ttl);
-			if (!nr)
-				continue;
-			if (type == QTYPE_A) {
-				const struct in_addr *a = (const struct in_addr *)addrs;
-				mdnsd_set_ip(d, nr, a[i]);
-				INFO("Created A record for %s addr %s", host, inet_ntoa(a[i]));
-			} else {
-				const struct in6_addr *a6 = (const struct in6_addr *)addrs;
-				mdnsd_set_ipv6(d, nr, a6[i]);
-				INFO("Created AAAA record for %s addr %s", host, inet_ntop(AF_INET6, &a6[i], buf6, sizeof(buf6)));
-			}
+
+		if (rc == 0) {
+			rec[i++] = NULL;
+			j++;
+			continue;
+		}
+
+		r = mdnsd_shared(d, host, type, ttl);
+		if (r) {
+			if (type == QTYPE_A)
+				mdnsd_set_ip(d, r, *(const struct in_addr *)want);
+			else
+				mdnsd_set_ipv6(d, r, *(const struct in6_addr *)want);
+			INFO("Created %s record for %s addr %s", type == QTYPE_A ? "A" : "AAAA",
+			     host, inet_ntop(type == QTYPE_A ? AF_INET : AF_INET6, want, buf, sizeof(buf)));
 		}
+		j++;
 	}
+}
 
-	/* Remove stale records (present but not in desired set) */
-	cur = mdnsd_get_published(d, host);
-	while (cur) {
-		mdns_record_t *next = mdnsd_record_next(cur);
-		const mdns_answer_t *data = mdnsd_record_data(cur);
-		if (data->type == type && strcmp(data->name, host) == 0) {
-			bool still_present = false;
-			for (size_t i = 0; i < count; i++) {
-				if (type == QTYPE_A) {
-					const struct in_addr *a = (const struct in_addr *)addrs;
-					if (data->ip.s_addr == a[i].s_addr) { still_present = true; break; }
-				} else {
-					const struct in6_addr *a6 = (const struct in6_addr *)addrs;
-					if (memcmp(&data->ip6, &a6[i], sizeof(struct in6_addr)) == 0) { still_present = true; break; }
-				}
-			}
-			if (!still_present)
-				mdnsd_done(d, cur);
+/*
+ * Reconcile the A and/or AAAA records of @host, or all hosts, against
+ * sorted address sets.  Collects the records once, sorts them per host
+ * and type, and merges each run with the wanted set, so the cost is
+ * linear in records and addresses, after the sort.  Stale records are
+ * withdrawn last, all changes go out together with the next packets.
+ */
+static int _addr_sync(mdns_daemon_t *d, const char *host, int a, int aaaa,
+		      const struct in_addr *v4, size_t v4c, const struct in6_addr *v6, size_t v6c)
+{
+	size_t i, num = 0, max = 0, first, last;
+	mdns_record_t **rec, *r;
+	int idx, lo = 0, hi = SPRIME;
+
+	/* One host, one bucket */
+	if (host) {
+		lo = _namehash(host) % SPRIME;
+		hi = lo + 1;
+	}
+
+	for (idx = lo; idx < hi; idx++) {
+		for (r = d->published[idx]; r; r = r->next)
+			max++;
+	}
+	if (!max)
+		return 0;
+
+	rec = malloc(max * sizeof(*rec));
+	if (!rec)
+		return -1;
+
+	for (idx = lo; idx < hi; idx++) {
+		for (r = d->published[idx]; r; r = r->next) {
+			if (r->rr.type == QTYPE_A ? !a : r->rr.type == QTYPE_AAAA ? !aaaa : 1)
+				continue;
+			if (!r->rr.ttl)
+				continue; /* On its way out, saying goodbye */
+			if (host && strcmp(r->rr.name, host))
+				continue;
+
+			rec[num++] = r;
 		}
-		cur = next;
+	}
+	qsort(rec, num, sizeof(*rec), _addr_cmp);
+
+	/* One host at a time, its A records sort before its AAAA records */
+	for (first = 0; first < num; first = last) {
+		const char *name = rec[first]->rr.name;
+		size_t split;
+
+		for (last = first; last < num && !strcmp(rec[last]->rr.name, name); last++)
+			;
+		for (split = first; split < last && rec[split]->rr.type == QTYPE_A; split++)
+			;
+
+		INFO("Updating addresses for host %s", name);
+		/* A count of 0 is intentional: it withdraws that whole family. */
+		if (a)
+			_addr_merge(d, name, QTYPE_A, &rec[first], split - first, v4, v4c);
+		if (aaaa)
+			_addr_merge(d, name, QTYPE_AAAA, &rec[split], last - split, v6, v6c);
 	}
 
+	/* A host without any address records yet */
+	if (host && !num) {
+		if (a)
+			_addr_merge(d, host, QTYPE_A, rec, 0, v4, v4c);
+		if (aaaa)
+			_addr_merge(d, host, QTYPE_AAAA, rec, 0, v6, v6c);
+	}
+
+	/* Withdraw the stale ones last, the names above point into them */
+	for (i = 0; i < num; i++) {
+		if (rec[i])
+			mdnsd_done(d, rec[i]);
+	}
+	free(rec);
+
 	return 0;
 }
 
+static int _addr4_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(struct in_addr));
+}
+
+static int _addr6_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(struct in6_addr));
+}
+
+/* Sorted copy of @addrs, without duplicates, for _addr_sync() */
+static void *_addr_sort(const void *addrs, size_t *count, size_t len)
+{
+	int (*cmp)(const void *, const void *) = len == sizeof(struct in_addr) ? _addr4_cmp : _addr6_cmp;
+	size_t i, n = 0;
+	char *set;
+
+	if (!*count)
+		return NULL;
+
+	set = malloc(*count * len);
+	if (!set)
+		return NULL;
+
+	memcpy(set, addrs, *count * len);
+	qsort(set, *count, len, cmp);
+	for (i = 0; i < *count; i++) {
+		if (n && !cmp(set + (n - 1) * len, set + i * len))
+			continue;
+		memmove(set + n * len, set + i * len, len);
+		n++;
+	}
+	*count = n;
+
+	return set;
+}
+
 int mdnsd_set_addresses_for_host(mdns_daemon_t *d, const char *host, const struct in_addr *addrs, size_t count)
 {
-	return _update_addresses_for_host(d, host, QTYPE_A, addrs, count);
+	struct in_addr *v4;
+	int rc;
+
+	if (!d || !host)
+		return -1;
+
+	v4 = _addr_sort(addrs, &count, sizeof(*v4));
+	if (count && !v4)
+		return -1;
+
+	rc = _addr_sync(d, host, 1, 0, v4, count, NULL, 0);
+	free(v4);
+
+	return rc;
 }
 
 int mdnsd_set_ipv6_addresses_for_host(mdns_daemon_t *d, const char *host, const struct in6_addr *addrs, size_t count)
 {
-	return _update_addresses_for_host(d, host, QTYPE_AAAA, addrs, count);
+	struct in6_addr *v6;
+	int rc;
+
+	if (!d || !host)
+		return -1;
+
+	v6 = _addr_sort(addrs, &count, sizeof(*v6));
+	if (count && !v6)
+		return -1;
+
+	rc = _addr_sync(d, host, 0, 1, NULL, 0, v6, count);
+	free(v6);
+
+	return rc;
+}
+
+int mdnsd_set_addresses(mdns_daemon_t *d, const struct in_addr *v4, size_t v4c,
+			const struct in6_addr *v6, size_t v6c)
+{
+	if (!d)
+		return -1;
+
+	return _addr_sync(d, NULL, 1, 1, v4, v4c, v6, v6c);
+}
+
+/* Append to a growing array, doubling its size as needed */
+static int _addr_push(void **arr, size_t *num, size_t *max, const void *addr, size_t len)
+{
+	if (*num == *max) {
+		size_t sz = *max ? *max * 2 : 8;
+		void *ptr;
+
+		ptr = realloc(*arr, sz * len);
+		if (!ptr)
+			return -1;
+		*arr = ptr;
+		*max = sz;
+	}
+	memcpy((char *)*arr + *num * len, addr, len);
+	(*num)++;
+
+	return 0;
 }
 
 int mdnsd_set_interface_addresses(mdns_daemon_t *d, const char *ifname)
 {
+	size_t v4c = 0, v4max = 0, v6c = 0, v6max = 0;
+	void *v4 = NULL, *v6 = NULL, *s4, *s6;
 	struct ifaddrs *ifa = NULL;
 	struct ifaddrs *it;
-	struct in_addr *v4 = NULL; size_t v4c = 0;
-	struct in6_addr *v6 = NULL; size_t v6c = 0;
-	char buf[INET_ADDRSTRLEN];
-	char buf6[INET6_ADDRSTRLEN];
+	int rc;
 
 	if (getifaddrs(&ifa) != 0)
 		return -1;
@@ -1847,73 +3866,28 @@ int mdnsd_set_interface_addresses(mdns_daemon_t *d, const char *ifname)
 	for (it = ifa; it; it = it->ifa_next) {
 		if (!it->ifa_addr || !it->ifa_name || strcmp(it->ifa_name, ifname))
 			continue;
-		if (it->ifa_addr->sa_family == AF_INET) {
-			v4 = realloc(v4, (v4c + 1) * sizeof(*v4));
-			if (v4) {
-				struct sockaddr_in *sin = (struct sockaddr_in *)it->ifa_addr;
-				v4[v4c++] = sin->sin_addr;
-				if(inet_ntop(AF_INET, &sin->sin_addr, buf, sizeof(buf)))
-						INFO("Adding address %s for interface %s", buf, ifname);
-			}
-		} else if (it->ifa_addr->sa_family == AF_INET6) {
-			v6 = realloc(v6, (v6c + 1) * sizeof(*v6));
-			if (v6) {
-				struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)it->ifa_addr;
-				v6[v6c++] = sin6->sin6_addr;
-				if (inet_ntop(AF_INET6, &sin6->sin6_addr, buf6, sizeof(buf6)))
-						INFO("Adding address %s for interface %s", buf6, ifname);
-			}
-		}
+		if (it->ifa_addr->sa_family == AF_INET)
+			_addr_push(&v4, &v4c, &v4max, &((struct sockaddr_in *)it->ifa_addr)->sin_addr,
+				   sizeof(struct in_addr));
+		else if (it->ifa_addr->sa_family == AF_INET6)
+			_addr_push(&v6, &v6c, &v6max, &((struct sockaddr_in6 *)it->ifa_addr)->sin6_addr,
+				   sizeof(struct in6_addr));
 	}
 	freeifaddrs(ifa);
 
-	/*
-	 * Reconcile per host name, not per record pointer: the calls below
-	 * free stale records, which would dangle a record iterator.  See #92.
-	 */
-	char **hosts = NULL;
-	size_t hostc = 0;
-
-	for (size_t idx = 0; idx < SPRIME; idx++) {
-		for (mdns_record_t *cur = d->published[idx]; cur; cur = mdnsd_record_next(cur)) {
-			const mdns_answer_t *data = mdnsd_record_data(cur);
-			bool seen = false;
-			char **tmp;
-
-			if (data->type != QTYPE_A && data->type != QTYPE_AAAA)
-				continue;
-
-			for (size_t i = 0; i < hostc; i++) {
-				if (!strcmp(hosts[i], data->name)) {
-					seen = true;
-					break;
-				}
-			}
-			if (seen)
-				continue;
-
-			tmp = realloc(hosts, (hostc + 1) * sizeof(*hosts));
-			if (!tmp)
-				continue;
-			hosts = tmp;
-			hosts[hostc] = strdup(data->name);
-			if (hosts[hostc])
-				hostc++;
-		}
-	}
-
-	for (size_t i = 0; i < hostc; i++) {
-		INFO("Updating addresses for host %s", hosts[i]);
-		/* A count of 0 is intentional: it withdraws that whole family. */
-		mdnsd_set_addresses_for_host(d, hosts[i], v4, v4c);
-		mdnsd_set_ipv6_addresses_for_host(d, hosts[i], v6, v6c);
-		free(hosts[i]);
-	}
-	free(hosts);
-
+	s4 = _addr_sort(v4, &v4c, sizeof(struct in_addr));
+	s6 = _addr_sort(v6, &v6c, sizeof(struct in6_addr));
 	free(v4);
 	free(v6);
-	return 0;
+
+	if ((v4c && !s4) || (v6c && !s6))
+		rc = -1;
+	else
+		rc = mdnsd_set_addresses(d, s4, v4c, s6, v6c);
+	free(s4);
+	free(s6);
+
+	return rc;
 }
 
 static int process_in(mdns_daemon_t *d, int sd)
@@ -1929,6 +3903,10 @@ static int process_in(mdns_daemon_t *d, int sd)
 		struct message m = { 0 };
 		int rc;
 
+		/* Shed floods before spending time on them */
+		if (!mdnsd_admit(d, &from))
+			continue;
+
 		buf[MAX_PACKET_LEN] = 0;
 		mdnsd_log_hex("Got Data:", buf, bsize);
 
@@ -1991,6 +3969,7 @@ int mdnsd_step(mdns_daemon_t *d, int sd, bool in, bool out, struct timeval *tv)
 
 void records_clear(mdns_daemon_t *d)
 {
+	_rc_drop(d);
 	for (int i = 0; i < SPRIME; i++)
 	{
 		mdns_record_t *r = d->published[i];
@@ -1999,9 +3978,12 @@ void records_clear(mdns_daemon_t *d)
 			mdns_record_t *const next = r->next;
 			_r_remove_lists(d, r, NULL);
 			_u_remove(d, r);
-			_free_record(r);
+			_tc_remove(d, r);
+			_bloom_update(d, r->hash, -1);
+			_free_record(d, r);
 			r = next;
 		}
 		d->published[i] = NULL;
 	}
+	d->referrers = NULL;
 }
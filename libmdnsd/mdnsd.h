@@ -50,6 +50,8 @@
 typedef struct mdns_daemon mdns_daemon_t;
 /* Record entry */
 typedef struct mdns_record mdns_record_t;
+/* Published names and rdata, shared by contexts, see mdnsd_set_store() */
+typedef struct mdnsd_store mdnsd_store_t;
 
 /* Callback for received record. Data is passed from the register call */
 typedef void (*mdnsd_record_received_callback)(const struct resource* r, void* data);
@@ -69,6 +71,38 @@ typedef struct mdns_answer {
 	} srv;			/* SRV */
 } mdns_answer_t;
 
+/* Per-context counters, see mdnsd_get_stats() */
+typedef struct mdnsd_stats {
+	unsigned long ratelimited;	/* Query responses held back, RFC 6762 §6 */
+	unsigned long response_hits;	/* Queries answered by a memoized response */
+	unsigned long response_misses;	/* Memoized responses (re)built */
+	unsigned long cache_declined;	/* Answers heard but not cached */
+	unsigned long cache_evictions;	/* Entries dropped for the cache budget */
+	size_t cache_bytes;		/* Bytes cached now, see mdnsd_set_cache_budget() */
+	unsigned long shed;		/* Packets dropped by mdnsd_admit() */
+} mdnsd_stats_t;
+
+/* A host over its limits, see mdnsd_get_offenders() */
+typedef struct mdnsd_source {
+	inet_addr_t addr;
+	unsigned long packets;		/* Seen by mdnsd_admit() */
+	unsigned long dropped;		/* Over the packet rate */
+	unsigned long declined;		/* Over the cache quota */
+	unsigned int records;		/* Cache entries now */
+} mdnsd_source_t;
+
+/* Per-source limits for mdnsd_set_source_limit(), generous for any honest host */
+#define MDNS_SOURCE_RATE    50		/* Packets/sec */
+#define MDNS_SOURCE_BURST   200		/* Packets */
+#define MDNS_SOURCE_RECORDS 512		/* Cache entries */
+
+/* What to cache of the answers heard, see mdnsd_set_cache_policy() */
+typedef enum {
+	MDNSD_CACHE_ALL = 0,	/* Everything, the default */
+	MDNSD_CACHE_QUERIED,	/* Only names and types with an active query */
+	MDNSD_CACHE_OWN,	/* Only names and types we publish */
+} mdnsd_cache_policy_t;
+
 /**
  * Global functions
  */
@@ -110,6 +144,96 @@ mdns_daemon_t *mdnsd_new(int class, int frame);
  */
 void mdnsd_set_family(mdns_daemon_t *d, sa_family_t family);
 
+/**
+ * Set the MTU of the link the daemon runs on.  The frame size given to
+ * mdnsd_new() is replaced with the MTU less IP and UDP headers, capped
+ * at 9000 bytes, RFC 6762 §17.  Call again when the link MTU changes.
+ */
+void mdnsd_set_mtu(mdns_daemon_t *d, int mtu);
+
+/**
+ * Get the current maximum frame size
+ */
+int mdnsd_get_frame(mdns_daemon_t *d);
+
+/**
+ * Ask for unicast responses (QU bit) the first time a query is sent,
+ * RFC 6762 §5.4.  Off by default, retries always ask for multicast.
+ */
+void mdnsd_set_unicast_query(mdns_daemon_t *d, bool enable);
+
+/**
+ * Set what is cached of the answers heard on the link.  A responder that
+ * never queries has no use for other hosts' records, MDNSD_CACHE_QUERIED
+ * keeps it from holding a copy of the whole LAN.  Conflict detection
+ * does not depend on the cache.
+ */
+void mdnsd_set_cache_policy(mdns_daemon_t *d, mdnsd_cache_policy_t policy);
+
+/**
+ * Limit the bytes held by the cache, 0 (default) means no limit.  When
+ * full, entries without an active query go first, those nearest expiry
+ * first.  Protects against floods of unique names on the link.
+ */
+void mdnsd_set_cache_budget(mdns_daemon_t *d, size_t bytes);
+
+/**
+ * Let @d use the cache of @peer, the other transport on the same link,
+ * so records a host announces over both IPv4 and IPv6 are cached once,
+ * and query callbacks called once.  Only possible before @d has cached
+ * anything, returns -1 with errno EBUSY otherwise, or EINVAL if either
+ * already shares.
+ */
+int mdnsd_share_cache(mdns_daemon_t *d, mdns_daemon_t *peer);
+
+/**
+ * Create a store for the names and rdata of published records.  Every
+ * context attached to it with mdnsd_set_store() shares one copy of each,
+ * e.g. the same services on many interfaces, or over IPv4 and IPv6.
+ * Records are not shared, an update is still made in each context.  Not
+ * locked, use the contexts sharing a store from one thread.
+ */
+mdnsd_store_t *mdnsd_store_new(void);
+
+/**
+ * Drop the reference from mdnsd_store_new(), the store is freed when
+ * the last context attached to it is
+ */
+void mdnsd_store_free(mdnsd_store_t *s);
+
+/**
+ * Attach a context to a store, or detach it with NULL.  Only possible
+ * before anything is published, returns -1 with errno EBUSY otherwise.
+ */
+int mdnsd_set_store(mdns_daemon_t *d, mdnsd_store_t *s);
+
+/**
+ * Limit what a single host on the link can make us do: @rate packets per
+ * second with bursts of @burst, and @records entries in the cache.  Zero
+ * means no limit, the default.  Sources are tracked in a small table, the
+ * least recently heard is forgotten first, but not while it has entries
+ * in the cache.  Sources that cannot be tracked share one packet bucket,
+ * and may not add to the cache.
+ */
+void mdnsd_set_source_limit(mdns_daemon_t *d, unsigned int rate, unsigned int burst, unsigned int records);
+
+/**
+ * Check a received packet against its source's rate limit, before it is
+ * parsed.  Returns false if the packet should be dropped.
+ */
+bool mdnsd_admit(mdns_daemon_t *d, const inet_addr_t *from);
+
+/**
+ * Get up to @max sources that have been over their limits, worst first.
+ * Returns the number of entries filled in.
+ */
+int mdnsd_get_offenders(mdns_daemon_t *d, mdnsd_source_t *list, int max);
+
+/**
+ * Get a snapshot of the context's counters
+ */
+void mdnsd_get_stats(mdns_daemon_t *d, mdnsd_stats_t *stats);
+
 /**
  * Set mDNS daemon host IP address
  */
@@ -188,7 +312,8 @@ void mdnsd_query(mdns_daemon_t *d, const char *host, int type, int (*answer)(mdn
 
 /**
  * Returns the first (if last == NULL) or next answer after last from
- * the cache mdns_answer_t only valid until an I/O function is called
+ * the cache mdns_answer_t only valid until an I/O function is called,
+ * or the next call to mdnsd_list()
  */
 mdns_answer_t *mdnsd_list(mdns_daemon_t *d, const char *host, int type, mdns_answer_t *last);
 
@@ -204,6 +329,13 @@ mdns_record_t *mdnsd_record_next(const mdns_record_t *r);
  */
 const mdns_answer_t *mdnsd_record_data(const mdns_record_t *r);
 
+/**
+ * Walk all published records, in no particular order.  Start with NULL,
+ * returns NULL when done.  The walk does not survive mdnsd_done() on the
+ * current record, collect the records to drop first.
+ */
+mdns_record_t *mdnsd_record_iterator(mdns_daemon_t *d, const mdns_record_t *r);
+
 
 /**
  * Publishing functions
@@ -285,6 +417,16 @@ int mdnsd_set_addresses_for_host(mdns_daemon_t *d, const char *host,
 int mdnsd_set_ipv6_addresses_for_host(mdns_daemon_t *d, const char *host,
 									  const struct in6_addr *addrs, size_t count);
 
+/**
+ * Multi-address support: set all IPv4 and IPv6 addresses, for every host
+ * name with A/AAAA records.  Both sets must be sorted, in memcmp() order,
+ * and free of duplicates, see mdnsd_set_interface_addresses().  Adds the
+ * missing records and removes the stale ones, in one pass.
+ * Returns 0 on success.
+ */
+int mdnsd_set_addresses(mdns_daemon_t *d, const struct in_addr *v4, size_t v4c,
+			const struct in6_addr *v6, size_t v6c);
+
 /**
  * Automatic interface discovery: update all published host A/AAAA records
  * to match all addresses currently assigned to the given interface.
@@ -46,49 +46,92 @@ static size_t _sd2txt_len(const char *key, char *val)
 	return ret;
 }
 
+/* Keys of the table, and the bytes they take on the wire */
+struct sd2txt {
+	const char **key;
+	int n, len;
+};
+
 static void _sd2txt_count(xht_t *h __attribute__((unused)), const char *key, void *val, void *arg)
 {
-	int *const count = arg;
+	struct sd2txt *t = arg;
+
+	t->len += (int)_sd2txt_len(key, val) + 1;
+	t->n++;
+}
+
+static void _sd2txt_key(xht_t *h __attribute__((unused)), const char *key, void *val __attribute__((unused)), void *arg)
+{
+	struct sd2txt *t = arg;
 
-	*count += (int)_sd2txt_len(key, val) + 1;
+	t->key[t->n++] = key;
 }
 
-static void _sd2txt_write(xht_t *h __attribute__((unused)), const char *key, void *val, void *arg)
+/* RFC 6763 §6.7: txtvers goes first, the rest sorted for a stable record */
+static int _sd2txt_cmp(const void *a, const void *b)
 {
-	unsigned char **txtp = arg;
-	char *const cval = val;
+	const char *x = *(const char **)a, *y = *(const char **)b;
+
+	if (!strcmp(x, "txtvers"))
+		return -1;
+	if (!strcmp(y, "txtvers"))
+		return 1;
+
+	return strcmp(x, y);
+}
 
+static void _sd2txt_write(const char *key, char *val, unsigned char **txtp)
+{
 	/* Copy in lengths, then strings */
 	**txtp = _sd2txt_len(key, val);
 	(*txtp)++;
 	memcpy(*txtp, key, strlen(key));
 	*txtp += strlen(key);
-	if (!*cval)
+	if (!*val)
 		return;
 
 	**txtp = '=';
 	(*txtp)++;
-	memcpy(*txtp, cval, strlen(cval));
-	*txtp += strlen(cval);
+	memcpy(*txtp, val, strlen(val));
+	*txtp += strlen(val);
 }
 
+/*
+ * The table's walk order follows the keyed hash, which is random per
+ * process, so the keys are sorted for the same record every time.
+ */
 unsigned char *sd2txt(xht_t *h, int *len)
 {
+	struct sd2txt t = { 0 };
 	unsigned char *buf, *raw;
+	int i;
 
 	*len = 0;
 
-	xht_walk(h, _sd2txt_count, len);
-	if (!*len) {
+	xht_walk(h, _sd2txt_count, &t);
+	if (!t.len) {
 		*len = 1;
 		return (unsigned char *)strdup("");
 	}
 
-	raw = buf = malloc(*len);
-	if (!buf)
+	t.key = malloc(t.n * sizeof(t.key[0]));
+	if (!t.key)
 		return NULL;
 
-	xht_walk(h, _sd2txt_write, &buf);
+	raw = buf = malloc(t.len);
+	if (!buf) {
+		free(t.key);
+		return NULL;
+	}
+
+	t.n = 0;
+	xht_walk(h, _sd2txt_key, &t);
+	qsort(t.key, t.n, sizeof(t.key[0]), _sd2txt_cmp);
+	for (i = 0; i < t.n; i++)
+		_sd2txt_write(t.key[i], xht_get(h, t.key[i]), &buf);
+
+	free(t.key);
+	*len = t.len;
 
 	return raw;
 }
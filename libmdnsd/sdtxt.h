@@ -38,7 +38,8 @@
 xht_t *txt2sd(unsigned char *txt, int len);
 
 /**
- * returns a raw block that can be sent with a SD TXT record, sets length
+ * returns a raw block that can be sent with a SD TXT record, sets length.
+ * The txtvers key goes first, the rest in sorted order.
  */
 unsigned char *sd2txt(xht_t *h, int *len);
 
@@ -0,0 +1,107 @@
+/* SipHash-1-3, cf. the reference implementation by Aumasson & Bernstein */
+#include "config.h"
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "siphash.h"
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND					\
+	do {						\
+		v0 += v1; v1 = ROTL(v1, 13);		\
+		v1 ^= v0; v0 = ROTL(v0, 32);		\
+		v2 += v3; v3 = ROTL(v3, 16);		\
+		v3 ^= v2;				\
+		v0 += v3; v3 = ROTL(v3, 21);		\
+		v3 ^= v0;				\
+		v2 += v1; v1 = ROTL(v1, 17);		\
+		v1 ^= v2; v2 = ROTL(v2, 32);		\
+	} while (0)
+
+static uint64_t le64(const uint8_t *p)
+{
+	return (uint64_t)p[0]       | (uint64_t)p[1] << 8  |
+	       (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+	       (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+	       (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+uint64_t siphash13(const uint8_t key[16], const void *data, size_t len)
+{
+	const uint8_t *in = data, *end = in + len - (len % 8);
+	uint64_t k0 = le64(key), k1 = le64(key + 8);
+	uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+	uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+	uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+	uint64_t v3 = 0x7465646279746573ULL ^ k1;
+	uint64_t b = (uint64_t)len << 56, m;
+	int i;
+
+	for (; in != end; in += 8) {
+		m = le64(in);
+		v3 ^= m;
+		SIPROUND;
+		v0 ^= m;
+	}
+
+	/* Last 0-7 bytes, and the length */
+	for (i = len % 8; i > 0; i--)
+		b |= (uint64_t)in[i - 1] << (8 * (i - 1));
+
+	v3 ^= b;
+	SIPROUND;
+	v0 ^= b;
+
+	v2 ^= 0xff;
+	for (i = 0; i < 3; i++)
+		SIPROUND;
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* The per-process key, from the kernel, else the best we can scrape together */
+static const uint8_t *seed(void)
+{
+	static uint8_t key[16];
+	static int done;
+
+	if (!done) {
+		int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+
+		if (fd < 0 || read(fd, key, sizeof(key)) != sizeof(key)) {
+			struct timespec ts;
+			uint64_t v[2];
+
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			v[0] = (uint64_t)ts.tv_nsec << 32 ^ (uint64_t)getpid() ^ (uintptr_t)&ts;
+			v[1] = (uint64_t)time(NULL) ^ (uintptr_t)key;
+			memcpy(key, v, sizeof(key));
+		}
+		if (fd >= 0)
+			close(fd);
+		done = 1;
+	}
+
+	return key;
+}
+
+unsigned int memhash(const void *data, size_t len)
+{
+	return (unsigned int)siphash13(seed(), data, len);
+}
+
+unsigned int strhash(const char *s)
+{
+	return memhash(s, strlen(s));
+}
+
+unsigned int randhash(void)
+{
+	static uint64_t n;
+
+	n++;
+	return memhash(&n, sizeof(n));
+}
@@ -0,0 +1,28 @@
+/* SipHash-1-3, a fast keyed hash for the internal hash tables */
+#ifndef MDNSD_SIPHASH_H_
+#define MDNSD_SIPHASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * SipHash-1-3 of @len bytes at @data, with the 128-bit @key, see
+ * Aumasson & Bernstein, "SipHash: a fast short-input PRF", 2012.
+ */
+uint64_t siphash13(const uint8_t key[16], const void *data, size_t len);
+
+/*
+ * Hash of @len bytes at @data, or the string @s, with a random key
+ * picked once per process.  Names from the network cannot be crafted
+ * to land in the same bucket, the key is not known outside.
+ */
+unsigned int memhash(const void *data, size_t len);
+unsigned int strhash(const char *s);
+
+/*
+ * Random number, SipHash of a counter under the same per-process key.
+ * For jittering timers, not for anything needing secrecy.
+ */
+unsigned int randhash(void);
+
+#endif /* MDNSD_SIPHASH_H_ */
@@ -30,6 +30,7 @@
 
 #include "config.h"
 #include "xht.h"
+#include "siphash.h"
 #include <string.h>
 #include <stdlib.h>
 
@@ -48,25 +49,10 @@ struct xht {
 	xhn_t *zen;
 };
 
-/* Generates a hash code for a string.
- * This function uses the ELF hashing algorithm as reprinted in 
- * Andrew Binstock, "Hashing Rehashed," Dr. Dobb's Journal, April 1996.
- */
-static int _xhter(const char *s)
+/* Keyed hash of a string, so keys from the network cannot be made to collide */
+static unsigned int _xhter(const char *s)
 {
-	/* ELF hash uses unsigned chars and unsigned arithmetic for portability */
-	const unsigned char *name = (const unsigned char *)s;
-	unsigned long h = 0, g;
-
-	while (*name) {		/* do some fancy bitwanking on the string */
-		h = (h << 4) + (unsigned long)(*name++);
-		if ((g = (h & 0xF0000000UL)) != 0)
-			h ^= (g >> 24);
-		h &= ~g;
-
-	}
-
-	return (int)h;
+	return strhash(s);
 }
 
 
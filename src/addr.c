@@ -76,55 +76,359 @@ struct iface *iface_find(const char *ifname)
 	return NULL;
 }
 
+static const char *filter;	/* Only this interface, see iface_filter() */
+static int resync;		/* Between iface_mark() and iface_sweep() */
+
+/* Binary search, returns 1 if found, else 0 and where it would go */
+static int addrset_find(struct addrset *set, const void *addr, size_t *pos)
+{
+	size_t lo = 0, hi = set->num;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		int rc = memcmp((char *)set->addr + mid * set->size, addr, set->size);
+
+		if (rc == 0) {
+			*pos = mid;
+			return 1;
+		}
+		if (rc < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*pos = lo;
+
+	return 0;
+}
+
+/* Returns 1 if added, 0 if already there, or on failure */
+static int addrset_add(struct addrset *set, const void *addr)
+{
+	char *base;
+	size_t pos;
+
+	if (addrset_find(set, addr, &pos))
+		return 0;
+
+	if (set->num == set->max) {
+		size_t max = set->max ? set->max * 2 : 4;
+		void *ptr;
+
+		ptr = realloc(set->addr, max * set->size);
+		if (!ptr) {
+			ERR("Failed allocating memory for address: %s", strerror(errno));
+			return 0;
+		}
+		set->addr = ptr;
+		set->max = max;
+	}
+
+	base = (char *)set->addr + pos * set->size;
+	memmove(base + set->size, base, (set->num - pos) * set->size);
+	memcpy(base, addr, set->size);
+	set->num++;
+
+	return 1;
+}
+
+/* Returns 1 if removed, 0 if it was not there */
+static int addrset_del(struct addrset *set, const void *addr)
+{
+	char *base;
+	size_t pos;
+
+	if (!addrset_find(set, addr, &pos))
+		return 0;
+
+	base = (char *)set->addr + pos * set->size;
+	memmove(base, base + set->size, (set->num - pos - 1) * set->size);
+	set->num--;
+
+	return 1;
+}
+
+static int addrset_equal(struct addrset *a, struct addrset *b)
+{
+	if (a->num != b->num)
+		return 0;
+	if (!a->num)
+		return 1;
+
+	return !memcmp(a->addr, b->addr, a->num * a->size);
+}
+
+static void addrset_free(struct addrset *set)
+{
+	free(set->addr);
+	set->addr = NULL;
+	set->num = set->max = 0;
+}
+
+/* Back to @old, kept aside by iface_mark() */
+static void addrset_restore(struct addrset *set, struct addrset *old)
+{
+	addrset_free(set);
+	*set = *old;
+	old->addr = NULL;
+	old->num = old->max = 0;
+}
+
 void iface_free(struct iface *iface)
 {
 	if (!iface)
 		return;
 
 	TAILQ_REMOVE(&iface_list, iface, link);
+	while (!SLIST_EMPTY(&iface->renames)) {
+		struct rename *rn = SLIST_FIRST(&iface->renames);
+
+		SLIST_REMOVE_HEAD(&iface->renames, link);
+		free(rn);
+	}
+	addrset_free(&iface->inaddrs);
+	addrset_free(&iface->inaddrs_old);
+	addrset_free(&iface->in6addrs);
+	addrset_free(&iface->in6addrs_old);
 	free(iface);
 }
 
-static void mark(void)
+/* By index, or by name if the index is unknown */
+static struct iface *iface_lookup(int ifindex, const char *ifname)
 {
 	struct iface *iface;
 
-	for (iface = iface_iterator(1); iface; iface = iface_iterator(0)) {
-		iface->unused = 1;
-		iface->inaddr_old = iface->inaddr;
-		memset(&iface->inaddr, 0, sizeof(iface->inaddr));
-		iface->in6addr_old = iface->in6addr;
-		memset(&iface->in6addr, 0, sizeof(iface->in6addr));
+	TAILQ_FOREACH(iface, &iface_list, link) {
+		if (ifindex ? iface->ifindex == ifindex : ifname && !strcmp(iface->ifname, ifname))
+			return iface;
 	}
+
+	return NULL;
 }
 
-static int sweep(void)
+/*
+ * IPv6 address preference, higher is better: any address is preferred
+ * over link local, site local loses to unique local, and a unique local
+ * address only to a global one.
+ */
+static int rank6(const struct in6_addr *ina)
 {
-	struct iface *iface;
-	int changed = 0;
+	if (IN6_IS_ADDR_LINKLOCAL(ina))
+		return 0;
+	if (IN6_IS_ADDR_SITELOCAL(ina))
+		return 1;
+	if ((ina->s6_addr[0] & 0xfe) == 0xfc)
+		return 2;
+
+	return 3;
+}
 
-	for (iface = iface_iterator(1); iface; iface = iface_iterator(0)) {
-		if (iface->unused)
-			continue;
+/* Pick the address to use for the socket, link local only as a last resort */
+static void prefer(struct iface *iface)
+{
+	struct in_addr *v4 = iface->inaddrs.addr;
+	struct in6_addr *v6 = iface->in6addrs.addr;
+	size_t i;
 
-		if (!iface->changed)
+	memset(&iface->inaddr, 0, sizeof(iface->inaddr));
+	for (i = 0; i < iface->inaddrs.num; i++) {
+		if (is_zeronet(&v4[i]))
 			continue;
 
-		if (iface->inaddr.s_addr == iface->inaddr_old.s_addr &&	IN6_ARE_ADDR_EQUAL(&iface->in6addr, &iface->in6addr_old)) {
-			iface->changed = 0;
-			continue;
+		iface->inaddr = v4[i];
+		if (!is_linklocal(&v4[i]))
+			break;
+	}
+
+	memset(&iface->in6addr, 0, sizeof(iface->in6addr));
+	for (i = 0; i < iface->in6addrs.num; i++) {
+		if (IN6_IS_ADDR_UNSPECIFIED(&iface->in6addr) || rank6(&v6[i]) > rank6(&iface->in6addr))
+			iface->in6addr = v6[i];
+	}
+}
+
+/* Recheck if the interface can be used, flag it as changed if @dirty */
+static void update(struct iface *iface, int dirty)
+{
+	const unsigned int want = IFF_UP | IFF_MULTICAST;
+	char unused;
+
+	/* Half way through a dump, wait for the whole picture */
+	if (resync)
+		return;
+
+	unused = iface->removed || (iface->flags & want) != want ||
+		(!iface->inaddrs.num && !iface->in6addrs.num);
+	if (unused != iface->unused || iface->removed) {
+		iface->unused = unused;
+		dirty = 1;
+	}
+
+	if (dirty) {
+		prefer(iface);
+		iface->changed = 1;
+	}
+}
+
+/* Limit to one interface, like -i eth0, or all with NULL */
+void iface_filter(const char *ifname)
+{
+	filter = ifname;
+}
+
+/*
+ * Start of a full resync, everything is gone until seen again.  The
+ * addresses are kept aside, for iface_sweep() to tell what changed, or
+ * for iface_unmark() to restore if the resync fails.
+ */
+void iface_mark(void)
+{
+	struct iface *iface;
+
+	resync = 1;
+	TAILQ_FOREACH(iface, &iface_list, link) {
+		iface->marked = 1;
+		addrset_free(&iface->inaddrs_old);
+		iface->inaddrs_old = iface->inaddrs;
+		iface->inaddrs.addr = NULL;
+		iface->inaddrs.num = iface->inaddrs.max = 0;
+		addrset_free(&iface->in6addrs_old);
+		iface->in6addrs_old = iface->in6addrs;
+		iface->in6addrs.addr = NULL;
+		iface->in6addrs.num = iface->in6addrs.max = 0;
+	}
+}
+
+/* End of a full resync, only what actually changed is flagged */
+void iface_sweep(void)
+{
+	struct iface *iface;
+
+	resync = 0;
+	TAILQ_FOREACH(iface, &iface_list, link) {
+		int dirty;
+
+		dirty = !addrset_equal(&iface->inaddrs, &iface->inaddrs_old) ||
+			!addrset_equal(&iface->in6addrs, &iface->in6addrs_old);
+		addrset_free(&iface->inaddrs_old);
+		addrset_free(&iface->in6addrs_old);
+
+		if (iface->marked)
+			iface->removed = 1;
+		iface->marked = 0;
+		update(iface, dirty);
+	}
+}
+
+/*
+ * A failed, or partial, resync: nothing is known to be gone, and the
+ * addresses are back to what they were before iface_mark().
+ */
+void iface_unmark(void)
+{
+	struct iface *iface;
+
+	resync = 0;
+	TAILQ_FOREACH(iface, &iface_list, link) {
+		addrset_restore(&iface->inaddrs, &iface->inaddrs_old);
+		addrset_restore(&iface->in6addrs, &iface->in6addrs_old);
+		iface->marked = 0;
+		update(iface, 0);
+	}
+}
+
+/* Link added or changed, e.g., RTM_NEWLINK, returns NULL if not for us */
+struct iface *iface_link(int ifindex, const char *ifname, unsigned int flags, int mtu)
+{
+	struct iface *iface;
+
+	if (flags & IFF_LOOPBACK)
+		return NULL; /* skip for now, mDNSResponder has it as fallback */
+	if (filter && strcmp(filter, ifname))
+		return NULL;
+
+	iface = iface_lookup(ifindex, ifname);
+	if (!iface) {
+		iface = calloc(1, sizeof(*iface));
+		if (!iface) {
+			ERR("Failed allocating memory for iface %s: %s", ifname, strerror(errno));
+			exit(1);
 		}
 
-		changed++;
+		DBG("Creating iface instance for interface %s", ifname);
+		TAILQ_INSERT_TAIL(&iface_list, iface, link);
+
+		iface->ifindex = ifindex;
+		iface->hostid = 1;
+		iface->sd = -1;
+		iface->sd6 = -1;
+		iface->unused = 1;
+		iface->inaddrs.size = iface->inaddrs_old.size = sizeof(struct in_addr);
+		iface->in6addrs.size = iface->in6addrs_old.size = sizeof(struct in6_addr);
 	}
 
-	return changed;
+	strlcpy(iface->ifname, ifname, sizeof(iface->ifname));
+	iface->removed = 0;
+	iface->marked = 0;
+	iface->flags = flags;
+	if (mtu > 0)
+		iface->linkmtu = mtu;
+
+	update(iface, 0);
+
+	return iface;
 }
 
-void iface_init(char *ifname)
+/* Link removed, e.g., RTM_DELLINK */
+void iface_unlink(int ifindex)
+{
+	struct iface *iface;
+
+	iface = iface_lookup(ifindex, NULL);
+	if (!iface)
+		return;
+
+	iface->removed = 1;
+	update(iface, 0);
+}
+
+static void addr_apply(struct iface *iface, int family, const void *addr, int add)
+{
+	struct addrset *set;
+	int dirty;
+
+	if (family == AF_INET)
+		set = &iface->inaddrs;
+	else if (family == AF_INET6)
+		set = &iface->in6addrs;
+	else
+		return;
+
+	if (add)
+		dirty = addrset_add(set, addr);
+	else
+		dirty = addrset_del(set, addr);
+
+	update(iface, dirty);
+}
+
+/* Address added or removed, e.g., RTM_NEWADDR/DELADDR */
+void iface_addr(int ifindex, int family, const void *addr, int add)
+{
+	struct iface *iface;
+
+	iface = iface_lookup(ifindex, NULL);
+	if (iface)
+		addr_apply(iface, family, addr, add);
+}
+
+/*
+ * Full scan with getifaddrs(), for systems without netlink.  Use the
+ * netlink dump instead where available, see netlink_resync().
+ */
+void iface_init(void)
 {
 	struct ifaddrs *ifaddr, *ifa;
-	struct iface *iface = NULL;
 	int rc = -1;
 
 	rc = getifaddrs(&ifaddr);
@@ -133,33 +437,23 @@ void iface_init(char *ifname)
 		return;
 	}
 
-	mark();
+	iface_mark();
 
 	for (ifa = ifaddr; ifa; ifa = ifa->ifa_next) {
 		struct in6_addr ina;
 		char buf[INET6_ADDRSTRLEN];
-
+		struct iface *iface;
+		int family;
 
 		if (!ifa->ifa_addr)
 			continue;
 
-		if (ifa->ifa_flags & IFF_LOOPBACK)
-			continue; /* skip for now, mDNSResponder has it as fallback */
-
-		if (!(ifa->ifa_flags & IFF_MULTICAST))
-			continue;
-
-		if (!(ifa->ifa_flags & IFF_UP))
-			continue; /* skip for now, not enabled */
-
-		if (ifa->ifa_addr->sa_family != AF_INET && ifa->ifa_addr->sa_family != AF_INET6)
-			continue;
-
-		if (ifname && strcmp(ifname, ifa->ifa_name))
+		family = ifa->ifa_addr->sa_family;
+		if (family != AF_INET && family != AF_INET6)
 			continue;
 
 		/* Validate IP address */
-		socklen_t salen = ifa->ifa_addr->sa_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+		socklen_t salen = family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
 		rc = getnameinfo(ifa->ifa_addr, salen, buf, sizeof(buf), NULL, 0, NI_NUMERICHOST);
 		if (rc)
 			continue;
@@ -168,69 +462,22 @@ void iface_init(char *ifname)
 		char* pc = strchr(buf, '%');
 		if (pc != NULL)  /* inet_pton cannot handle the interface part of a link local IPv6 address. */
 			*pc = '\0';
-		if (inet_pton(ifa->ifa_addr->sa_family, buf, &ina) <= 0)
+		if (inet_pton(family, buf, &ina) <= 0)
 			continue;
 
-		if (!iface)
-			iface = iface_find(ifa->ifa_name);
-
-		if (!iface) {
-			iface = calloc(1, sizeof(*iface));
-			if (!iface) {
-				ERR("Failed allocating memory for iface %s: %s", ifa->ifa_name, strerror(errno));
-				exit(1);
-			}
-
-			DBG("Creating iface instance for interface %s, address %s", ifa->ifa_name, buf);
-			TAILQ_INSERT_TAIL(&iface_list, iface, link);
-
-			strlcpy(iface->ifname, ifa->ifa_name, sizeof(iface->ifname));
-			iface->ifindex = if_nametoindex(ifa->ifa_name);
-			iface->hostid = 1;
-			iface->sd = -1;
-			iface->sd6 = -1;
-		} else {
-			iface->unused = 0;
-		}
-
-		if (ifa->ifa_addr->sa_family == AF_INET) {
-			if (iface->inaddr.s_addr != ina.s6_addr32[0]) {
-				if (is_zeronet(&iface->inaddr) || is_linklocal(&iface->inaddr)) {
-					iface->inaddr.s_addr = ina.s6_addr32[0];
-					iface->changed = 1;
-				}
-			}
-		} else {
-			if (! IN6_ARE_ADDR_EQUAL(&iface->in6addr, &ina)) {
-				if (IN6_IS_ADDR_UNSPECIFIED(&iface->in6addr)    /* Everything is better than no address (::) */
-					/* Any address is preferred over link local address */
-					|| IN6_IS_ADDR_LINKLOCAL(&iface->in6addr)
-					/* Any address is preferred over a site local address except for a link local address. */
-					|| (IN6_IS_ADDR_SITELOCAL(&iface->in6addr) && !IN6_IS_ADDR_LINKLOCAL(&ina))
-					/* A unique local address shall only be overwritten by a global address. */
-					|| ((iface->in6addr.s6_addr[0] & 0xfe) == 0xfc && !IN6_IS_ADDR_SITELOCAL(&ina) && !IN6_IS_ADDR_LINKLOCAL(&ina))
-					) {
-					iface->in6addr = ina;
-					iface->changed = 1;
-				}
-			}
-		}
-
-		/* prepare for next */
-		if (!ifname)
-			iface = NULL;
+		iface = iface_link(if_nametoindex(ifa->ifa_name), ifa->ifa_name, ifa->ifa_flags, 0);
+		if (iface)
+			addr_apply(iface, family, &ina, 1);
 	}
 	freeifaddrs(ifaddr);
 
-	sweep();
+	iface_sweep();
 }
 
 void iface_exit(void)
 {
 	struct iface *iface, *tmp;
 
-	TAILQ_FOREACH_SAFE(iface, &iface_list, link, tmp) {
-		TAILQ_REMOVE(&iface_list, iface, link);
-		free(iface);
-	}
+	TAILQ_FOREACH_SAFE(iface, &iface_list, link, tmp)
+		iface_free(iface);
 }
@@ -53,6 +53,24 @@ struct conf_srec {
 	size_t  txt_num;
 };
 
+/*
+ * A parsed .service file, shared by all interfaces and their contexts,
+ * and reused across reloads for as long as the file is unchanged.
+ */
+struct service {
+	TAILQ_ENTRY(service) link;
+	char               *file;
+	struct timespec     mtime;       /* With size and inode, to tell */
+	off_t               size;        /* if the file has changed      */
+	ino_t               ino;
+	char                seen;        /* In the latest conf_scan()    */
+
+	struct conf_srec    srec;
+	unsigned char      *txt;         /* TXT rdata, from srec.txt     */
+	int                 txtlen;
+};
+
+static TAILQ_HEAD(, service) services = TAILQ_HEAD_INITIALIZER(services);
 
 static char *chomp(char *str)
 {
@@ -141,74 +159,173 @@ static void fqdn(char *buf, size_t len, const char *name)
 	snprintf(buf, len, "%s%s", name, n && name[n - 1] == '.' ? "" : ".");
 }
 
-/* Create a new record, or update an existing one */
-static mdns_record_t *record(mdns_daemon_t *d, struct iface *iface, int shared, char *host,
-		      const char *name, unsigned short type, unsigned long ttl)
-{
-	mdns_record_t *r;
+/* Records the model wants in the context being set up, see apply() */
+static struct {
+	mdns_record_t     **r;
+	size_t              num;
+	size_t              max;
+} keep;
 
-	r = mdnsd_find(d, name, type);
-	while (r != NULL) {
-		const mdns_answer_t *a;
+static void hold(mdns_record_t *r)
+{
+	if (!r)
+		return;
 
-		if (!host)
-			break;
+	if (keep.num == keep.max) {
+		size_t max = keep.max ? keep.max * 2 : 64;
+		mdns_record_t **p;
 
-		a = mdnsd_record_data(r);
-		if (!a) {
-			r = mdnsd_record_next(r);
-			continue;
+		p = realloc(keep.r, max * sizeof(*p));
+		if (!p) {
+			ERR("Failed allocating memory: %s", strerror(errno));
+			return;
 		}
+		keep.r = p;
+		keep.max = max;
+	}
+	keep.r[keep.num++] = r;
+}
+
+static int ptrcmp(const void *a, const void *b)
+{
+	const mdns_record_t *x = *(mdns_record_t * const *)a;
+	const mdns_record_t *y = *(mdns_record_t * const *)b;
 
-		if (a->rdname && strcmp(a->rdname, host)) {
-			r = mdnsd_record_next(r);
+	return (x > y) - (x < y);
+}
+
+/* Live records only, one on its way out with a goodbye is not reused */
+static mdns_record_t *lookup(mdns_daemon_t *d, const char *host, const char *name, unsigned short type)
+{
+	mdns_record_t *r;
+
+	for (r = mdnsd_get_published(d, name); r; r = mdnsd_record_next(r)) {
+		const mdns_answer_t *a = mdnsd_record_data(r);
+
+		if (a->type != type || !a->ttl || strcmp(a->name, name))
+			continue;
+		if (host && a->rdname && strcmp(a->rdname, host))
 			continue;
-		}
 
 		return r;
 	}
 
+	return NULL;
+}
+
+/* Find an existing record, or create a new one, either way it is kept */
+static mdns_record_t *record(mdns_daemon_t *d, struct iface *iface, int shared, char *host,
+		      const char *name, unsigned short type, unsigned long ttl)
+{
+	mdns_record_t *r;
+
+	r = lookup(d, host, name, type);
 	if (!r) {
 		if (shared)
 			r = mdnsd_shared(d, name, type, ttl);
 		else
 			r = mdnsd_unique(d, name, type, ttl, mdnsd_conflict, iface);
 
-		if (host)
+		if (r && host)
 			mdnsd_set_host(d, r, host);
 	}
+	hold(r);
 
 	return r;
 }
 
-static int load(struct iface *iface, mdns_daemon_t *d, const char *path, const char *hostname)
+/* Address records are reconciled by conf_init(), keep all of @name's */
+static void hold_addresses(mdns_daemon_t *d, const char *name)
 {
-	struct conf_srec srec;
-	unsigned char *packet;
 	mdns_record_t *r;
-	size_t i;
-	xht_t *h;
-	char hlocal[256], tlocal[256], tgtlocal[256], clocal[256];
-	int len = 0;
 
-	memset(&srec, 0, sizeof(srec));
-	if (parse(path, &srec)) {
-		ERR("Failed reading %s: %s", path, strerror(errno));
-		return 1;
+	for (r = mdnsd_get_published(d, name); r; r = mdnsd_record_next(r)) {
+		const mdns_answer_t *a = mdnsd_record_data(r);
+
+		if ((a->type == QTYPE_A || a->type == QTYPE_AAAA) && !strcmp(a->name, name))
+			hold(r);
 	}
+}
+
+/*
+ * Only touch the data of a record that differs from what it should be,
+ * setting it (again) sends an announcement.
+ */
+static void set_srv(mdns_daemon_t *d, mdns_record_t *r, int port, char *target)
+{
+	const mdns_answer_t *a;
+
+	if (!r)
+		return;
 
-	if (!srec.name)
-		srec.name = strdup(hostname);
-	if (!srec.type)
-		srec.type = strdup("_http._tcp");
+	a = mdnsd_record_data(r);
+	if (a->srv.priority || a->srv.weight || a->srv.port != port ||
+	    !a->rdname || strcmp(a->rdname, target))
+		mdnsd_set_srv(d, r, 0, 0, port, target);
+}
 
-	snprintf(hlocal, sizeof(hlocal), "%s.%s.local.", srec.name, srec.type);
-	snprintf(tlocal, sizeof(tlocal), "%s.local.", srec.type);
+static void set_raw(mdns_daemon_t *d, mdns_record_t *r, const unsigned char *data, int len)
+{
+	const mdns_answer_t *a;
+
+	if (!r)
+		return;
+
+	a = mdnsd_record_data(r);
+	if (!a->rdata || a->rdlen != len || memcmp(a->rdata, data, len))
+		mdnsd_set_raw(d, r, (const char *)data, len);
+}
+
+/* Instance renamed on @iface after a conflict, e.g., "name (2)", or NULL */
+static struct rename *renamed(struct iface *iface, const char *instance)
+{
+	struct rename *rn;
+
+	SLIST_FOREACH(rn, &iface->renames, link) {
+		if (!strcmp(rn->name, instance))
+			return rn;
+	}
+
+	return NULL;
+}
+
+/*
+ * The instance name of @svc, as in the .service file, and as published
+ * on @iface.  A service without a name is named after the host.
+ */
+static void instance(struct iface *iface, struct service *svc, const char *hostname,
+		     char *base, char *buf, size_t len)
+{
+	struct conf_srec *srec = &svc->srec;
+	const char *name, *type;
+	struct rename *rn;
+
+	name = srec->name ? srec->name : hostname;
+	type = srec->type ? srec->type : "_http._tcp";
+
+	snprintf(base, len, "%s.%s.local.", name, type);
+	rn = srec->name ? renamed(iface, base) : NULL;
+	if (rn)
+		snprintf(buf, len, "%s (%d).%s.local.", name, rn->id, type);
+	else
+		strlcpy(buf, base, len);
+}
+
+static int load(struct iface *iface, mdns_daemon_t *d, struct service *svc, const char *hostname)
+{
+	struct conf_srec *srec = &svc->srec;
+	const char *type;
+	mdns_record_t *r;
+	char base[256], hlocal[256], tlocal[256], tgtlocal[256], clocal[256];
+
+	type = srec->type ? srec->type : "_http._tcp";
+	instance(iface, svc, hostname, base, hlocal, sizeof(hlocal));
+	snprintf(tlocal, sizeof(tlocal), "%s.local.", type);
 
 	/* SRV target host: a service may override it, else all services on
 	 * this host share the one host name (issue #80) */
-	if (srec.target)
-		fqdn(tgtlocal, sizeof(tgtlocal), srec.target);
+	if (srec->target)
+		fqdn(tgtlocal, sizeof(tgtlocal), srec->target);
 	else
 		snprintf(tgtlocal, sizeof(tgtlocal), "%s.local.", hostname);
 
@@ -220,96 +337,219 @@ static int load(struct iface *iface, mdns_daemon_t *d, const char *path, const c
 	record(d, iface, 1, hlocal, tlocal, QTYPE_PTR, 120);
 
 	r = record(d, iface, 0, NULL, hlocal, QTYPE_SRV, 120);
-	mdnsd_set_srv(d, r, 0, 0, srec.port, tgtlocal);
-
-	/* Ensure A/AAAA records exist; addresses populated from interface */
-	r = record(d, iface, 0, NULL, tgtlocal, QTYPE_A, 120);
-	r = record(d, iface, 0, NULL, tgtlocal, QTYPE_AAAA, 120);
+	set_srv(d, r, srec->port, tgtlocal);
 
-	/* Publish all v4/v6 addresses for this interface and host */
-	mdnsd_set_interface_addresses(d, iface->ifname);
+	/* Ensure A/AAAA records exist, addresses are set by conf_init() */
+	record(d, iface, 0, NULL, tgtlocal, QTYPE_A, 120);
+	record(d, iface, 0, NULL, tgtlocal, QTYPE_AAAA, 120);
+	hold_addresses(d, tgtlocal);
 
 	/* A cname aliases the host, so it resolves to the host's addresses */
-	if (srec.cname) {
-		fqdn(clocal, sizeof(clocal), srec.cname);
+	if (srec->cname) {
+		fqdn(clocal, sizeof(clocal), srec->cname);
 		record(d, iface, 1, tgtlocal, clocal, QTYPE_CNAME, 120);
 	}
 	r = record(d, iface, 0, NULL, hlocal, QTYPE_TXT, 4500);
+	set_raw(d, r, svc->txt, svc->txtlen);
+
+	return 0;
+}
+
+/*
+ * Send goodbyes for records no service wants anymore, e.g. the service
+ * file was removed or changed, or we changed name after a conflict.
+ */
+static void sweep(mdns_daemon_t *d)
+{
+	mdns_record_t *r, **gone = NULL;
+	size_t num = 0, max = 0, i;
+
+	qsort(keep.r, keep.num, sizeof(keep.r[0]), ptrcmp);
+	for (r = mdnsd_record_iterator(d, NULL); r; r = mdnsd_record_iterator(d, r)) {
+		if (!mdnsd_record_data(r)->ttl)
+			continue;
+		if (bsearch(&r, keep.r, keep.num, sizeof(keep.r[0]), ptrcmp))
+			continue;
+
+		if (num == max) {
+			mdns_record_t **p;
+
+			max = max ? max * 2 : 16;
+			p = realloc(gone, max * sizeof(*p));
+			if (!p) {
+				ERR("Failed allocating memory: %s", strerror(errno));
+				break;
+			}
+			gone = p;
+		}
+		gone[num++] = r;
+	}
+
+	for (i = 0; i < num; i++) {
+		const mdns_answer_t *a = mdnsd_record_data(gone[i]);
+
+		DBG("Withdrawing %s type %d", a->name, a->type);
+		mdnsd_done(d, gone[i]);
+	}
+	free(gone);
+}
+
+/*
+ * Reconcile the records of @d with the model: new records are probed
+ * and announced, changed ones announced, removed ones get a goodbye,
+ * and the rest is left as-is, not even re-announced.
+ */
+static int apply(struct iface *iface, mdns_daemon_t *d, const char *hostname)
+{
+	struct service *svc;
+	int rc = 0;
+
+	keep.num = 0;
+	TAILQ_FOREACH(svc, &services, link)
+		rc |= load(iface, d, svc, hostname);
+	sweep(d);
+
+	/*
+	 * Publish all v4/v6 addresses of the interface for all hosts, once
+	 * all services are in, from the addresses netlink (or the last poll)
+	 * has given us.  Once per context, not once per service file.
+	 */
+	mdnsd_set_addresses(d, iface->inaddrs.addr, iface->inaddrs.num,
+			    iface->in6addrs.addr, iface->in6addrs.num);
+
+	return rc;
+}
+
+static void srec_free(struct conf_srec *srec)
+{
+	size_t i;
+
+	free(srec->type);
+	free(srec->name);
+	free(srec->target);
+	free(srec->cname);
+	for (i = 0; i < NELEMS(srec->txt); i++)
+		free(srec->txt[i]);
+	memset(srec, 0, sizeof(*srec));
+}
+
+static void service_free(struct service *svc)
+{
+	TAILQ_REMOVE(&services, svc, link);
+	srec_free(&svc->srec);
+	free(svc->txt);
+	free(svc->file);
+	free(svc);
+}
+
+/* Parse @svc->file, and build its TXT rdata, only done when it changes */
+static int service_parse(struct service *svc)
+{
+	struct conf_srec *srec = &svc->srec;
+	size_t i;
+	xht_t *h;
+
+	srec_free(srec);
+	free(svc->txt);
+	svc->txt = NULL;
+	svc->txtlen = 0;
+
+	if (parse(svc->file, srec)) {
+		ERR("Failed reading %s: %s", svc->file, strerror(errno));
+		return 1;
+	}
 
 	h = xht_new(11);
-	for (i = 0; i < srec.txt_num; i++) {
+	for (i = 0; i < srec->txt_num; i++) {
 		char *ptr;
 
-		ptr = strchr(srec.txt[i], '=');
+		ptr = strchr(srec->txt[i], '=');
 		if (!ptr)
 			continue;
 		*ptr++ = 0;
 
-		xht_set(h, srec.txt[i], ptr);
+		xht_set(h, srec->txt[i], ptr);
 	}
-	packet = sd2txt(h, &len);
+	svc->txt = sd2txt(h, &svc->txtlen);
 	xht_free(h);
-	mdnsd_set_raw(d, r, (char *)packet, len);
-	free(packet);
-
-	free(srec.type);
-	free(srec.name);
-	free(srec.target);
-	free(srec.cname);
-	for (i = 0; i < NELEMS(srec.txt); i++)
-		free(srec.txt[i]);
 
 	return 0;
 }
 
-/* Publish the records in @path into all of the interface's contexts */
-static int load_all(struct iface *iface, const char *path, const char *hostname)
-{
-	int rc = load(iface, iface->mdns, path, hostname);
-#ifdef ENABLE_IPV6
-	if (iface->mdns6)
-		rc |= load(iface, iface->mdns6, path, hostname);
-#endif
-	return rc;
-}
-
-int conf_init(struct iface *iface, const char *path, const char *hostnm)
+/*
+ * Find, or parse, the model of @file, in the order conf_scan() sees them.
+ * Returns 1 if the model changed, i.e., a new, changed, or now unreadable
+ * file, otherwise 0.
+ */
+static int service_scan(const char *file)
 {
-	char hostname[_POSIX_HOST_NAME_MAX];
-	int hostid = iface->hostid;
+	struct service *svc;
 	struct stat st;
-	int rc = 0;
 
-	if (hostnm) {
-		strlcpy(hostname, hostnm, sizeof(hostname));
-	} else {
-		/* apparently gethostname() can fail ... */
-		if (gethostname(hostname, sizeof(hostname)) == -1)
-			strlcpy(hostname, "default", sizeof(hostname));
+	if (stat(file, &st)) {
+		ERR("Failed reading %s: %s", file, strerror(errno));
+		return 0;
 	}
 
-	/* uniqify hostname by appending -hostid, e.g., default-2 */
-	if (hostid > 1) {
-		size_t hlen, slen;
-		char suffix[16];
+	TAILQ_FOREACH(svc, &services, link) {
+		if (!strcmp(svc->file, file))
+			break;
+	}
 
-		slen = snprintf(suffix, sizeof(suffix), "-%d", hostid) + 1;
-		hlen = strlen(hostname);
-		if (hlen + slen >= sizeof(hostname))
-			hlen = sizeof(hostname) - slen;
+	if (!svc) {
+		svc = calloc(1, sizeof(*svc));
+		if (!svc || !(svc->file = strdup(file))) {
+			ERR("Failed allocating memory for %s: %s", file, strerror(errno));
+			free(svc);
+			return 0;
+		}
+	} else {
+		TAILQ_REMOVE(&services, svc, link);
+		if (svc->mtime.tv_sec == st.st_mtim.tv_sec && svc->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+		    svc->size == st.st_size && svc->ino == st.st_ino) {
+			DBG("Unchanged %s, reusing it", file);
+			svc->seen = 1;
+			TAILQ_INSERT_TAIL(&services, svc, link);
+			return 0;
+		}
+	}
 
-		strlcpy(&hostname[hlen], suffix, sizeof(hostname) - hlen);
+	svc->mtime = st.st_mtim;
+	svc->size  = st.st_size;
+	svc->ino   = st.st_ino;
+	if (service_parse(svc)) {
+		TAILQ_INSERT_TAIL(&services, svc, link);
+		service_free(svc);
+		return 1;
 	}
 
+	svc->seen = 1;
+	TAILQ_INSERT_TAIL(&services, svc, link);
+
+	return 1;
+}
+
+/*
+ * Read the service files in @path, a directory or a single file, into
+ * the model all interfaces are set up from, see conf_init().  Call once
+ * per reload: only new and changed files are parsed, the rest is kept.
+ * Returns the number of services added, changed, or removed.
+ */
+int conf_scan(const char *path)
+{
+	struct service *svc, *tmp;
+	struct stat st;
+	int changes = 0;
+
+	TAILQ_FOREACH(svc, &services, link)
+		svc->seen = 0;
+
 	if (stat(path, &st)) {
 		if (ENOENT == errno)
 			ERR("Services directory %s, missing or unconfigured.", path);
 		else
 			ERR("Cannot determine path type: %s", strerror(errno));
-		return 1;
-	}
-
-	if (S_ISDIR(st.st_mode)) {
+	} else if (S_ISDIR(st.st_mode)) {
 		glob_t gl;
 		size_t i;
 		char pat[strlen(path) + 64];
@@ -338,16 +578,122 @@ int conf_init(struct iface *iface, const char *path, const char *hostnm)
 
 		if (glob(pat, flags, NULL, &gl)) {
 			ERR("No .service files found in %s", pat);
-			return 1;
+		} else {
+			for (i = 0; i < gl.gl_pathc; i++)
+				changes += service_scan(gl.gl_pathv[i]);
+			globfree(&gl);
 		}
+	} else
+		changes += service_scan(path);
 
-		for (i = 0; i < gl.gl_pathc; i++)
-			rc |= load_all(iface, gl.gl_pathv[i], hostname);
+	/* Gone since the last time */
+	TAILQ_FOREACH_SAFE(svc, &services, link, tmp) {
+		if (svc->seen)
+			continue;
 
-		globfree(&gl);
-	} else
-		rc |= load_all(iface, path, hostname);
+		DBG("Removed %s", svc->file);
+		service_free(svc);
+		changes++;
+	}
 
-	return rc;
+	return changes;
+}
+
+void conf_exit(void)
+{
+	struct service *svc, *tmp;
+
+	TAILQ_FOREACH_SAFE(svc, &services, link, tmp)
+		service_free(svc);
+
+	free(keep.r);
+	memset(&keep, 0, sizeof(keep));
+}
+
+/* The host name to use on @iface, the system's or @hostnm, and -hostid */
+static void host(struct iface *iface, const char *hostnm, char *hostname, size_t len)
+{
+	int hostid = iface->hostid;
+
+	if (hostnm) {
+		strlcpy(hostname, hostnm, len);
+	} else {
+		/* apparently gethostname() can fail ... */
+		if (gethostname(hostname, len) == -1)
+			strlcpy(hostname, "default", len);
+	}
+
+	/* uniqify hostname by appending -hostid, e.g., default-2 */
+	if (hostid > 1) {
+		size_t hlen, slen;
+		char suffix[16];
+
+		slen = snprintf(suffix, sizeof(suffix), "-%d", hostid) + 1;
+		hlen = strlen(hostname);
+		if (hlen + slen >= len)
+			hlen = len - slen;
+
+		strlcpy(&hostname[hlen], suffix, len - hlen);
+	}
 }
 
+/*
+ * Pick a new name after a conflict for @name on @iface, RFC 6762 §9.
+ * Only the instance that conflicts is renamed, "name (2)", or, for the
+ * host name and anything else, the host, "host-2".  Call conf_init()
+ * on the interface after, only records using the name are re-probed.
+ */
+void conf_conflict(struct iface *iface, const char *hostnm, const char *name)
+{
+	char hostname[_POSIX_HOST_NAME_MAX];
+	char base[256], buf[256];
+	struct service *svc;
+
+	host(iface, hostnm, hostname, sizeof(hostname));
+	TAILQ_FOREACH(svc, &services, link) {
+		struct rename *rn;
+
+		if (!svc->srec.name)
+			continue;	/* Named after the host */
+
+		instance(iface, svc, hostname, base, buf, sizeof(buf));
+		if (strcmp(buf, name))
+			continue;
+
+		rn = renamed(iface, base);
+		if (!rn) {
+			rn = calloc(1, sizeof(*rn) + strlen(base) + 1);
+			if (!rn) {
+				ERR("Failed allocating memory: %s", strerror(errno));
+				break;
+			}
+			strcpy(rn->name, base);
+			rn->id = 1;
+			SLIST_INSERT_HEAD(&iface->renames, rn, link);
+		}
+		rn->id++;
+
+		NOTE("%s: renaming %s to %s (%d)", iface->ifname, svc->srec.name, svc->srec.name, rn->id);
+		return;
+	}
+
+	iface->hostid++;
+	host(iface, hostnm, hostname, sizeof(hostname));
+	NOTE("%s: renaming host to %s", iface->ifname, hostname);
+}
+
+/* Set up, or update, the interface's contexts from the conf_scan() model */
+int conf_init(struct iface *iface, const char *hostnm)
+{
+	char hostname[_POSIX_HOST_NAME_MAX];
+	int rc;
+
+	host(iface, hostnm, hostname, sizeof(hostname));
+	rc = apply(iface, iface->mdns, hostname);
+#ifdef ENABLE_IPV6
+	if (iface->mdns6)
+		rc |= apply(iface, iface->mdns6, hostname);
+#endif
+
+	return rc;
+}
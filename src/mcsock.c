@@ -34,7 +34,9 @@
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
 #include <errno.h>
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -67,6 +69,29 @@ static struct in_addr get_addr(const char *ifname)
 }
 
 
+int mdns_mtu(const char *ifname)
+{
+	struct ifreq ifr;
+	int sd, mtu = 0;
+
+	if (!ifname)
+		return 0;
+
+	sd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sd < 0)
+		return 0;
+
+	memset(&ifr, 0, sizeof(ifr));
+	snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+	if (!ioctl(sd, SIOCGIFMTU, &ifr))
+		mtu = ifr.ifr_mtu;
+	else
+		DBG("Failed reading MTU of %s: %s", ifname, strerror(errno));
+	close(sd);
+
+	return mtu;
+}
+
 static int mc_socket(struct ifnfo *iface, unsigned char ttl)
 {
 #ifdef HAVE_STRUCT_IP_MREQN_IMR_IFINDEX
@@ -47,6 +47,14 @@ struct ifnfo {
  */
 int mdns_socket(struct ifnfo *iface, unsigned char ttl);
 
+/**
+ * Get the link MTU of an interface.
+ *
+ * @param ifname  Interface name
+ * @return MTU in bytes, or 0 if unknown
+ */
+int mdns_mtu(const char *ifname);
+
 #ifdef ENABLE_IPV6
 /**
  * Create an IPv6 mDNS multicast socket joined to ff02::fb on @iface.
@@ -46,8 +46,13 @@
 #include "mcsock.h"
 #include "mdnsd.h"
 #include "netlink.h"
+#include "watch.h"
 
-#define SYS_INTERVAL 10		/* System interface poll interval, safety net */
+#define SYS_INTERVAL 10		/* Interface poll interval without netlink, max sleep */
+#define SYS_SETTLE   200	/* Netlink events are coalesced for this long, msec */
+#define HOLD_MIN     1		/* Hold-down of a flapping interface, sec, doubles per flap */
+#define HOLD_MAX     16		/* ... up to this */
+#define HOLD_DECAY   60		/* Flaps forgotten after this long without one, sec */
 
 static volatile sig_atomic_t running = 1;
 static volatile sig_atomic_t reload = 0;
@@ -58,6 +63,10 @@ static const char *path        = NULL;
 static int   background  = 1;
 static int   logging     = 1;
 static int   ttl         = 255;
+static int   nl_sd       = -1;
+static int   watch_sd    = -1;
+static mdnsd_store_t *store = NULL;	/* Services are the same on all interfaces */
+static struct timespec settle;		/* Netlink events pending until, see sys_settle() */
 
 
 /*
@@ -82,18 +91,21 @@ static int multicast_socket(struct iface *iface, unsigned char ttl, sa_family_t
 }
 
 /*
- * Each transport context (v4 and v6) defends its own name, so a conflict
- * on either triggers a reload that re-probes both -- deliberate, not a bug.
+ * Called from mdnsd_step(), so only pick a new name here, the records of
+ * this interface are reconciled after.  Each transport context (v4 and
+ * v6) defends its own name, both usually see the same conflict: one new
+ * name at a time per interface, a remaining conflict comes back later.
  */
 void mdnsd_conflict(char *name, int type, void *arg)
 {
 	struct iface *iface = (struct iface *)arg;
 
-	WARN("%s: conflicting name detected %s for type %d, reloading config ...", iface->ifname, name, type);
-	if (!reload) {
-		iface->hostid++;
-		reload = 1;
-	}
+	WARN("%s: conflicting name detected %s for type %d", iface->ifname, name, type);
+	if (iface->conflict)
+		return;
+
+	conf_conflict(iface, hostnm, name);
+	iface->conflict = 1;
 }
 
 static void record_received(const struct resource *r, void *data __attribute__((unused)))
@@ -138,16 +150,20 @@ static void record_received(const struct resource *r, void *data __attribute__((
 	}
 }
 
-static void free_iface(struct iface *iface)
+/* Say goodbye and close down, the interface stays around for later */
+static void stop_iface(struct iface *iface)
 {
-	mdnsd_shutdown(iface->mdns);
-	/* Flush goodbye packets (TTL=0) out on the wire before freeing */
-	if (iface->sd >= 0)
-		mdnsd_step(iface->mdns, iface->sd, false, true, NULL);
-	mdnsd_free(iface->mdns);
-	iface->mdns = NULL;
+	if (iface->mdns) {
+		mdnsd_shutdown(iface->mdns);
+		/* Flush goodbye packets (TTL=0) out on the wire before freeing */
+		if (iface->sd >= 0)
+			mdnsd_step(iface->mdns, iface->sd, false, true, NULL);
+		mdnsd_free(iface->mdns);
+		iface->mdns = NULL;
+	}
 	if (iface->sd >= 0)
 		close(iface->sd);
+	iface->sd = -1;
 
 #ifdef ENABLE_IPV6
 	if (iface->mdns6) {
@@ -156,29 +172,144 @@ static void free_iface(struct iface *iface)
 			mdnsd_step(iface->mdns6, iface->sd6, false, true, NULL);
 		mdnsd_free(iface->mdns6);
 		iface->mdns6 = NULL;
-		if (iface->sd6 >= 0)
-			close(iface->sd6);
 	}
+	if (iface->sd6 >= 0)
+		close(iface->sd6);
+	iface->sd6 = -1;
 #endif
+	iface->mtu = 0;
+}
+
+/*
+ * Time left until @ts, lowers @tv to it if that is sooner.  Returns 0
+ * once @ts has passed, or if it is not set.
+ */
+static int until(const struct timespec *ts, struct timeval *tv)
+{
+	struct timespec now;
+	long long ms;
+
+	if (!ts->tv_sec && !ts->tv_nsec)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (ts->tv_sec - now.tv_sec) * 1000LL + (ts->tv_nsec - now.tv_nsec) / 1000000;
+	if (ms <= 0)
+		return 0;
+
+	if (tv && tv->tv_sec * 1000LL + tv->tv_usec / 1000 > ms) {
+		tv->tv_sec = ms / 1000;
+		tv->tv_usec = (ms % 1000) * 1000;
+	}
+
+	return 1;
+}
+
+/*
+ * A running interface went down.  Each time it does within HOLD_DECAY
+ * of the last, it is held down twice as long before it is set up again,
+ * from none the first time up to HOLD_MAX, so a flapping link does not
+ * cost a goodbye, probe and announcement round per flap.
+ */
+static void flap(struct iface *iface)
+{
+	struct timespec now;
+	int hold = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec - iface->flapped.tv_sec > HOLD_DECAY)
+		iface->flaps = 0;
+
+	if (iface->flaps) {
+		hold = HOLD_MAX;
+		if (iface->flaps < 8 && HOLD_MIN << (iface->flaps - 1) < HOLD_MAX)
+			hold = HOLD_MIN << (iface->flaps - 1);
+
+		if (until(&iface->hold, NULL))
+			DBG("%s still flapping, holding it down %d sec", iface->ifname, hold);
+		else
+			NOTE("%s flapping, holding it down %d sec", iface->ifname, hold);
+	}
+
+	iface->flaps++;
+	iface->flapped = now;
+	iface->hold = now;
+	iface->hold.tv_sec += hold;
+}
+
+/* A socket error, set up @iface again in SYS_INTERVAL sec by sys_hold() */
+static void retry(struct iface *iface)
+{
+	clock_gettime(CLOCK_MONOTONIC, &iface->hold);
+	iface->hold.tv_sec += SYS_INTERVAL;
+	iface->changed = 1;
+}
+
+static void free_iface(struct iface *iface)
+{
+	stop_iface(iface);
 	iface_free(iface);
 }
 
+/* Size frames to the link MTU, it can change at runtime, e.g. jumbo frames */
+static void setup_mtu(struct iface *iface)
+{
+	int mtu;
+
+	mtu = iface->linkmtu;
+	if (!mtu)
+		mtu = mdns_mtu(iface->ifname);
+	if (mtu <= 0 || mtu == iface->mtu)
+		return;
+
+	if (iface->mtu)
+		INFO("MTU of %s changed %d => %d", iface->ifname, iface->mtu, mtu);
+	iface->mtu = mtu;
+
+	if (iface->mdns)
+		mdnsd_set_mtu(iface->mdns, mtu);
+	if (iface->mdns6)
+		mdnsd_set_mtu(iface->mdns6, mtu);
+}
+
 static void setup_iface(struct iface *iface)
 {
-	if (!iface->changed)
+	if (!iface->changed) {
+		if (!iface->unused)
+			setup_mtu(iface);
 		return;
+	}
 
 	if (iface->unused) {
-		free_iface(iface);
+		if (iface->removed)
+			free_iface(iface);
+		else {
+			/* Flapping while held down holds it longer */
+			if (iface->mdns || until(&iface->hold, NULL))
+				flap(iface);
+			stop_iface(iface);
+		}
+		iface->changed = 0;
 		return;
 	}
 
+	/* Left changed, for sys_hold() to set up later */
+	if (!iface->mdns && until(&iface->hold, NULL))
+		return;
+
+	setup_mtu(iface);
 	if (!iface->mdns) {
 		iface->mdns = mdnsd_new(QCLASS_IN, 1000);
 		if (!iface->mdns) {
 			ERR("Failed creating mDNS context for interface %s: %s", iface->ifname, strerror(errno));
 			exit(1);
 		}
+		if (iface->mtu)
+			mdnsd_set_mtu(iface->mdns, iface->mtu);
+		mdnsd_set_store(iface->mdns, store);
+		/* We never query, no use caching the rest of the LAN */
+		mdnsd_set_cache_policy(iface->mdns, MDNSD_CACHE_QUERIED);
+		mdnsd_set_source_limit(iface->mdns, MDNS_SOURCE_RATE, MDNS_SOURCE_BURST, MDNS_SOURCE_RECORDS);
 		mdnsd_register_receive_callback(iface->mdns, record_received, NULL);
 	}
 
@@ -202,19 +333,44 @@ static void setup_iface(struct iface *iface)
 			exit(1);
 		}
 		mdnsd_set_family(iface->mdns6, AF_INET6);
+		if (iface->mtu)
+			mdnsd_set_mtu(iface->mdns6, iface->mtu);
+		mdnsd_set_store(iface->mdns6, store);
+		mdnsd_share_cache(iface->mdns6, iface->mdns);
+		mdnsd_set_cache_policy(iface->mdns6, MDNSD_CACHE_QUERIED);
+		mdnsd_set_source_limit(iface->mdns6, MDNS_SOURCE_RATE, MDNS_SOURCE_BURST, MDNS_SOURCE_RECORDS);
 		mdnsd_register_receive_callback(iface->mdns6, record_received, NULL);
 	}
 #endif
 
 	/*
 	 * Reconfigure in place: conf_init() reuses records and the reconcile
-	 * sends goodbyes for removed addresses.  Only SIGHUP does a full clear.
+	 * sends goodbyes for removed addresses and services.
 	 */
-	conf_init(iface, path, hostnm);
+	conf_init(iface, hostnm);
 
+	memset(&iface->hold, 0, sizeof(iface->hold));
 	iface->changed = 0;
 }
 
+/*
+ * Publish the difference between the service files, as last read by
+ * conf_scan(), and what each interface has: unchanged records keep their
+ * probe and announce state, changed ones are announced, removed ones get
+ * a goodbye.
+ */
+static void services_update(void)
+{
+	struct iface *iface;
+
+	for (iface = iface_iterator(1); iface; iface = iface_iterator(0)) {
+		if (iface->unused || !iface->mdns)
+			continue;
+
+		conf_init(iface, hostnm);
+	}
+}
+
 static int sys_timeout(int *timeout)
 {
 	static struct timespec before;
@@ -234,17 +390,65 @@ static int sys_timeout(int *timeout)
 	return 0;
 }
 
-static void sys_init(void)
+/* Set up, or tear down, the interfaces that changed */
+static void sys_setup(void)
 {
 	struct iface *iface;
 
-	/* Initialize or check if IP address changed, needed to update A records */
-	iface_init(ifname);
-
 	for (iface = iface_iterator(1); iface; iface = iface_iterator(0))
 		setup_iface(iface);
 }
 
+/*
+ * Netlink events come in bursts: a link bouncing, a DHCP renew replacing
+ * its addresses.  They are applied to the interfaces as they come, but
+ * acted on SYS_SETTLE msec after the first, all at once.  A link down
+ * and up again within the window is no change at all.
+ */
+static void sys_settle(void)
+{
+	if (settle.tv_sec || settle.tv_nsec)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &settle);
+	settle.tv_nsec += SYS_SETTLE * 1000000L;
+	if (settle.tv_nsec >= 1000000000L) {
+		settle.tv_sec++;
+		settle.tv_nsec -= 1000000000L;
+	}
+}
+
+/*
+ * Set up the interfaces whose hold-down is over, lowers @tv to when the
+ * next one is.  Returns the number set up.
+ */
+static int sys_hold(struct timeval *tv)
+{
+	struct iface *iface;
+	int num = 0;
+
+	for (iface = iface_iterator(1); iface; iface = iface_iterator(0)) {
+		if (!iface->changed || iface->unused || !iface->hold.tv_sec)
+			continue;
+		if (until(&iface->hold, tv))
+			continue;
+
+		setup_iface(iface);
+		num++;
+	}
+
+	return num;
+}
+
+/* Full scan of all interfaces and addresses, see netlink_read() for updates */
+static void sys_init(void)
+{
+	if (netlink_resync())
+		iface_init();
+
+	sys_setup();
+}
+
 static void done(int signo __attribute__((unused)))
 {
 	running = 0;
@@ -312,7 +516,6 @@ int main(int argc, char *argv[])
 	fd_set fds;
 	int timeout = 0;
 	int c, rc;
-	int nl_sd = -1;
 
 	prognm = progname(argv[0]);
 	while ((c = getopt(argc, argv, "H:h"
@@ -383,9 +586,14 @@ int main(int argc, char *argv[])
 
 	NOTE("%s starting.", PACKAGE_STRING);
 	sig_init();
+	iface_filter(ifname);
+	/* Subscribe first, so no change is lost between the dump and the events */
+	nl_sd = netlink_init();
+	watch_sd = watch_init(path);
+	store = mdnsd_store_new();
+	conf_scan(path);
 	sys_init();
 	pidfile(PACKAGE_NAME);
-	nl_sd = netlink_init();
 
 	while (running) {
 		int nfds = 0;
@@ -396,6 +604,11 @@ int main(int argc, char *argv[])
 			if (nl_sd > nfds)
 				nfds = nl_sd;
 		}
+		if (watch_sd >= 0) {
+			FD_SET(watch_sd, &fds);
+			if (watch_sd > nfds)
+				nfds = watch_sd;
+		}
 		for (iface = iface_iterator(1); iface; iface = iface_iterator(0)) {
 			if (iface->sd < 0 || iface->unused)
 				continue;
@@ -421,15 +634,11 @@ int main(int argc, char *argv[])
 			if (!running)
 				break;
 			if (reload) {
-				sys_init();
-				for (iface = iface_iterator(1); iface; iface = iface_iterator(0)) {
-					records_clear(iface->mdns);
-#ifdef ENABLE_IPV6
-					if (iface->mdns6)
-						records_clear(iface->mdns6);
-#endif
-					conf_init(iface, path, hostnm);
-				}
+				/* Parse changed .service files once, not per interface */
+				conf_scan(path);
+				if (nl_sd < 0)
+					sys_init();
+				services_update();
 				pidfile(PACKAGE_NAME);
 				reload = 0;
 			}
@@ -438,14 +647,34 @@ int main(int argc, char *argv[])
 		}
 
 		if (nl_sd >= 0 && FD_ISSET(nl_sd, &fds)) {
-			if (netlink_read(nl_sd) > 0)
-				sys_init();
+			rc = netlink_read(nl_sd);
+			if (rc > 0)
+				sys_settle();
+			else if (rc < 0) {
+				WARN("Lost netlink, polling interfaces every %d sec", SYS_INTERVAL);
+				netlink_exit(nl_sd);
+				nl_sd = -1;
+			}
+		}
+
+		if (watch_sd >= 0 && FD_ISSET(watch_sd, &fds)) {
+			rc = watch_read(watch_sd);
+			/* Only the added, changed, or removed file is parsed */
+			if (rc > 0 && conf_scan(path))
+				services_update();
+			else if (rc < 0) {
+				WARN("Lost watch of %s, reload with SIGHUP", path);
+				watch_exit(watch_sd);
+				watch_sd = -1;
+			}
 		}
 
-		if (sys_timeout(&timeout))
-		    sys_init();
+		/* Without netlink we can only poll for changes */
+		if (nl_sd < 0 && sys_timeout(&timeout))
+			sys_init();
+
+		tv.tv_sec = SYS_INTERVAL;
 
-		tv.tv_sec = timeout;
 		for (iface = iface_iterator(1); iface; iface = iface_iterator(0)) {
 			struct timeval next;
 
@@ -460,7 +689,8 @@ int main(int argc, char *argv[])
 				if (rc == 2)
 					ERR("Failed writing to socket: %s", strerror(errno));
 
-				free_iface(iface);
+				stop_iface(iface);
+				retry(iface);
 				continue;
 			}
 			if (tv.tv_sec > next.tv_sec)
@@ -470,20 +700,42 @@ int main(int argc, char *argv[])
 			if (iface->mdns6 && iface->sd6 >= 0) {
 				rc = mdnsd_step(iface->mdns6, iface->sd6, FD_ISSET(iface->sd6, &fds), true, &next);
 				if (rc) {
-					ERR("%s: IPv6 socket error, disabling IPv6", iface->ifname);
+					ERR("%s: IPv6 socket error, retrying in %d sec", iface->ifname, SYS_INTERVAL);
+					mdnsd_free(iface->mdns6);
+					iface->mdns6 = NULL;
 					close(iface->sd6);
 					iface->sd6 = -1;
+					retry(iface);
 				} else if (tv.tv_sec > next.tv_sec)
 					tv = next;
 			}
 #endif
+
+			/* Only records using the new name, on this interface */
+			if (iface->conflict) {
+				conf_init(iface, hostnm);
+				iface->conflict = 0;
+				tv.tv_sec = tv.tv_usec = 0;
+			}
+		}
+
+		/* The burst of netlink events is over, or a hold-down */
+		if ((settle.tv_sec || settle.tv_nsec) && !until(&settle, &tv)) {
+			memset(&settle, 0, sizeof(settle));
+			sys_setup();
+			tv.tv_sec = tv.tv_usec = 0;
 		}
+		if (sys_hold(&tv))
+			tv.tv_sec = tv.tv_usec = 0;
 	}
 
 	NOTE("%s exiting.", PACKAGE_STRING);
 	for (iface = iface_iterator(1); iface; iface = iface_iterator(0))
 		free_iface(iface);
 	iface_exit();
+	conf_exit();
+	mdnsd_store_free(store);
+	watch_exit(watch_sd);
 	netlink_exit(nl_sd);
 
 	return 0;
@@ -32,6 +32,7 @@
 
 #include <net/if.h>		/* IFNAMSIZ */
 #include <netinet/in.h>
+#include <time.h>
 #include <libmdnsd/mdnsd.h>
 #include <libmdnsd/sdtxt.h>
 
@@ -55,24 +56,52 @@
 #define IN_LINKLOCAL(addr) ((addr & IN_CLASSB_NET) == IN_LINKLOCALNETNUM)
 #endif
 
+/* Sorted set of addresses, all of one family, see addr.c */
+struct addrset {
+	void              *addr;
+	size_t             size;             /* Of one address             */
+	size_t             num;
+	size_t             max;
+};
+
+/* Service instance renamed after a conflict, see conf_conflict() */
+struct rename {
+	SLIST_ENTRY(rename) link;
+	int                id;               /* "name (id)", from 2        */
+	char               name[];           /* As in the .service file    */
+};
+
 struct iface {
 	TAILQ_ENTRY(iface) link;
 	char               unused;
 	char               changed;
+	char               removed;          /* Link is gone               */
+	char               marked;           /* Not seen in the dump, yet  */
 
 	char               ifname[IFNAMSIZ];
 	int                ifindex;          /* Physical interface index   */
+	unsigned int       flags;            /* IFF_UP, IFF_MULTICAST, ... */
 	struct in_addr     inaddr;           /* == 0 for non IP interfaces */
-	struct in_addr     inaddr_old;
 	struct in6_addr    in6addr;          /* == :: for non IP interfaces */
-	struct in6_addr    in6addr_old;
+	struct addrset     inaddrs;          /* All of them, struct in_addr */
+	struct addrset     inaddrs_old;
+	struct addrset     in6addrs;         /* ... and struct in6_addr    */
+	struct addrset     in6addrs_old;
 
 	int                sd;
 	int                sd6;              /* IPv6 multicast socket      */
+	int                mtu;              /* Link MTU, 0 if unknown     */
+	int                linkmtu;          /* From netlink, 0 if unknown */
 
 	mdns_daemon_t     *mdns;
 	mdns_daemon_t     *mdns6;            /* IPv6 transport context     */
 	int                hostid;           /* init to 1, +1 on conflict  */
+	SLIST_HEAD(, rename) renames;        /* Instances renamed, ditto   */
+	char               conflict;         /* Renamed, to conf_init()    */
+
+	int                flaps;            /* Recent downs, see flap()   */
+	struct timespec    flapped;          /* Last down, monotonic       */
+	struct timespec    hold;             /* Not set up again until     */
 };
 
 void mdnsd_conflict(char *name, int type, void *arg);
@@ -81,11 +110,21 @@ void mdnsd_conflict(char *name, int type, void *arg);
 struct iface *iface_iterator(int first);
 struct iface *iface_find(const char *ifname);
 void          iface_free(struct iface *iface);
-void          iface_init(char *ifname);
+void          iface_filter(const char *ifname);
+void          iface_mark(void);
+void          iface_sweep(void);
+void          iface_unmark(void);
+struct iface *iface_link(int ifindex, const char *ifname, unsigned int flags, int mtu);
+void          iface_unlink(int ifindex);
+void          iface_addr(int ifindex, int family, const void *addr, int add);
+void          iface_init(void);
 void          iface_exit(void);
 
 /* conf.c */
-int conf_init(struct iface *iface, const char *path, const char *hostnm);
+int conf_scan(const char *path);
+int conf_init(struct iface *iface, const char *hostnm);
+void conf_conflict(struct iface *iface, const char *hostnm, const char *name);
+void conf_exit(void);
 
 /* replacement functions for systems that don't have them  */
 #ifndef HAVE_PIDFILE
@@ -46,6 +46,9 @@
 #include <libmdnsd/sdtxt.h>
 #include "mcsock.h"
 
+#ifndef HAVE_STRLCPY
+size_t strlcpy(char *dst, const char *src, size_t siz);
+#endif
 
 static mdns_daemon_t *d;
 static int simple;
@@ -118,10 +121,6 @@ static void device_add_addr(struct device *dev, const char *addr)
 }
 
 
-#ifndef HAVE_STRLCPY
-size_t strlcpy(char *dst, const char *src, size_t siz);
-#endif
-
 /* Find default outbound *LAN* interface, i.e. skipping tunnels */
 static char *getifname(char *ifname, size_t len)
 {
@@ -472,6 +471,22 @@ static void print_device_detail(void)
 	}
 }
 
+/* Hosts that flooded us, worst first, on stderr to keep results clean */
+static void offenders(void)
+{
+	mdnsd_source_t list[5];
+	int i, n;
+
+	n = mdnsd_get_offenders(d, list, 5);
+	for (i = 0; i < n; i++) {
+		char addr[INET_ADDRSTR_LEN];
+
+		fprintf(stderr, "Shed %lu of %lu packets and %lu records from %s\n",
+			list[i].dropped, list[i].packets, list[i].declined,
+			inet_ntop2(&list[i].addr, addr, sizeof(addr)));
+	}
+}
+
 /* Create the mDNS multicast socket for the given address family */
 static int msock(char *ifname, sa_family_t family)
 {
@@ -604,6 +619,9 @@ int main(int argc, char *argv[])
 	if (!d)
 		return 1;
 	mdnsd_set_family(d, family);
+	mdnsd_set_mtu(d, mdns_mtu(ifname));
+	mdnsd_set_unicast_query(d, true);
+	mdnsd_set_source_limit(d, MDNS_SOURCE_RATE, MDNS_SOURCE_BURST, MDNS_SOURCE_RECORDS);
 
 	start = time(NULL);
 	if (devmode) {
@@ -631,6 +649,9 @@ int main(int argc, char *argv[])
 		if (FD_ISSET(sd, &fds)) {
 			ssize = sizeof(from);
 			while ((bsize = recvfrom(sd, buf, MAX_PACKET_LEN, 0, (struct sockaddr *)&from, &ssize)) > 0) {
+				if (!mdnsd_admit(d, &from))
+					continue;
+
 				last_rx = time(NULL);
 				memset(&m, 0, sizeof(struct message));
 				if (message_parse(&m, buf) == 0)
@@ -657,6 +678,7 @@ int main(int argc, char *argv[])
 			break;
 	}
 
+	offenders();
 	mdnsd_shutdown(d);
 	mdnsd_free(d);
 
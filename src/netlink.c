@@ -34,6 +34,7 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <net/if.h>
 #include <sys/socket.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
@@ -41,7 +42,7 @@
 #include "mdnsd.h"
 #include "netlink.h"
 
-#define NL_BUFSZ 4096
+#define NL_BUFSZ 32768
 
 /*
  * Open a netlink socket subscribed to interface link and address events.
@@ -69,20 +70,221 @@ int netlink_init(void)
 	return sd;
 }
 
+static void nl_link(struct nlmsghdr *nh)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(nh);
+	char ifname[IFNAMSIZ] = { 0 };
+	struct rtattr *rta;
+	int len, mtu = 0;
+
+	if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+		return;
+
+	if (nh->nlmsg_type == RTM_DELLINK) {
+		iface_unlink(ifi->ifi_index);
+		return;
+	}
+
+	len = IFLA_PAYLOAD(nh);
+	for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		switch (rta->rta_type) {
+		case IFLA_IFNAME:
+			strlcpy(ifname, RTA_DATA(rta), sizeof(ifname));
+			break;
+
+		case IFLA_MTU:
+			if (RTA_PAYLOAD(rta) >= sizeof(int))
+				mtu = *(int *)RTA_DATA(rta);
+			break;
+		}
+	}
+
+	if (!ifname[0])
+		return;
+
+	iface_link(ifi->ifi_index, ifname, ifi->ifi_flags, mtu);
+}
+
+static void nl_addr(struct nlmsghdr *nh)
+{
+	struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+	void *addr = NULL, *local = NULL;
+	struct rtattr *rta;
+	size_t alen;
+	int len;
+
+	if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa)))
+		return;
+
+	if (ifa->ifa_family == AF_INET)
+		alen = sizeof(struct in_addr);
+	else if (ifa->ifa_family == AF_INET6)
+		alen = sizeof(struct in6_addr);
+	else
+		return;
+
+	len = IFA_PAYLOAD(nh);
+	for (rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (RTA_PAYLOAD(rta) < alen)
+			continue;
+
+		switch (rta->rta_type) {
+		case IFA_ADDRESS:
+			addr = RTA_DATA(rta);
+			break;
+
+		case IFA_LOCAL:
+			local = RTA_DATA(rta);
+			break;
+		}
+	}
+
+	/* On point-to-point links IFA_ADDRESS is the peer */
+	if (local)
+		addr = local;
+	if (!addr)
+		return;
+
+	/*
+	 * Failed duplicate address detection, as good as gone, and still
+	 * tentative, not ours yet.  The kernel sends a new RTM_NEWADDR once
+	 * DAD completes.
+	 */
+	if (nh->nlmsg_type == RTM_NEWADDR && !(ifa->ifa_flags & (IFA_F_DADFAILED | IFA_F_TENTATIVE)))
+		iface_addr(ifa->ifa_index, ifa->ifa_family, addr, 1);
+	else
+		iface_addr(ifa->ifa_index, ifa->ifa_family, addr, 0);
+}
+
+/*
+ * Apply one batch of messages, returns 1 at the end of a dump, or -1
+ * with errno set if the kernel reports an error instead.
+ */
+static int nl_parse(char *buf, size_t len)
+{
+	struct nlmsghdr *nh;
+	struct nlmsgerr *err;
+
+	for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+		switch (nh->nlmsg_type) {
+		case NLMSG_DONE:
+			return 1;
+
+		case NLMSG_ERROR:
+			err = NLMSG_DATA(nh);
+			if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(*err))) {
+				errno = EPROTO;
+				return -1;
+			}
+			if (!err->error)
+				return 1; /* ACK */
+			errno = -err->error;
+			return -1;
+
+		case RTM_NEWLINK:
+		case RTM_DELLINK:
+			nl_link(nh);
+			break;
+
+		case RTM_NEWADDR:
+		case RTM_DELADDR:
+			nl_addr(nh);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* Request a dump of all links or addresses, and apply it */
+static int nl_dump(int sd, int type, unsigned int seq)
+{
+	static char buf[NL_BUFSZ];
+	struct {
+		struct nlmsghdr  nh;
+		struct rtgenmsg  g;
+	} req;
+	ssize_t len;
+	int rc;
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len   = NLMSG_LENGTH(sizeof(req.g));
+	req.nh.nlmsg_type  = type;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nh.nlmsg_seq   = seq;
+	req.g.rtgen_family = AF_UNSPEC;
+
+	if (send(sd, &req, req.nh.nlmsg_len, 0) < 0)
+		return -1;
+
+	while (1) {
+		len = recv(sd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (len == 0)
+			return -1;
+
+		rc = nl_parse(buf, (size_t)len);
+		if (rc < 0)
+			return -1;
+		if (rc)
+			break;
+	}
+
+	return 0;
+}
+
 /*
- * Drain all pending netlink messages.  Returns 1 if any link or address
- * change event was seen (caller should re-run interface discovery), 0 if
- * nothing relevant arrived, or -1 on a fatal socket error.
+ * Full resync from a dump of all links and addresses, the source of
+ * truth at startup and whenever events have been lost.  Uses its own
+ * socket, events arriving meanwhile are applied after, in order, which
+ * converges on the same state.  Returns 0 on success, or -1 with the
+ * interfaces left as they were, for the getifaddrs() fallback.
+ */
+int netlink_resync(void)
+{
+	static unsigned int seq;
+	int sd, rc;
+
+	sd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (sd < 0) {
+		ERR("Failed creating netlink socket: %s", strerror(errno));
+		return -1;
+	}
+
+	iface_mark();
+	rc = nl_dump(sd, RTM_GETLINK, ++seq);
+	if (!rc)
+		rc = nl_dump(sd, RTM_GETADDR, ++seq);
+	if (rc) {
+		ERR("Failed reading interfaces over netlink: %s", strerror(errno));
+		iface_unmark();
+	} else
+		iface_sweep();
+	close(sd);
+
+	return rc;
+}
+
+/*
+ * Drain all pending netlink messages and apply each link and address
+ * change to its interface.  Returns 1 if anything arrived, the caller
+ * then sets up the interfaces that changed, 0 if nothing arrived, or -1
+ * on a fatal socket error.
  *
- * ENOBUFS means the kernel dropped events because we were too slow; treat
- * that as an implicit change so the caller rescans to catch up.
+ * ENOBUFS means the kernel dropped events because we were too slow, the
+ * only case where we start over from a full dump.
  */
 int netlink_read(int sd)
 {
-	char buf[NL_BUFSZ];
-	struct nlmsghdr *nh;
+	static char buf[NL_BUFSZ];
 	ssize_t len;
-	size_t l;
 	int changed = 0;
 
 	while (1) {
@@ -93,27 +295,18 @@ int netlink_read(int sd)
 			if (errno == EINTR)
 				continue;
 			if (errno == ENOBUFS) {
-				WARN("Netlink buffer overflow, interface events may have been lost");
+				WARN("Netlink buffer overflow, interface events lost, resyncing");
+				if (netlink_resync())
+					iface_init();
 				changed = 1;
-				break;
+				continue;
 			}
 			ERR("Netlink recv error: %s", strerror(errno));
 			return -1;
 		}
 
-		l = (size_t)len;
-		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, l); nh = NLMSG_NEXT(nh, l)) {
-			switch (nh->nlmsg_type) {
-			case RTM_NEWLINK:
-			case RTM_DELLINK:
-			case RTM_NEWADDR:
-			case RTM_DELADDR:
-				changed = 1;
-				break;
-			default:
-				break;
-			}
-		}
+		nl_parse(buf, (size_t)len);
+		changed = 1;
 	}
 
 	return changed;
@@ -33,12 +33,14 @@
 #ifdef __linux__
 
 int  netlink_init(void);
+int  netlink_resync(void);
 int  netlink_read(int sd);
 void netlink_exit(int sd);
 
 #else /* non-Linux stubs */
 
 static inline int  netlink_init(void)        { return -1; }
+static inline int  netlink_resync(void)      { return -1; }
 static inline int  netlink_read(int sd)      { (void)sd; return 0; }
 static inline void netlink_exit(int sd)      { (void)sd; }
 
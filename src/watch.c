@@ -0,0 +1,146 @@
+/* Service directory monitor for Linux
+ *
+ * Copyright (c) 2026  Joachim Wiberg <troglobit@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the copyright holders nor the names of its
+ *       contributors may be used to endorse or promote products derived from
+ *       this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+
+#include "config.h"
+
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "mdnsd.h"
+#include "watch.h"
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+
+/* Single service file mode, else all *.service in the directory */
+static char file[NAME_MAX + 1];
+
+/*
+ * Watch @path, the services directory, or the single .service file, for
+ * changes.  A file is watched by its directory, editors replace it by a
+ * rename.  Returns the inotify fd on success, -1 on failure.
+ */
+int watch_init(const char *path)
+{
+	char dir[PATH_MAX];
+	struct stat st;
+	int sd;
+
+	if (stat(path, &st)) {
+		WARN("Cannot watch %s for changes: %s", path, strerror(errno));
+		return -1;
+	}
+
+	strlcpy(dir, path, sizeof(dir));
+	if (!S_ISDIR(st.st_mode)) {
+		char base[PATH_MAX];
+
+		strlcpy(base, path, sizeof(base));
+		strlcpy(file, basename(base), sizeof(file));
+		strlcpy(dir, dirname(dir), sizeof(dir));
+	} else {
+		file[0] = 0;
+	}
+
+	sd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (sd < 0) {
+		ERR("Failed creating inotify instance: %s", strerror(errno));
+		return -1;
+	}
+
+	if (inotify_add_watch(sd, dir, WATCH_EVENTS | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+		ERR("Failed watching %s: %s", dir, strerror(errno));
+		close(sd);
+		return -1;
+	}
+
+	return sd;
+}
+
+static int relevant(const char *name)
+{
+	size_t len;
+
+	if (file[0])
+		return !strcmp(name, file);
+
+	len = strlen(name);
+	return len > 8 && !strcmp(&name[len - 8], ".service");
+}
+
+/*
+ * Read all pending events.  Returns 1 if a service file has changed,
+ * 0 if not, and -1 if the directory is gone or the watch is lost.
+ */
+int watch_read(int sd)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int changed = 0;
+	ssize_t len;
+
+	while ((len = read(sd, buf, sizeof(buf))) > 0) {
+		const struct inotify_event *ev;
+		char *ptr;
+
+		for (ptr = buf; ptr < buf + len; ptr += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)ptr;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				changed = 1;
+				continue;
+			}
+			if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+				return -1;
+
+			if (ev->len && relevant(ev->name)) {
+				DBG("Service file %s changed, mask 0x%x", ev->name, ev->mask);
+				changed = 1;
+			}
+		}
+	}
+
+	if (len < 0 && errno != EAGAIN && errno != EINTR)
+		return -1;
+
+	return changed;
+}
+
+void watch_exit(int sd)
+{
+	if (sd >= 0)
+		close(sd);
+}
+
+#endif /* __linux__ */
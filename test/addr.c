@@ -60,7 +60,7 @@ static void test_iface_init_no_ifc(__attribute__((__unused__)) void **state)
 	will_return(__wrap_getifaddrs, NULL);
 	will_return(__wrap_getifaddrs, 0);
 
-	iface_init(NULL);
+	iface_init();
 
 	struct iface *iface = iface_iterator(1);
 	assert_null(iface);
@@ -80,9 +80,9 @@ static void check_one_iface_one_global_ipv4(char* ifname)
 	/* Ignoring the (undeterminable) ifindex. */
 
 	assert_int_equal(ipv4_10_0_20_1.sin_addr.s_addr, iface->inaddr.s_addr);
-	assert_int_equal(0x00000000, iface->inaddr_old.s_addr);
+	assert_int_equal(0, iface->inaddrs_old.num);
 	assert_true(IN6_IS_ADDR_UNSPECIFIED(&iface->in6addr));
-	assert_true(IN6_IS_ADDR_UNSPECIFIED(&iface->in6addr_old));
+	assert_int_equal(0, iface->in6addrs_old.num);
 
 	assert_int_equal(-1, iface->sd);
 	assert_null(iface->mdns);
@@ -107,7 +107,7 @@ static void test_iface_init_one_ifc_ipv4(__attribute__((__unused__)) void **stat
 	will_return(__wrap_getifaddrs, &addrs);
 	will_return(__wrap_getifaddrs, 0);
 
-	iface_init(NULL);
+	iface_init();
 
 	check_one_iface_one_global_ipv4(addrs.ifa_name);
 }
@@ -134,7 +134,7 @@ static void test_iface_init_one_ifc_global_ipv4_LL_ipv4(__attribute__((__unused_
 	will_return(__wrap_getifaddrs, addrs);
 	will_return(__wrap_getifaddrs, 0);
 
-	iface_init(NULL);
+	iface_init();
 
 	check_one_iface_one_global_ipv4(addrs->ifa_name);
 }
@@ -161,7 +161,7 @@ static void test_iface_init_one_ifc_LL_ipv4_global_ipv4(__attribute__((__unused_
 	will_return(__wrap_getifaddrs, addrs);
 	will_return(__wrap_getifaddrs, 0);
 
-	iface_init(NULL);
+	iface_init();
 
 	check_one_iface_one_global_ipv4(addrs->ifa_name);
 }
@@ -181,9 +181,9 @@ static void check_one_iface_one_global_ipv6(char* ifname)
 	/* Ignoring the (undeterminable) ifindex. */
 
 	assert_int_equal(0x00000000, iface->inaddr.s_addr);
-	assert_int_equal(0x00000000, iface->inaddr_old.s_addr);
+	assert_int_equal(0, iface->inaddrs_old.num);
 	assert_true(IN6_ARE_ADDR_EQUAL(&ipv6_global.sin6_addr, &iface->in6addr));
-	assert_true(IN6_IS_ADDR_UNSPECIFIED(&iface->in6addr_old));
+	assert_int_equal(0, iface->in6addrs_old.num);
 
 	assert_int_equal(-1, iface->sd);
 	assert_null(iface->mdns);
@@ -208,7 +208,7 @@ static void test_iface_init_one_ifc_ipv6(__attribute__((__unused__)) void **stat
 	will_return(__wrap_getifaddrs, &addrs);
 	will_return(__wrap_getifaddrs, 0);
 
-	iface_init(NULL);
+	iface_init();
 
 	check_one_iface_one_global_ipv6(addrs.ifa_name);
 }
@@ -235,7 +235,7 @@ static void test_iface_init_one_ifc_global_ipv6_LL_ipv6(__attribute__((__unused_
 	will_return(__wrap_getifaddrs, addrs);
 	will_return(__wrap_getifaddrs, 0);
 
-	iface_init(NULL);
+	iface_init();
 
 	check_one_iface_one_global_ipv6(addrs->ifa_name);
 }
@@ -262,7 +262,7 @@ static void test_iface_init_one_ifc_LL_ipv6_global_ipv6(__attribute__((__unused_
 	will_return(__wrap_getifaddrs, addrs);
 	will_return(__wrap_getifaddrs, 0);
 
-	iface_init(NULL);
+	iface_init();
 
 	check_one_iface_one_global_ipv6(addrs->ifa_name);
 }
@@ -300,7 +300,7 @@ static void test_iface_init_one_ifc_LL_SL_UL_global_ipv6(__attribute__((__unused
 	will_return(__wrap_getifaddrs, addrs);
 	will_return(__wrap_getifaddrs, 0);
 
-	iface_init(NULL);
+	iface_init();
 
 	check_one_iface_one_global_ipv6(addrs->ifa_name);
 }
@@ -338,7 +338,7 @@ static void test_iface_init_one_ifc_global_UL_SL_LL_ipv6(__attribute__((__unused
 	will_return(__wrap_getifaddrs, addrs);
 	will_return(__wrap_getifaddrs, 0);
 
-	iface_init(NULL);
+	iface_init();
 
 	check_one_iface_one_global_ipv6(addrs->ifa_name);
 }
@@ -357,9 +357,9 @@ static void check_one_iface_global_ipv4_ipv6(char* ifname)
 	/* Ignoring the (undeterminable) ifindex. */
 
 	assert_int_equal(ipv4_10_0_20_1.sin_addr.s_addr, iface->inaddr.s_addr);
-	assert_int_equal(0x00000000, iface->inaddr_old.s_addr);
+	assert_int_equal(0, iface->inaddrs_old.num);
 	assert_true(IN6_ARE_ADDR_EQUAL(&ipv6_global.sin6_addr, &iface->in6addr));
-	assert_true(IN6_IS_ADDR_UNSPECIFIED(&iface->in6addr_old));
+	assert_int_equal(0, iface->in6addrs_old.num);
 
 	assert_int_equal(-1, iface->sd);
 	assert_null(iface->mdns);
@@ -398,7 +398,7 @@ static void test_iface_init_one_ifc_ipv4_ll_global_ipv6(__attribute__((__unused_
 	will_return(__wrap_getifaddrs, &addrs);
 	will_return(__wrap_getifaddrs, 0);
 
-	iface_init(NULL);
+	iface_init();
 
 	check_one_iface_global_ipv4_ipv6(addrs->ifa_name);
 }
@@ -441,7 +441,7 @@ static void test_iface_init_two_ifc_ipv4_ll_global_ipv6_ipv4_ipv6(__attribute__(
 	will_return(__wrap_getifaddrs, &addrs);
 	will_return(__wrap_getifaddrs, 0);
 
-	iface_init(NULL);
+	iface_init();
 
 	check_one_iface_global_ipv4_ipv6(addrs->ifa_name);
 	struct iface *iface = iface_iterator(1);
@@ -453,9 +453,9 @@ static void test_iface_init_two_ifc_ipv4_ll_global_ipv6_ipv4_ipv6(__attribute__(
 	/* Ignoring the (undeterminable) ifindex. */
 
 	assert_int_equal(ipv4_10_0_20_1.sin_addr.s_addr, iface->inaddr.s_addr);
-	assert_int_equal(0x00000000, iface->inaddr_old.s_addr);
+	assert_int_equal(0, iface->inaddrs_old.num);
 	assert_true(IN6_ARE_ADDR_EQUAL(&ipv6_global.sin6_addr, &iface->in6addr));
-	assert_true(IN6_IS_ADDR_UNSPECIFIED(&iface->in6addr_old));
+	assert_int_equal(0, iface->in6addrs_old.num);
 
 	assert_int_equal(-1, iface->sd);
 	assert_null(iface->mdns);
@@ -471,9 +471,9 @@ static void test_iface_init_two_ifc_ipv4_ll_global_ipv6_ipv4_ipv6(__attribute__(
 	/* Ignoring the (undeterminable) ifindex. */
 
 	assert_int_equal(ipv4_192_168_2_100.sin_addr.s_addr, iface->inaddr.s_addr);
-	assert_int_equal(0x00000000, iface->inaddr_old.s_addr);
+	assert_int_equal(0, iface->inaddrs_old.num);
 	assert_true(IN6_ARE_ADDR_EQUAL(&ipv6_global_2.sin6_addr, &iface->in6addr));
-	assert_true(IN6_IS_ADDR_UNSPECIFIED(&iface->in6addr_old));
+	assert_int_equal(0, iface->in6addrs_old.num);
 
 	assert_int_equal(-1, iface->sd);
 	assert_null(iface->mdns);
@@ -487,6 +487,142 @@ static void test_iface_init_two_ifc_ipv4_ll_global_ipv6_ipv4_ipv6(__attribute__(
 
 
 
+/*
+ * Netlink style updates: addresses come and go one at a time, are kept
+ * sorted, and only an actual change flags the interface.
+ */
+static void test_iface_addr_delta(__attribute__((__unused__)) void **state)
+{
+	struct in_addr *v4;
+	struct iface *iface;
+
+	iface = iface_link(7, "nl0", IFF_UP | IFF_MULTICAST, 1500);
+	assert_non_null(iface);
+	assert_int_equal(1, iface->unused);	/* No address yet */
+	assert_int_equal(0, iface->changed);
+	assert_int_equal(1500, iface->linkmtu);
+
+	iface_addr(7, AF_INET, &ipv4_LL_169_254_100_32.sin_addr, 1);
+	assert_int_equal(0, iface->unused);
+	assert_int_equal(1, iface->changed);
+	assert_int_equal(ipv4_LL_169_254_100_32.sin_addr.s_addr, iface->inaddr.s_addr);
+
+	iface->changed = 0;
+	iface_addr(7, AF_INET, &ipv4_192_168_2_100.sin_addr, 1);
+	iface_addr(7, AF_INET, &ipv4_10_0_20_1.sin_addr, 1);
+	assert_int_equal(1, iface->changed);
+	assert_int_equal(3, iface->inaddrs.num);
+	v4 = iface->inaddrs.addr;
+	assert_true(memcmp(&v4[0], &v4[1], sizeof(*v4)) < 0);
+	assert_true(memcmp(&v4[1], &v4[2], sizeof(*v4)) < 0);
+	assert_false(is_linklocal(&iface->inaddr));
+
+	/* Same address again, e.g., a lifetime update, is no change */
+	iface->changed = 0;
+	iface_addr(7, AF_INET, &ipv4_10_0_20_1.sin_addr, 1);
+	assert_int_equal(0, iface->changed);
+	assert_int_equal(3, iface->inaddrs.num);
+
+	iface_addr(7, AF_INET6, &ipv6_link_local.sin6_addr, 1);
+	iface_addr(7, AF_INET6, &ipv6_global.sin6_addr, 1);
+	assert_true(IN6_ARE_ADDR_EQUAL(&ipv6_global.sin6_addr, &iface->in6addr));
+	iface_addr(7, AF_INET6, &ipv6_global.sin6_addr, 0);
+	assert_int_equal(1, iface->in6addrs.num);
+	assert_true(IN6_ARE_ADDR_EQUAL(&ipv6_link_local.sin6_addr, &iface->in6addr));
+
+	/* Not an interface we know, ignored */
+	iface_addr(8, AF_INET, &ipv4_10_0_20_1.sin_addr, 1);
+	assert_null(iface_iterator(0));
+
+	/* Link down, then gone */
+	iface->changed = 0;
+	iface_link(7, "nl0", IFF_MULTICAST, 1500);
+	assert_int_equal(1, iface->unused);
+	assert_int_equal(1, iface->changed);
+	iface_unlink(7);
+	assert_int_equal(1, iface->removed);
+}
+
+/* A full resync only flags the interfaces that differ from before */
+static void test_iface_resync(__attribute__((__unused__)) void **state)
+{
+	struct iface *nl0, *nl1;
+
+	nl0 = iface_link(3, "nl0", IFF_UP | IFF_MULTICAST, 0);
+	nl1 = iface_link(4, "nl1", IFF_UP | IFF_MULTICAST, 0);
+	iface_addr(3, AF_INET, &ipv4_10_0_20_1.sin_addr, 1);
+	iface_addr(4, AF_INET, &ipv4_192_168_2_100.sin_addr, 1);
+	nl0->changed = nl1->changed = 0;
+
+	iface_mark();
+	iface_link(3, "nl0", IFF_UP | IFF_MULTICAST, 0);
+	iface_addr(3, AF_INET, &ipv4_10_0_20_1.sin_addr, 1);
+	iface_link(4, "nl1", IFF_UP | IFF_MULTICAST, 0);
+	iface_addr(4, AF_INET, &ipv4_192_168_2_100.sin_addr, 1);
+	iface_addr(4, AF_INET6, &ipv6_global.sin6_addr, 1);
+	iface_sweep();
+	assert_int_equal(0, nl0->changed);
+	assert_int_equal(1, nl1->changed);
+
+	/* nl1 is not in the dump anymore */
+	nl1->changed = 0;
+	iface_mark();
+	iface_link(3, "nl0", IFF_UP | IFF_MULTICAST, 0);
+	iface_addr(3, AF_INET, &ipv4_10_0_20_1.sin_addr, 1);
+	iface_sweep();
+	assert_int_equal(0, nl0->changed);
+	assert_int_equal(1, nl1->removed);
+	assert_int_equal(1, nl1->unused);
+	assert_int_equal(1, nl1->changed);
+}
+
+/* A failed dump tears nothing down, the interfaces stay as they were */
+static void test_iface_resync_failed(__attribute__((__unused__)) void **state)
+{
+	struct iface *nl0, *nl1;
+
+	nl0 = iface_link(3, "nl0", IFF_UP | IFF_MULTICAST, 0);
+	nl1 = iface_link(4, "nl1", IFF_UP | IFF_MULTICAST, 0);
+	iface_addr(3, AF_INET, &ipv4_10_0_20_1.sin_addr, 1);
+	iface_addr(4, AF_INET, &ipv4_192_168_2_100.sin_addr, 1);
+	nl0->changed = nl1->changed = 0;
+
+	/* The dump fails after the link of nl0, before any address */
+	iface_mark();
+	iface_link(3, "nl0", IFF_UP | IFF_MULTICAST, 0);
+	iface_unmark();
+	assert_int_equal(0, nl0->changed);
+	assert_int_equal(0, nl0->unused);
+	assert_int_equal(1, nl0->inaddrs.num);
+	assert_int_equal(0, nl1->removed);
+	assert_int_equal(0, nl1->unused);
+	assert_int_equal(0, nl1->changed);
+	assert_int_equal(1, nl1->inaddrs.num);
+	assert_int_equal(ipv4_192_168_2_100.sin_addr.s_addr, nl1->inaddr.s_addr);
+
+	/* The next full dump is no change either */
+	iface_mark();
+	iface_link(3, "nl0", IFF_UP | IFF_MULTICAST, 0);
+	iface_addr(3, AF_INET, &ipv4_10_0_20_1.sin_addr, 1);
+	iface_link(4, "nl1", IFF_UP | IFF_MULTICAST, 0);
+	iface_addr(4, AF_INET, &ipv4_192_168_2_100.sin_addr, 1);
+	iface_sweep();
+	assert_int_equal(0, nl0->changed);
+	assert_int_equal(0, nl1->changed);
+	assert_int_equal(0, nl1->removed);
+
+	/* A link that did go down in the partial dump is still acted on */
+	iface_mark();
+	iface_link(4, "nl1", IFF_MULTICAST, 0);
+	iface_unmark();
+	assert_int_equal(0, nl0->changed);
+	assert_int_equal(1, nl1->unused);
+	assert_int_equal(1, nl1->changed);
+	assert_int_equal(0, nl1->removed);
+}
+
+
+
 /*
  * Regression test for issue #92: reconciling interface addresses must not
  * use-after-free while walking the published records.  Publish two unique
@@ -548,6 +684,83 @@ static void test_set_interface_addresses_no_uaf(__attribute__((__unused__)) void
 
 
 
+/* Live (not withdrawn) A/AAAA records of @host, returns the first */
+static mdns_record_t *live(mdns_daemon_t *d, const char *host, int *a, int *aaaa)
+{
+	mdns_record_t *r, *first = NULL;
+
+	*a = *aaaa = 0;
+	for (r = mdnsd_get_published(d, host); r; r = mdnsd_record_next(r)) {
+		const mdns_answer_t *data = mdnsd_record_data(r);
+
+		if (strcmp(data->name, host) || !data->ttl)
+			continue;
+		if (data->type == QTYPE_A)
+			(*a)++;
+		else if (data->type == QTYPE_AAAA)
+			(*aaaa)++;
+		else
+			continue;
+		if (!first)
+			first = r;
+	}
+
+	return first;
+}
+
+/*
+ * Sorted sets, reconciled for all hosts at once: records for addresses
+ * still there are kept as they are, the rest come and go.
+ */
+static void test_set_addresses(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	struct in_addr v4[2] = { ipv4_10_0_20_1.sin_addr, ipv4_192_168_2_100.sin_addr };
+	struct in6_addr v6[50];
+	mdns_record_t *r;
+	int i, a, aaaa;
+
+	assert_non_null(d);
+	for (i = 0; i < 50; i++) {
+		v6[i] = ipv6_global.sin6_addr;
+		v6[i].s6_addr[14] = i;
+	}
+
+	mdnsd_shared(d, "one.local.", QTYPE_A, 120);
+	mdnsd_shared(d, "two.local.", QTYPE_AAAA, 120);
+	assert_int_equal(0, mdnsd_set_addresses(d, v4, 2, v6, 50));
+
+	r = live(d, "one.local.", &a, &aaaa);
+	assert_int_equal(2, a);
+	assert_int_equal(50, aaaa);
+	live(d, "two.local.", &a, &aaaa);
+	assert_int_equal(2, a);
+	assert_int_equal(50, aaaa);
+
+	/* Nothing changed, nothing touched */
+	assert_int_equal(0, mdnsd_set_addresses(d, v4, 2, v6, 50));
+	assert_ptr_equal(r, live(d, "one.local.", &a, &aaaa));
+	assert_int_equal(2, a);
+	assert_int_equal(50, aaaa);
+
+	/* Lose one IPv4 and the first ten IPv6 addresses */
+	assert_int_equal(0, mdnsd_set_addresses(d, &v4[1], 1, &v6[10], 40));
+	live(d, "two.local.", &a, &aaaa);
+	assert_int_equal(1, a);
+	assert_int_equal(40, aaaa);
+
+	/* The per-host calls only touch their own family */
+	assert_int_equal(0, mdnsd_set_ipv6_addresses_for_host(d, "one.local.", v6, 0));
+	live(d, "one.local.", &a, &aaaa);
+	assert_int_equal(1, a);
+	assert_int_equal(0, aaaa);
+
+	mdnsd_shutdown(d);
+	mdnsd_free(d);
+}
+
+
+
 /*
  * Regression test for issue #84: removing a record while a unicast answer
  * is still queued for it must not leave a dangling pointer in the uanswers
@@ -620,7 +833,12 @@ int main(void)
 
 		cmocka_unit_test_teardown(test_iface_init_one_ifc_ipv4_ll_global_ipv6, teardown),
 
+		cmocka_unit_test_teardown(test_iface_addr_delta, teardown),
+		cmocka_unit_test_teardown(test_iface_resync, teardown),
+		cmocka_unit_test_teardown(test_iface_resync_failed, teardown),
+
 		cmocka_unit_test(test_set_interface_addresses_no_uaf),
+		cmocka_unit_test(test_set_addresses),
 		cmocka_unit_test(test_unicast_answer_no_uaf),
 	};
 
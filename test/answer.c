@@ -1,5 +1,6 @@
 #include "unittest.h"
 
+#include <stdio.h>
 #include <string.h>
 
 /* White-box: _a_copy() is static, so pull in the library source directly. */
@@ -79,7 +80,7 @@ static void test_additional_records_for_ptr(__attribute__((__unused__)) void **s
 	char *inst = "qotd._qotd._tcp.local.";
 	char *host = "qotd-host.local.";
 	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
-	struct answered seen = { 0 };
+	struct answered seen;
 	struct message m, resp;
 	struct in_addr ip;
 	struct in6_addr ip6;
@@ -107,6 +108,7 @@ static void test_additional_records_for_ptr(__attribute__((__unused__)) void **s
 	memset(&m, 0, sizeof(m));
 	message_an(&m, ptr->rr.name, QTYPE_PTR, QCLASS_IN, ptr->rr.ttl);
 	_a_copy(&m, &ptr->rr);
+	_answered_init(d, &seen);
 	_answered_add(&seen, ptr);
 	_additional(d, &m, ptr, &seen);
 
@@ -145,7 +147,7 @@ static void test_additional_records_dedup(__attribute__((__unused__)) void **sta
 	char *i2   = "i2._http._tcp.local.";
 	char *host = "shared.local.";
 	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
-	struct answered seen = { 0 };
+	struct answered seen;
 	struct message m, resp;
 	struct in_addr ip;
 	mdns_record_t *ptr1, *ptr2, *r;
@@ -171,6 +173,7 @@ static void test_additional_records_dedup(__attribute__((__unused__)) void **sta
 	_a_copy(&m, &ptr1->rr);
 	message_an(&m, ptr2->rr.name, QTYPE_PTR, QCLASS_IN, ptr2->rr.ttl);
 	_a_copy(&m, &ptr2->rr);
+	_answered_init(d, &seen);
 	_answered_add(&seen, ptr1);
 	_answered_add(&seen, ptr2);
 	_additional(d, &m, ptr1, &seen);
@@ -193,6 +196,97 @@ static void test_additional_records_dedup(__attribute__((__unused__)) void **sta
 	mdnsd_free(d);
 }
 
+/*
+ * Many instances on one host, more records than the additional section
+ * used to track: each SRV/TXT once, and the host's A only once.
+ */
+static void test_additional_records_many(__attribute__((__unused__)) void **state)
+{
+	static struct message m, resp;
+	char *type = "_http._tcp.local.";
+	char *host = "shared.local.";
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 9000);
+	mdns_record_t *ptr[70], *r;
+	struct answered seen;
+	struct in_addr ip;
+	char inst[64];
+	int i, a = 0;
+
+	assert_non_null(d);
+
+	r = mdnsd_shared(d, host, QTYPE_A, 120);
+	inet_pton(AF_INET, "192.168.0.1", &ip);
+	mdnsd_set_ip(d, r, ip);
+	for (i = 0; i < 70; i++) {
+		snprintf(inst, sizeof(inst), "i%d.%s", i, type);
+		ptr[i] = mdnsd_shared(d, type, QTYPE_PTR, 120);
+		mdnsd_set_host(d, ptr[i], inst);
+		r = mdnsd_shared(d, inst, QTYPE_SRV, 120);
+		mdnsd_set_srv(d, r, 0, 0, 80, host);
+		r = mdnsd_shared(d, inst, QTYPE_TXT, 4500);
+		mdnsd_set_raw(d, r, "\011txtvers=1", 10);
+	}
+
+	memset(&m, 0, sizeof(m));
+	_answered_init(d, &seen);
+	for (i = 0; i < 70; i++) {
+		assert_int_equal(0, _r_put(d, &m, message_an_wire, ptr[i]));
+		_answered_add(&seen, ptr[i]);
+	}
+	_additionals(d, &m, &seen);
+
+	memset(&resp, 0, sizeof(resp));
+	assert_int_equal(0, message_parse(&resp, message_packet(&m)));
+	assert_int_equal(70, resp.ancount);
+	assert_int_equal(141, resp.arcount);	/* 70 SRV + 70 TXT + one A */
+
+	for (i = 0; i < resp.arcount; i++) {
+		if (resp.ar[i].type == QTYPE_A)
+			a++;
+	}
+	assert_int_equal(1, a);
+
+	mdnsd_shutdown(d);
+	mdnsd_free(d);
+}
+
+/* Links follow records being added and removed, in any order */
+static void test_record_links(__attribute__((__unused__)) void **state)
+{
+	char *inst = "qotd._qotd._tcp.local.";
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	mdns_record_t *ptr, *srv, *txt;
+
+	assert_non_null(d);
+
+	/* Dangling until the instance shows up */
+	ptr = mdnsd_shared(d, "_qotd._tcp.local.", QTYPE_PTR, 120);
+	mdnsd_set_host(d, ptr, inst);
+	assert_null(ptr->target);
+
+	txt = mdnsd_shared(d, inst, QTYPE_TXT, 4500);
+	assert_ptr_equal(txt, ptr->target);
+	srv = mdnsd_shared(d, inst, QTYPE_SRV, 120);
+	assert_ptr_equal(srv, txt->same);
+	assert_ptr_equal(txt, srv->same);
+
+	/* Gone, the PTR moves on to what is left of the instance */
+	_r_done(d, txt);
+	assert_ptr_equal(srv, ptr->target);
+	assert_ptr_equal(srv, srv->same);
+	_r_done(d, srv);
+	assert_null(ptr->target);
+
+	/* Pointed elsewhere */
+	txt = mdnsd_shared(d, "other._qotd._tcp.local.", QTYPE_TXT, 4500);
+	assert_null(ptr->target);
+	mdnsd_set_host(d, ptr, "other._qotd._tcp.local.");
+	assert_ptr_equal(txt, ptr->target);
+
+	mdnsd_shutdown(d);
+	mdnsd_free(d);
+}
+
 /*
  * Issue #94: _a_match() compared rdata and names without guarding NULL, so
  * an empty-rdata record -- or a PTR/NS/CNAME with no decoded name -- handed
@@ -239,6 +333,8 @@ int main(void)
 		cmocka_unit_test(test_known_answer_srv_compression),
 		cmocka_unit_test(test_additional_records_for_ptr),
 		cmocka_unit_test(test_additional_records_dedup),
+		cmocka_unit_test(test_additional_records_many),
+		cmocka_unit_test(test_record_links),
 		cmocka_unit_test(test_a_match_empty_rdata),
 		cmocka_unit_test(test_a_match_null_rdname),
 	};
@@ -0,0 +1,654 @@
+/*
+ * Micro benchmarks for libmdnsd, not part of `make check`.  Build with
+ * `make -C test bench`, then run `test/bench <name>`, see README.md
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* White-box: benchmarks reach for internals, so pull in the library source. */
+#include "libmdnsd/mdnsd.c"
+
+#define NSVC 200
+
+static struct message pkt;	/* too big for the stack */
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Like mdnsd_out(), but only clear what the encoder relies on */
+static void reset(struct message *m)
+{
+	memset(m, 0, offsetof(struct message, _packet));
+}
+
+/* NSVC services like conf.c publishes them, returns the record array */
+static mdns_record_t **services(mdns_daemon_t *d, int *num)
+{
+	struct in_addr ip = { .s_addr = htonl(0xc0a82a65) };	/* 192.168.42.101 */
+	unsigned char txt[] = "\x0bvendor=Acme\x0dmodel=Example";
+	mdns_record_t **r;
+	char inst[128];
+	int i, n = 0;
+
+	r = calloc(NSVC * 3 + 1, sizeof(*r));
+	if (!r)
+		exit(1);
+
+	r[n] = mdnsd_shared(d, "myhost.local.", QTYPE_A, 120);
+	mdnsd_set_ip(d, r[n++], ip);
+	for (i = 0; i < NSVC; i++) {
+		snprintf(inst, sizeof(inst), "Service number %03d._http._tcp.local.", i);
+
+		r[n] = mdnsd_shared(d, "_http._tcp.local.", QTYPE_PTR, 120);
+		mdnsd_set_host(d, r[n++], inst);
+		r[n] = mdnsd_shared(d, inst, QTYPE_SRV, 120);
+		mdnsd_set_srv(d, r[n++], 0, 0, 8000 + i, "myhost.local.");
+		r[n] = mdnsd_shared(d, inst, QTYPE_TXT, 4500);
+		mdnsd_set_raw(d, r[n++], (char *)txt, sizeof(txt) - 1);
+	}
+
+	*num = n;
+	return r;
+}
+
+/*
+ * Encode every record into response packets, round after round, from the
+ * text form (mdns_answer_t) vs. the pre-encoded wire form.
+ */
+static int codec(int rounds)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	mdns_record_t **r;
+	double t[2];
+	long answers;
+	int i, j, n, pass;
+
+	if (!d)
+		return 1;
+	mdnsd_set_mtu(d, 1500);
+	r = services(d, &n);
+
+	for (pass = 0; pass < 2; pass++) {
+		double start = now();
+
+		answers = 0;
+		for (i = 0; i < rounds; i++) {
+			reset(&pkt);
+			for (j = 0; j < n; j++) {
+				struct message_mark mk;
+
+				message_mark(&pkt, &mk);
+				if (pass == 0) {
+					message_an(&pkt, r[j]->rr.name, r[j]->rr.type, QCLASS_IN, r[j]->rr.ttl);
+					_a_copy(&pkt, &r[j]->rr);
+				} else {
+					message_an_wire(&pkt, r[j]->wname, r[j]->rr.type, QCLASS_IN, r[j]->rr.ttl);
+					_r_copy(&pkt, r[j]);
+				}
+
+				/* Full, next packet */
+				if (message_packet_len(&pkt) > d->frame) {
+					message_rewind(&pkt, &mk);
+					reset(&pkt);
+					j--;
+					continue;
+				}
+				answers++;
+			}
+		}
+		t[pass] = now() - start;
+		printf("%-8s %8ld answers in %.3f sec, %10.0f answers/sec\n",
+		       pass ? "wire" : "text", answers, t[pass], answers / t[pass]);
+	}
+	printf("speedup  %.2fx\n", t[0] / t[1]);
+
+	free(r);
+	mdnsd_free(d);
+
+	return 0;
+}
+
+/*
+ * A browse storm: queriers on the link asking for the same service types,
+ * no known answers, with every response built from the records vs. sent
+ * from the memoized response packets.
+ */
+#define NTYPE 16
+
+static int browse(int rounds)
+{
+	struct in_addr ip = { .s_addr = htonl(0xc0a82a65) };	/* 192.168.42.101 */
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	struct message *q;
+	unsigned char *buf;
+	mdns_record_t *r[NTYPE * 4 + 1];
+	mdnsd_stats_t st;
+	inet_addr_t from, to;
+	char type[64], inst[128];
+	int i, j, n = 0, pass;
+	double t[2];
+	long sent;
+
+	q = calloc(NTYPE, sizeof(*q));
+	buf = calloc(NTYPE, MAX_PACKET_LEN);
+	if (!d || !q || !buf)
+		return 1;
+	mdnsd_set_mtu(d, 1500);
+
+	r[n] = mdnsd_shared(d, "myhost.local.", QTYPE_A, 120);
+	mdnsd_set_ip(d, r[n++], ip);
+	for (i = 0; i < NTYPE; i++) {
+		snprintf(type, sizeof(type), "_svc%02d._tcp.local.", i);
+		snprintf(inst, sizeof(inst), "Service number %03d.%s", i, type);
+
+		r[n] = mdnsd_shared(d, DISCO_NAME, QTYPE_PTR, 4500);
+		mdnsd_set_host(d, r[n++], type);
+		r[n] = mdnsd_shared(d, type, QTYPE_PTR, 120);
+		mdnsd_set_host(d, r[n++], inst);
+		r[n] = mdnsd_shared(d, inst, QTYPE_SRV, 120);
+		mdnsd_set_srv(d, r[n++], 0, 0, 8000 + i, "myhost.local.");
+		r[n] = mdnsd_shared(d, inst, QTYPE_TXT, 4500);
+		mdnsd_set_raw(d, r[n++], "\x07path=/", 7);
+
+		/* The queries, parsed once up front */
+		reset(&pkt);
+		message_qd(&pkt, type, QTYPE_PTR, QCLASS_IN);
+		memcpy(&buf[i * MAX_PACKET_LEN], message_packet(&pkt), message_packet_len(&pkt));
+		if (message_parse(&q[i], &buf[i * MAX_PACKET_LEN]))
+			return 1;
+	}
+	for (j = 0; j < n; j++)
+		r[j]->tries = 4;	/* Done announcing */
+	d->a_publish = NULL;
+
+	memset(&from, 0, sizeof(from));
+	from.ss_family = AF_INET;
+	((struct sockaddr_in *)&from)->sin_addr.s_addr = htonl(0xcb007101);	/* 203.0.113.1 */
+	((struct sockaddr_in *)&from)->sin_port = htons(5353);
+
+	for (pass = 0; pass < 2; pass++) {
+		double start = now();
+
+		sent = 0;
+		for (i = 0; i < rounds; i++) {
+			for (j = 0; j < NTYPE * 4 + 1; j++)
+				r[j]->last_sent.tv_sec = 0;	/* Skip rate limiting */
+
+			for (j = 0; j < NTYPE; j++) {
+				if (pass == 0)
+					d->gen++;	/* Nothing memoized holds */
+				mdnsd_in(d, &q[j], &from);
+
+				d->pause.tv_sec = 0;	/* Skip the 20-120 msec delay */
+				while (mdnsd_out(d, &pkt, &to))
+					sent++;
+			}
+		}
+		t[pass] = now() - start;
+		printf("%-8s %8ld responses in %.3f sec, %10.0f responses/sec\n",
+		       pass ? "memo" : "build", sent, t[pass], sent / t[pass]);
+	}
+	printf("speedup  %.2fx\n", t[0] / t[1]);
+
+	mdnsd_get_stats(d, &st);
+	printf("hits     %lu, misses %lu\n", st.response_hits, st.response_misses);
+
+	free(buf);
+	free(q);
+	mdnsd_free(d);
+
+	return 0;
+}
+
+/*
+ * Chatter about other hosts and services: queries for names we neither
+ * publish nor query, with every question looked up in the hash tables
+ * vs. turned away by the name filter.
+ */
+static int filter(int rounds)
+{
+	static unsigned char bloom[BLOOM_SIZE];
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	unsigned char *buf;
+	struct message *q;
+	inet_addr_t from;
+	char name[64];
+	double t[2];
+	int i, j, n;
+	long asked;
+
+	q = calloc(NTYPE, sizeof(*q));
+	buf = calloc(NTYPE, MAX_PACKET_LEN);
+	if (!d || !q || !buf)
+		return 1;
+	free(services(d, &n));
+	memcpy(bloom, d->bloom, sizeof(bloom));
+
+	/* Four questions each, as many a querier bundles them */
+	for (i = 0; i < NTYPE; i++) {
+		reset(&pkt);
+		for (j = 0; j < 4; j++) {
+			snprintf(name, sizeof(name), "_other%02d._tcp.local.", i * 4 + j);
+			message_qd(&pkt, name, QTYPE_PTR, QCLASS_IN);
+		}
+		memcpy(&buf[i * MAX_PACKET_LEN], message_packet(&pkt), message_packet_len(&pkt));
+		if (message_parse(&q[i], &buf[i * MAX_PACKET_LEN]))
+			return 1;
+	}
+
+	memset(&from, 0, sizeof(from));
+	from.ss_family = AF_INET;
+	((struct sockaddr_in *)&from)->sin_addr.s_addr = htonl(0xcb007101);	/* 203.0.113.1 */
+	((struct sockaddr_in *)&from)->sin_port = htons(5353);
+
+	for (n = 0; n < 2; n++) {
+		double start = now();
+
+		if (n == 0)
+			memset(d->bloom, 255, sizeof(d->bloom));	/* Lets everything by */
+		else
+			memcpy(d->bloom, bloom, sizeof(d->bloom));
+
+		asked = 0;
+		for (i = 0; i < rounds * 10; i++) {
+			for (j = 0; j < NTYPE; j++) {
+				mdnsd_in(d, &q[j], &from);
+				asked += q[j].qdcount;
+			}
+		}
+		t[n] = now() - start;
+		printf("%-8s %8ld questions in %.3f sec, %10.0f questions/sec\n",
+		       n ? "filter" : "lookup", asked, t[n], asked / t[n]);
+	}
+	printf("speedup  %.2fx\n", t[0] / t[1]);
+
+	free(buf);
+	free(q);
+	mdnsd_free(d);
+
+	return 0;
+}
+
+/* The unkeyed ELF hash the tables used before SipHash, for comparison */
+static unsigned int elfhash(const char *s)
+{
+	const unsigned char *name = (const unsigned char *)s;
+	unsigned long h = 0, g;
+
+	while (*name) {
+		h = (h << 4) + (unsigned long)(*name++);
+		if ((g = (h & 0xF0000000UL)) != 0)
+			h ^= (g >> 24);
+		h &= ~g;
+	}
+
+	return (unsigned int)h;
+}
+
+struct node {
+	char name[32];
+	unsigned int hash;
+	struct node *next;
+};
+
+/*
+ * A collision attack on the cache: NCOLL names crafted to share one
+ * bucket under the ELF hash, looked up in a table of LPRIME buckets
+ * indexed by the ELF hash, walking strcmp() chains, vs. by the keyed
+ * hash, comparing the kept hash first.  Same as _c_next() before/after.
+ */
+#define NCOLL 2000
+
+static int collide(int rounds)
+{
+	struct node *tab[2][LPRIME], *nodes, *n;
+	unsigned int target;
+	double t[2];
+	long found;
+	int i, j, k, pass, longest[2];
+
+	nodes = calloc(NCOLL, sizeof(*nodes));
+	if (!nodes)
+		return 1;
+
+	/* Craft the names, easy with an unkeyed hash */
+	target = elfhash("flood.local.") % LPRIME;
+	for (i = 0, j = 0; i < NCOLL; j++) {
+		snprintf(nodes[i].name, sizeof(nodes[i].name), "h%x.local.", j);
+		if (elfhash(nodes[i].name) % LPRIME == target)
+			i++;
+	}
+
+	memset(tab, 0, sizeof(tab));
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < NCOLL; i++) {
+			n = &nodes[i];
+			if (pass == 0) {
+				n->hash = elfhash(n->name);
+			} else {
+				n = calloc(1, sizeof(*n));
+				if (!n)
+					return 1;
+				*n = nodes[i];
+				n->hash = strhash(n->name);
+			}
+			n->next = tab[pass][n->hash % LPRIME];
+			tab[pass][n->hash % LPRIME] = n;
+		}
+
+		longest[pass] = 0;
+		for (i = 0; i < LPRIME; i++) {
+			for (k = 0, n = tab[pass][i]; n; n = n->next)
+				k++;
+			if (k > longest[pass])
+				longest[pass] = k;
+		}
+	}
+
+	for (pass = 0; pass < 2; pass++) {
+		double start = now();
+
+		found = 0;
+		for (i = 0; i < rounds / 100 + 1; i++) {
+			for (j = 0; j < NCOLL; j++) {
+				const char *name = nodes[j].name;
+				unsigned int h;
+
+				if (pass == 0) {
+					h = elfhash(name);
+					for (n = tab[0][h % LPRIME]; n; n = n->next) {
+						if (!strcmp(n->name, name))
+							break;
+					}
+				} else {
+					h = strhash(name);
+					for (n = tab[1][h % LPRIME]; n; n = n->next) {
+						if (n->hash == h && !strcmp(n->name, name))
+							break;
+					}
+				}
+				if (n)
+					found++;
+			}
+		}
+		t[pass] = now() - start;
+		printf("%-8s %8ld lookups in %.3f sec, %10.0f lookups/sec, longest chain %d\n",
+		       pass ? "siphash" : "elf", found, t[pass], found / t[pass], longest[pass]);
+	}
+	printf("speedup  %.2fx\n", t[0] / t[1]);
+
+	for (i = 0; i < LPRIME; i++) {
+		while ((n = tab[1][i])) {
+			tab[1][i] = n->next;
+			free(n);
+		}
+	}
+	free(nodes);
+
+	return 0;
+}
+
+/* Resident set size in kB, from /proc */
+static long rss(void)
+{
+	char line[128];
+	long kb = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/self/status", "r");
+	if (!fp)
+		return 0;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "VmRSS: %ld", &kb) == 1)
+			break;
+	}
+	fclose(fp);
+
+	return kb;
+}
+
+/* Bytes held by the cache, one allocation per entry */
+static long cache_bytes(mdns_daemon_t *d, long *entries)
+{
+	struct cached *c;
+	long bytes = 0;
+	int i;
+
+	*entries = 0;
+	for (i = 0; i < LPRIME; i++) {
+		for (c = d->cache[i]; c; c = c->next) {
+			bytes += _c_size(c);
+			(*entries)++;
+		}
+	}
+
+	return bytes;
+}
+
+/*
+ * A busy LAN: NHOST devices announcing a service each, with addresses,
+ * heard by a responder like mdnsd, caching everything vs. only what it
+ * queries.  Each policy runs in its own process, for a clean RSS.
+ */
+#define NHOST 2000
+
+static void lan_run(mdnsd_cache_policy_t policy, int rounds)
+{
+	static const char *policies[] = { "all", "queried", "own" };
+	static unsigned char buf[MAX_PACKET_LEN];
+	static struct message heard;
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	struct in6_addr ip6 = IN6ADDR_LOOPBACK_INIT;
+	long before, bytes, entries;
+	char host[64], inst[128];
+	unsigned char txt[] = "\x0bvendor=Acme\x0dmodel=Example";
+	mdnsd_stats_t st;
+	inet_addr_t from;
+	struct in_addr ip;
+	double start;
+	int i, j, n;
+
+	if (!d)
+		exit(1);
+	mdnsd_set_cache_policy(d, policy);
+	free(services(d, &n));
+
+	memset(&from, 0, sizeof(from));
+	from.ss_family = AF_INET;
+	((struct sockaddr_in *)&from)->sin_port = htons(5353);
+
+	before = rss();
+	start = now();
+	for (j = 0; j < rounds / 100 + 1; j++) {
+		for (i = 0; i < NHOST; i++) {
+			snprintf(host, sizeof(host), "device%04d.local.", i);
+			snprintf(inst, sizeof(inst), "Device %04d._ipp._tcp.local.", i);
+			ip.s_addr = htonl(0x0a000000 + i);	/* 10.0.x.y */
+			ip6.s6_addr[15] = i & 0xff;
+			ip6.s6_addr[14] = i >> 8;
+
+			reset(&pkt);
+			pkt.header.qr = 1;
+			message_an(&pkt, "_ipp._tcp.local.", QTYPE_PTR, QCLASS_IN, 4500);
+			message_rdata_name(&pkt, inst);
+			message_an(&pkt, inst, QTYPE_SRV, QCLASS_IN + 32768, 120);
+			message_rdata_srv(&pkt, 0, 0, 631, host);
+			message_an(&pkt, inst, QTYPE_TXT, QCLASS_IN + 32768, 4500);
+			message_rdata_raw(&pkt, txt, sizeof(txt) - 1);
+			message_an(&pkt, host, QTYPE_A, QCLASS_IN + 32768, 120);
+			message_rdata_ipv4(&pkt, ip);
+			message_an(&pkt, host, QTYPE_AAAA, QCLASS_IN + 32768, 120);
+			message_rdata_ipv6(&pkt, ip6);
+
+			memcpy(buf, message_packet(&pkt), message_packet_len(&pkt));
+			memset(&heard, 0, sizeof(heard));
+			if (message_parse(&heard, buf))
+				exit(1);
+			((struct sockaddr_in *)&from)->sin_addr = ip;
+			mdnsd_in(d, &heard, &from);
+		}
+	}
+
+	bytes = cache_bytes(d, &entries);
+	mdnsd_get_stats(d, &st);
+	printf("%-8s %8ld cached, %8ld bytes, %6ld kB RSS, %8lu declined, %.3f sec\n",
+	       policies[policy], entries, bytes, rss() - before, st.cache_declined, now() - start);
+	mdnsd_free(d);
+}
+
+static int lan(int rounds)
+{
+	mdnsd_cache_policy_t policy;
+
+	for (policy = MDNSD_CACHE_ALL; policy <= MDNSD_CACHE_OWN; policy++) {
+		pid_t pid = fork();
+		int status;
+
+		if (pid < 0)
+			return 1;
+		if (!pid) {
+			lan_run(policy, rounds);
+			exit(0);
+		}
+		if (waitpid(pid, &status, 0) < 0 || status)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * A router with NIFACE VLAN interfaces, two contexts on each, like mdnsd
+ * runs, publishing the same NSVC services: each context with its own
+ * copy of names and rdata vs. all of them attached to one store.  Then
+ * the TXT of every service changes, on every context, the total time of
+ * which is the cost of one catalogue update.  Each in its own process,
+ * for a clean RSS.
+ */
+#define NIFACE 200
+
+static void store_run(int shared, int rounds)
+{
+	const char *txt[] = { "\x0bvendor=Acme\x0dmodel=Another", "\x0bvendor=Acme\x0dmodel=Example" };
+	mdns_daemon_t *d[NIFACE * 2];
+	mdns_record_t **r[NIFACE * 2];
+	mdnsd_store_t *s = NULL;
+	long before, kb;
+	double start, t, upd;
+	int i, j, k, n;
+
+	if (shared)
+		s = mdnsd_store_new();
+
+	before = rss();
+	start = now();
+	for (i = 0; i < NIFACE * 2; i++) {
+		d[i] = mdnsd_new(QCLASS_IN, 1000);
+		if (!d[i] || mdnsd_set_store(d[i], s))
+			exit(1);
+		r[i] = services(d[i], &n);
+	}
+	t = now() - start;
+	kb = rss() - before;
+
+	/* Every third record is a TXT, see services() */
+	start = now();
+	for (k = 0; k < rounds / 100 + 1; k++) {
+		for (i = 0; i < NIFACE * 2; i++) {
+			for (j = 3; j < n; j += 3)
+				mdnsd_set_raw(d[i], r[i][j], txt[k & 1], strlen(txt[k & 1]));
+		}
+	}
+	upd = (now() - start) / (rounds / 100 + 1);
+	printf("%-8s %6d contexts, %6ld kB RSS, %.3f sec to publish, %.1f ms to update all, %8.0f updates/sec\n",
+	       shared ? "shared" : "private", NIFACE * 2, kb, t, upd * 1000, NIFACE * 2 * NSVC / upd);
+
+	for (i = 0; i < NIFACE * 2; i++) {
+		free(r[i]);
+		mdnsd_free(d[i]);
+	}
+	mdnsd_store_free(s);
+}
+
+static int store(int rounds)
+{
+	int shared;
+
+	for (shared = 0; shared < 2; shared++) {
+		pid_t pid = fork();
+		int status;
+
+		if (pid < 0)
+			return 1;
+		if (!pid) {
+			store_run(shared, rounds);
+			exit(0);
+		}
+		if (waitpid(pid, &status, 0) < 0 || status)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int usage(int rc)
+{
+	fprintf(stderr,
+		"Usage: bench [-n ROUNDS] NAME\n"
+		"\n"
+		"Benchmarks:\n"
+		"  codec     Encode published records into packets, answers/sec\n"
+		"  browse    Answer a storm of identical queries, responses/sec\n"
+		"  filter    Turn away questions for names that are not ours, questions/sec\n"
+		"  lan       Hear a busy LAN, cache size and RSS per cache policy\n"
+		"  collide   Look up names crafted to collide in the cache, lookups/sec\n"
+		"  store     Publish the same services on 200 interfaces, RSS and updates/sec\n");
+
+	return rc;
+}
+
+int main(int argc, char *argv[])
+{
+	int rounds = 2000;
+	int c;
+
+	while ((c = getopt(argc, argv, "hn:")) != EOF) {
+		switch (c) {
+		case 'h':
+			return usage(0);
+		case 'n':
+			rounds = atoi(optarg);
+			break;
+		default:
+			return usage(1);
+		}
+	}
+
+	if (optind >= argc)
+		return usage(1);
+
+	mdnsd_log_level("err");
+	if (!strcmp(argv[optind], "codec"))
+		return codec(rounds);
+	if (!strcmp(argv[optind], "browse"))
+		return browse(rounds);
+	if (!strcmp(argv[optind], "filter"))
+		return filter(rounds);
+	if (!strcmp(argv[optind], "lan"))
+		return lan(rounds);
+	if (!strcmp(argv[optind], "collide"))
+		return collide(rounds);
+	if (!strcmp(argv[optind], "store"))
+		return store(rounds);
+
+	return usage(1);
+}
@@ -0,0 +1,343 @@
+#include "unittest.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* White-box: the cache is static, so pull in the library source. */
+#include "libmdnsd/mdnsd.c"
+
+#define HOST  "printer.local."
+#define PEER  "laptop.local."
+#define NPEER 50
+#define BUDGET 16384
+#define NFLOOD 5000
+
+/* A busy link: our own name, the one we query, and NPEER others, A records all */
+static void chatter(mdns_daemon_t *d)
+{
+	struct in_addr ip;
+	inet_addr_t from;
+	char name[64];
+	int i;
+
+	peer(&from, 0);
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.header.qr = 1;
+	for (i = 0; i < NPEER + 2; i++) {
+		if (i == 0)
+			snprintf(name, sizeof(name), HOST);
+		else if (i == 1)
+			snprintf(name, sizeof(name), PEER);
+		else
+			snprintf(name, sizeof(name), "device%02d.local.", i);
+
+		ip.s_addr = htonl(0xcb007100 + i);	/* 203.0.113.x */
+		message_an(&pkt, name, QTYPE_A, QCLASS_IN, 120);
+		message_rdata_ipv4(&pkt, ip);
+	}
+	assert_int_equal(0, mdnsd_in(d, wire(&pkt), &from));
+}
+
+/* Entries cached now */
+static int cached(mdns_daemon_t *d)
+{
+	struct cached *c;
+	int i, n = 0;
+
+	for (i = 0; i < LPRIME; i++) {
+		for (c = d->cache[i]; c; c = c->next)
+			n++;
+	}
+
+	return n;
+}
+
+/*
+ * A flood of @num unique names, ten per packet, with the given TTL.  The
+ * byte budget must also bound the number of entries, every one is at least
+ * a struct cached.  Not RSS, which allocator slack and reuse make noisy.
+ */
+static void flood(mdns_daemon_t *d, int first, int num, unsigned long ttl)
+{
+	struct in_addr ip;
+	inet_addr_t from;
+	char name[64];
+	int i;
+
+	peer(&from, 249);
+
+	for (i = first; i < first + num; i += 10) {
+		int j;
+
+		memset(&pkt, 0, sizeof(pkt));
+		pkt.header.qr = 1;
+		for (j = i; j < i + 10; j++) {
+			snprintf(name, sizeof(name), "flood%05d.local.", j);
+			ip.s_addr = htonl(0x0a000000 + j);	/* 10.x.y.z */
+			message_an(&pkt, name, QTYPE_A, QCLASS_IN, ttl);
+			message_rdata_ipv4(&pkt, ip);
+		}
+		assert_int_equal(0, mdnsd_in(d, wire(&pkt), &from));
+		assert_true(d->stats.cache_bytes <= BUDGET);
+		assert_true(cached(d) <= (int)(BUDGET / sizeof(struct cached)));
+	}
+}
+
+/* The bytes accounted for match what is actually cached */
+static size_t held(mdns_daemon_t *d)
+{
+	struct cached *c;
+	size_t bytes = 0;
+	int i;
+
+	for (i = 0; i < LPRIME; i++) {
+		for (c = d->cache[i]; c; c = c->next)
+			bytes += _c_size(c);
+	}
+
+	return bytes;
+}
+
+static mdns_daemon_t *setup(mdnsd_cache_policy_t policy)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+
+	assert_non_null(d);
+	mdnsd_set_cache_policy(d, policy);
+	mdnsd_shared(d, HOST, QTYPE_A, 120);
+	mdnsd_query(d, PEER, QTYPE_A, ans, NULL);
+
+	return d;
+}
+
+static void teardown(mdns_daemon_t *d)
+{
+	mdnsd_shutdown(d);
+	mdnsd_free(d);
+}
+
+/* By default everything heard is cached */
+static void test_policy_all(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = setup(MDNSD_CACHE_ALL);
+	mdnsd_stats_t st;
+
+	chatter(d);
+	assert_int_equal(NPEER + 2, cached(d));
+	mdnsd_get_stats(d, &st);
+	assert_int_equal(0, st.cache_declined);
+
+	teardown(d);
+}
+
+/* Only what we ask for, and it still reaches the query */
+static void test_policy_queried(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = setup(MDNSD_CACHE_QUERIED);
+	mdnsd_stats_t st;
+
+	chatter(d);
+	assert_int_equal(1, cached(d));
+	assert_non_null(mdnsd_list(d, PEER, QTYPE_A, NULL));
+	mdnsd_get_stats(d, &st);
+	assert_int_equal(NPEER + 1, st.cache_declined);
+
+	teardown(d);
+}
+
+/* Only what others say about our names */
+static void test_policy_own(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = setup(MDNSD_CACHE_OWN);
+
+	chatter(d);
+	assert_int_equal(1, cached(d));
+	assert_non_null(mdnsd_list(d, HOST, QTYPE_A, NULL));
+	assert_null(mdnsd_list(d, PEER, QTYPE_A, NULL));
+
+	teardown(d);
+}
+
+/* A flood stays within budget, and what we query for stays */
+static void test_budget_flood(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = setup(MDNSD_CACHE_ALL);
+	mdnsd_stats_t st;
+
+	mdnsd_set_cache_budget(d, BUDGET);
+	chatter(d);
+	flood(d, 0, NFLOOD, 120);
+
+	mdnsd_get_stats(d, &st);
+	printf("Flood of %d: %d cached, %zu bytes, %lu evicted\n", NFLOOD, cached(d), st.cache_bytes, st.cache_evictions);
+	assert_true(st.cache_bytes <= BUDGET);
+	assert_int_equal(held(d), st.cache_bytes);
+	assert_true(st.cache_evictions > NFLOOD / 2);
+	assert_non_null(mdnsd_list(d, PEER, QTYPE_A, NULL));
+
+	/* Lowering the budget evicts right away */
+	mdnsd_set_cache_budget(d, BUDGET / 2);
+	mdnsd_get_stats(d, &st);
+	assert_true(st.cache_bytes <= BUDGET / 2);
+	assert_non_null(mdnsd_list(d, PEER, QTYPE_A, NULL));
+
+	teardown(d);
+}
+
+/* Of the unqueried, the ones nearest expiry go first */
+static void test_budget_ttl(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = setup(MDNSD_CACHE_ALL);
+	char name[64];
+	int i, n = 0;
+
+	mdnsd_set_cache_budget(d, BUDGET);
+	flood(d, 0, 50, 4500);
+	flood(d, 50, NFLOOD, 10);
+
+	for (i = 0; i < 50; i++) {
+		snprintf(name, sizeof(name), "flood%05d.local.", i);
+		if (mdnsd_list(d, name, QTYPE_A, NULL))
+			n++;
+	}
+	assert_int_equal(50, n);
+
+	teardown(d);
+}
+
+static int added, expired;
+
+static int count(mdns_answer_t *a, __attribute__((__unused__)) void *arg)
+{
+	if (a->ttl)
+		added++;
+	else
+		expired++;
+
+	return 0;
+}
+
+/* PEER announcing its address, or its goodbye, over IPv4 or IPv6 */
+static void announce(mdns_daemon_t *d, int v6, unsigned long ttl)
+{
+	struct in_addr ip = { .s_addr = htonl(0xcb007102) };	/* 203.0.113.2 */
+	inet_addr_t from;
+
+	if (v6) {
+		memset(&from, 0, sizeof(from));
+		from.ss_family = AF_INET6;
+		/* 2001:db8::2, documentation prefix */
+		inet_pton(AF_INET6, "2001:db8::2", &((struct sockaddr_in6 *)&from)->sin6_addr);
+		((struct sockaddr_in6 *)&from)->sin6_port = htons(5353);
+	} else
+		peer(&from, 1);
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.header.qr = 1;
+	message_an(&pkt, PEER, QTYPE_A, QCLASS_IN, ttl);
+	message_rdata_ipv4(&pkt, ip);
+	assert_int_equal(0, mdnsd_in(d, wire(&pkt), &from));
+}
+
+/* The IPv4 and IPv6 contexts of one link, sharing a cache, both querying */
+static void link_setup(mdns_daemon_t **d4, mdns_daemon_t **d6)
+{
+	*d4 = mdnsd_new(QCLASS_IN, 1000);
+	*d6 = mdnsd_new(QCLASS_IN, 1000);
+	assert_non_null(*d4);
+	assert_non_null(*d6);
+	mdnsd_set_family(*d6, AF_INET6);
+	assert_int_equal(0, mdnsd_share_cache(*d6, *d4));
+
+	mdnsd_query(*d4, PEER, QTYPE_A, count, NULL);
+	mdnsd_query(*d6, PEER, QTYPE_A, count, NULL);
+	added = expired = 0;
+}
+
+/* A record announced over both transports is cached, and reported, once */
+static void test_shared_once(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d4, *d6;
+	struct cached *c;
+	mdnsd_stats_t st;
+
+	link_setup(&d4, &d6);
+	announce(d4, 0, 120);
+	announce(d6, 1, 120);
+
+	assert_int_equal(1, cached(d4));
+	assert_int_equal(1, cached(d6));
+	assert_int_equal(1, added);
+	c = _c_next(d6, NULL, PEER, QTYPE_A);
+	assert_non_null(c);
+	assert_int_equal(3, c->seen);
+
+	mdnsd_get_stats(d6, &st);
+	assert_int_equal(held(d4), st.cache_bytes);
+
+	/* Nor again, once sharing */
+	assert_int_equal(-1, mdnsd_share_cache(d4, d6));
+	assert_int_equal(EINVAL, errno);
+
+	teardown(d6);
+	teardown(d4);
+}
+
+/* A goodbye over one transport leaves what is still on the other */
+static void test_shared_goodbye(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d4, *d6;
+
+	link_setup(&d4, &d6);
+	announce(d4, 0, 120);
+	announce(d6, 1, 120);
+
+	announce(d4, 0, 0);
+	assert_int_equal(1, cached(d4));
+	assert_int_equal(2, _c_next(d4, NULL, PEER, QTYPE_A)->seen);
+	assert_int_equal(0, expired);
+
+	announce(d6, 1, 0);
+	assert_int_equal(0, cached(d4));
+	assert_int_equal(1, expired);
+
+	teardown(d6);
+	teardown(d4);
+}
+
+/* The cache outlives either context, with the other's query */
+static void test_shared_free(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d4, *d6;
+
+	link_setup(&d4, &d6);
+	announce(d4, 0, 120);
+	teardown(d4);
+
+	assert_int_equal(1, cached(d6));
+	assert_null(d6->peer);
+	announce(d6, 1, 120);
+	announce(d6, 1, 0);
+	assert_int_equal(0, cached(d6));
+	assert_int_equal(1, added);
+	assert_int_equal(1, expired);
+
+	teardown(d6);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_policy_all),
+		cmocka_unit_test(test_policy_queried),
+		cmocka_unit_test(test_policy_own),
+		cmocka_unit_test(test_budget_flood),
+		cmocka_unit_test(test_budget_ttl),
+		cmocka_unit_test(test_shared_once),
+		cmocka_unit_test(test_shared_goodbye),
+		cmocka_unit_test(test_shared_free),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
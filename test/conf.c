@@ -0,0 +1,489 @@
+#include "unittest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+/* White-box: settles the records to see what a reload sends, so pull in the library source. */
+#include "libmdnsd/mdnsd.c"
+#include "whitebox.h"
+#include "src/mdnsd.h"
+
+#define NIFACE 100
+#define NSVC   10
+
+/*
+ * Mock-ups
+ */
+static int opens;			/* Service files parsed */
+static int syncs;			/* Address reconciliations */
+
+FILE *__real_fopen(const char *path, const char *mode);
+FILE *__wrap_fopen(const char *path, const char *mode)
+{
+	if (mode[0] == 'r')
+		opens++;
+
+	return __real_fopen(path, mode);
+}
+
+int __real_mdnsd_set_addresses(mdns_daemon_t *d, const struct in_addr *v4, size_t v4c,
+				const struct in6_addr *v6, size_t v6c);
+int __wrap_mdnsd_set_addresses(mdns_daemon_t *d, const struct in_addr *v4, size_t v4c,
+			       const struct in6_addr *v6, size_t v6c)
+{
+	syncs++;
+	return __real_mdnsd_set_addresses(d, v4, v4c, v6, v6c);
+}
+
+/* Lives in mdnsd.c, along with main() */
+void mdnsd_conflict(char *name, int type, void *arg)
+{
+	(void)name;
+	(void)type;
+	(void)arg;
+}
+
+static char dir[] = "/tmp/mdnsd-conf-XXXXXX";
+static struct iface ifaces[NIFACE];
+static struct in_addr addrs[NIFACE];
+
+static void service(int n, int port, const char *txt, time_t mtime, suseconds_t usec)
+{
+	struct timeval tv[2] = { { mtime, usec }, { mtime, usec } };
+	char fn[sizeof(dir) + 32];
+	FILE *fp;
+
+	snprintf(fn, sizeof(fn), "%s/svc%02d.service", dir, n);
+	fp = __real_fopen(fn, "w");
+	assert_non_null(fp);
+	fprintf(fp, "name Service %02d\ntype _http._tcp\nport %d\ntxt %s\n", n, port, txt);
+	fclose(fp);
+	assert_int_equal(0, utimes(fn, tv));
+}
+
+static void unlink_service(int n)
+{
+	char fn[sizeof(dir) + 32];
+
+	snprintf(fn, sizeof(fn), "%s/svc%02d.service", dir, n);
+	assert_int_equal(0, unlink(fn));
+}
+
+static int setup(__attribute__((__unused__)) void **state)
+{
+	int i;
+
+	if (!mkdtemp(dir))
+		return -1;
+
+	for (i = 0; i < NSVC; i++)
+		service(i, 8000 + i, "path=/", 1000000000, 0);
+
+	for (i = 0; i < NIFACE; i++) {
+		struct iface *iface = &ifaces[i];
+
+		snprintf(iface->ifname, sizeof(iface->ifname), "eth%d", i);
+		iface->hostid = 1;
+		addrs[i].s_addr = htonl(0xc6336401 + i);	/* 198.51.100.1 + i */
+		iface->inaddrs.addr = &addrs[i];
+		iface->inaddrs.size = sizeof(addrs[i]);
+		iface->inaddrs.num = iface->inaddrs.max = 1;
+		iface->mdns = mdnsd_new(QCLASS_IN, 1000);
+		iface->mdns6 = mdnsd_new(QCLASS_IN, 1000);
+		if (!iface->mdns || !iface->mdns6)
+			return -1;
+		mdnsd_set_family(iface->mdns6, AF_INET6);
+	}
+
+	return 0;
+}
+
+static int teardown(__attribute__((__unused__)) void **state)
+{
+	char fn[sizeof(dir) + 32];
+	int i;
+
+	for (i = 0; i < NIFACE; i++) {
+		mdnsd_free(ifaces[i].mdns);
+		mdnsd_free(ifaces[i].mdns6);
+		while (!SLIST_EMPTY(&ifaces[i].renames)) {
+			struct rename *rn = SLIST_FIRST(&ifaces[i].renames);
+
+			SLIST_REMOVE_HEAD(&ifaces[i].renames, link);
+			free(rn);
+		}
+	}
+	conf_exit();
+
+	for (i = 0; i < NSVC; i++) {
+		snprintf(fn, sizeof(fn), "%s/svc%02d.service", dir, i);
+		unlink(fn);
+	}
+	rmdir(dir);
+
+	return 0;
+}
+
+/* Like a SIGHUP, or the service directory watch, in main() */
+static int update(void)
+{
+	int i, changes;
+
+	opens = syncs = 0;
+	changes = conf_scan(dir);
+	for (i = 0; i < NIFACE; i++)
+		conf_init(&ifaces[i], "host");
+
+	return changes;
+}
+
+/* Same, timed, in msec */
+static double reload(void)
+{
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	update();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+/* Done probing and announcing everything, goodbyes are sent */
+static void settle(mdns_daemon_t *d)
+{
+	mdns_record_t *r, *next;
+	int i;
+
+	d->probing = d->a_now = d->a_pause = d->a_publish = NULL;
+	for (i = 0; i < SPRIME; i++) {
+		for (r = d->published[i]; r; r = next) {
+			next = r->next;
+			r->list = NULL;
+			if (!r->rr.ttl) {
+				_r_done(d, r);
+				continue;
+			}
+
+			if (r->unique)
+				r->unique = 5;
+			r->tries = 4;
+		}
+	}
+}
+
+static void settle_all(void)
+{
+	int i;
+
+	for (i = 0; i < NIFACE; i++) {
+		settle(ifaces[i].mdns);
+		settle(ifaces[i].mdns6);
+	}
+}
+
+/* Records on their way out, with a goodbye */
+static int goodbyes(mdns_daemon_t *d)
+{
+	mdns_record_t *r;
+	int n = 0;
+
+	for (r = mdnsd_record_iterator(d, NULL); r; r = mdnsd_record_iterator(d, r)) {
+		if (!r->rr.ttl)
+			n++;
+	}
+
+	return n;
+}
+
+/* The port of the @n:th service's SRV record in @d, or -1 if not published */
+static int port(mdns_daemon_t *d, int n)
+{
+	const mdns_answer_t *a;
+	mdns_record_t *r;
+	char name[64];
+
+	snprintf(name, sizeof(name), "Service %02d._http._tcp.local.", n);
+	r = mdnsd_find(d, name, QTYPE_SRV);
+	if (!r || !r->rr.ttl)
+		return -1;
+
+	a = mdnsd_record_data(r);
+	assert_string_equal("host.local.", a->rdname);
+
+	return a->srv.port;
+}
+
+/* Each .service file is read once per reload, not once per interface */
+static void test_reload_parses_once(__attribute__((__unused__)) void **state)
+{
+	double ms;
+
+	ms = reload();
+	printf("Initial load, %d interfaces: %d files read, %.2f ms\n", NIFACE, opens, ms);
+	assert_int_equal(NSVC, opens);
+	assert_int_equal(8003, port(ifaces[0].mdns, 3));
+	assert_int_equal(8003, port(ifaces[NIFACE - 1].mdns6, 3));
+
+	ms = reload();
+	printf("Unchanged reload, %d interfaces: %d files read, %.2f ms\n", NIFACE, opens, ms);
+	assert_int_equal(0, opens);
+	assert_int_equal(8003, port(ifaces[NIFACE - 1].mdns, 3));
+}
+
+/* Addresses are reconciled once per context, after all services are in */
+static void test_reload_addresses(__attribute__((__unused__)) void **state)
+{
+	const mdns_answer_t *a;
+	mdns_record_t *r;
+	int i;
+
+	reload();
+	assert_int_equal(2 * NIFACE, syncs);
+
+	for (i = 0; i < NIFACE; i++) {
+		int n = 0;
+
+		/* Other names may share the hash bucket */
+		for (r = mdnsd_get_published(ifaces[i].mdns, "host.local."); r; r = mdnsd_record_next(r)) {
+			a = mdnsd_record_data(r);
+			if (a->type != QTYPE_A || strcmp(a->name, "host.local."))
+				continue;
+
+			assert_int_equal(addrs[i].s_addr, a->ip.s_addr);
+			n++;
+		}
+		assert_int_equal(1, n);
+	}
+}
+
+/* Only the changed file is read again, and removed ones are forgotten */
+static void test_reload_changed(__attribute__((__unused__)) void **state)
+{
+	int i;
+
+	service(3, 9003, "path=/", 1000000001, 0);
+	unlink_service(NSVC - 1);
+
+	reload();
+	assert_int_equal(1, opens);
+	for (i = 0; i < NIFACE; i++) {
+		assert_int_equal(9003, port(ifaces[i].mdns, 3));
+		assert_int_equal(9003, port(ifaces[i].mdns6, 3));
+		assert_int_equal(8004, port(ifaces[i].mdns, 4));
+		assert_int_equal(-1, port(ifaces[i].mdns, NSVC - 1));
+	}
+}
+
+/* A reload with nothing changed sends nothing, and re-probes nothing */
+static void test_reload_unchanged(__attribute__((__unused__)) void **state)
+{
+	int i;
+
+	settle_all();
+	reload();
+	assert_int_equal(0, opens);
+
+	for (i = 0; i < NIFACE; i++) {
+		assert_null(ifaces[i].mdns->probing);
+		assert_int_equal(0, drain(ifaces[i].mdns));
+		assert_int_equal(0, drain(ifaces[i].mdns6));
+	}
+
+	/* After a changed port: one packet, with the SRV record */
+	service(2, 9002, "path=/", 1000000003, 0);
+	reload();
+	assert_int_equal(1, opens);
+
+	for (i = 0; i < NIFACE; i++) {
+		assert_null(ifaces[i].mdns->probing);
+		assert_int_equal(1, drain(ifaces[i].mdns));
+		assert_int_equal(9002, port(ifaces[i].mdns, 2));
+	}
+}
+
+/* Editing one TXT line announces that TXT record, and nothing else */
+static void test_update_txt(__attribute__((__unused__)) void **state)
+{
+	mdns_record_t *r;
+	int i;
+
+	settle_all();
+	service(4, 8004, "path=/edited", 1000000002, 0);
+	assert_int_equal(1, update());
+	assert_int_equal(1, opens);
+
+	for (i = 0; i < NIFACE; i++) {
+		mdns_daemon_t *d = ifaces[i].mdns;
+
+		assert_null(d->probing);
+		r = d->a_publish;
+		assert_non_null(r);
+		assert_null(r->list);
+		assert_int_equal(QTYPE_TXT, r->rr.type);
+		assert_string_equal("Service 04._http._tcp.local.", r->rr.name);
+		assert_int_equal(0, goodbyes(d));
+	}
+
+	/* Nothing changed since, nothing to do */
+	settle_all();
+	assert_int_equal(0, update());
+	assert_int_equal(0, opens);
+	assert_null(ifaces[0].mdns->a_publish);
+}
+
+/* An edit keeping the size, within the same second, is still seen */
+static void test_update_same_second(__attribute__((__unused__)) void **state)
+{
+	mdns_record_t *r;
+
+	settle_all();
+	service(4, 8004, "path=/EDITED", 1000000002, 500000);
+	assert_int_equal(1, update());
+	assert_int_equal(1, opens);
+
+	r = ifaces[0].mdns->a_publish;
+	assert_non_null(r);
+	assert_int_equal(QTYPE_TXT, r->rr.type);
+	assert_string_equal("Service 04._http._tcp.local.", r->rr.name);
+}
+
+/* A removed service says goodbye, the service type is still around */
+static void test_update_removed(__attribute__((__unused__)) void **state)
+{
+	mdns_record_t *r;
+	int i;
+
+	settle_all();
+	unlink_service(5);
+	assert_int_equal(1, update());
+	assert_int_equal(0, opens);
+
+	for (i = 0; i < NIFACE; i++) {
+		/* Service PTR, SRV and TXT */
+		assert_int_equal(3, goodbyes(ifaces[i].mdns));
+		assert_int_equal(3, goodbyes(ifaces[i].mdns6));
+		assert_null(ifaces[i].mdns->probing);
+		assert_null(ifaces[i].mdns->a_publish);
+		r = mdnsd_find(ifaces[i].mdns, DISCO_NAME, QTYPE_PTR);
+		assert_non_null(r);
+		assert_int_not_equal(0, r->rr.ttl);
+	}
+}
+
+/* Records waiting to be probed */
+static int probing(mdns_daemon_t *d)
+{
+	mdns_record_t *r;
+	int n = 0;
+
+	for (r = d->probing; r; r = r->list)
+		n++;
+
+	return n;
+}
+
+/* A record not on its way out */
+static mdns_record_t *live(mdns_daemon_t *d, const char *name, unsigned short type)
+{
+	mdns_record_t *r;
+
+	for (r = mdnsd_get_published(d, name); r; r = mdnsd_record_next(r)) {
+		if (r->rr.type == type && r->rr.ttl && !strcmp(r->rr.name, name))
+			return r;
+	}
+
+	return NULL;
+}
+
+/* Nothing to send on any other interface */
+static void quiet_but(int skip)
+{
+	int i;
+
+	for (i = 0; i < NIFACE; i++) {
+		if (i == skip)
+			continue;
+
+		assert_int_equal(0, drain(ifaces[i].mdns));
+		assert_int_equal(0, drain(ifaces[i].mdns6));
+	}
+}
+
+/* A conflicting instance is renamed on that interface only */
+static void test_conflict_instance(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = ifaces[7].mdns;
+	mdns_record_t *r;
+
+	settle_all();
+	conf_conflict(&ifaces[7], "host", "Service 01._http._tcp.local.");
+	conf_init(&ifaces[7], "host");
+	quiet_but(7);
+
+	/* Goodbye to the old name, probe the new SRV and TXT */
+	assert_int_equal(-1, port(d, 1));
+	assert_int_equal(3, goodbyes(d));
+	assert_int_equal(2, probing(d));
+	r = mdnsd_find(d, "Service 01 (2)._http._tcp.local.", QTYPE_SRV);
+	assert_non_null(r);
+	assert_int_equal(8001, r->rr.srv.port);
+	assert_int_equal(8000, port(d, 0));
+
+	/* The new name sticks */
+	settle_all();
+	assert_int_equal(0, update());
+	quiet_but(-1);
+	assert_non_null(mdnsd_find(d, "Service 01 (2)._http._tcp.local.", QTYPE_TXT));
+
+	/* And conflicts again */
+	conf_conflict(&ifaces[7], "host", "Service 01 (2)._http._tcp.local.");
+	conf_init(&ifaces[7], "host");
+	assert_non_null(mdnsd_find(d, "Service 01 (3)._http._tcp.local.", QTYPE_SRV));
+}
+
+/* A conflicting host name renames the host, its services keep their names */
+static void test_conflict_host(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = ifaces[8].mdns;
+	mdns_record_t *r;
+
+	settle_all();
+	conf_conflict(&ifaces[8], "host", "host.local.");
+	assert_int_equal(2, ifaces[8].hostid);
+	conf_init(&ifaces[8], "host");
+	quiet_but(8);
+
+	r = live(d, "host-2.local.", QTYPE_A);
+	assert_non_null(r);
+	assert_int_equal(addrs[8].s_addr, r->rr.ip.s_addr);
+	assert_null(live(d, "host.local.", QTYPE_A));
+
+	/* Same instance, now on the new host, announced not probed */
+	r = mdnsd_find(d, "Service 00._http._tcp.local.", QTYPE_SRV);
+	assert_non_null(r);
+	assert_string_equal("host-2.local.", r->rr.rdname);
+	assert_int_equal(5, r->unique);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_reload_parses_once),
+		cmocka_unit_test(test_reload_addresses),
+		cmocka_unit_test(test_reload_changed),
+		cmocka_unit_test(test_reload_unchanged),
+		cmocka_unit_test(test_update_txt),
+		cmocka_unit_test(test_update_same_second),
+		cmocka_unit_test(test_update_removed),
+		cmocka_unit_test(test_conflict_instance),
+		cmocka_unit_test(test_conflict_host),
+	};
+
+	return cmocka_run_group_tests(tests, setup, teardown);
+}
@@ -0,0 +1,104 @@
+#include "unittest.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* White-box: the name filter is static, so pull in the library source. */
+#include "libmdnsd/mdnsd.c"
+#include "whitebox.h"
+
+#define HOST "printer.local."
+#define PEER "laptop.local."
+
+static int has(mdns_daemon_t *d, const char *name)
+{
+	return _bloom_has(d, _namehash(name));
+}
+
+/* Names come and go with the records and queries holding them */
+static void test_filter_names(__attribute__((__unused__)) void **state)
+{
+	struct in_addr ip = { .s_addr = htonl(0xc6336401) };	/* 198.51.100.1 */
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	mdns_record_t *a, *txt;
+	char name[64];
+	int i, n = 0;
+
+	assert_non_null(d);
+	assert_false(has(d, HOST));
+
+	a = mdnsd_shared(d, HOST, QTYPE_A, 120);
+	mdnsd_set_ip(d, a, ip);
+	txt = mdnsd_shared(d, HOST, QTYPE_TXT, 120);
+	mdnsd_set_raw(d, txt, "\x07path=/", 7);
+	assert_true(has(d, HOST));
+
+	mdnsd_done(d, a);
+	drain(d);
+	assert_true(has(d, HOST));
+	mdnsd_done(d, txt);
+	drain(d);
+	assert_false(has(d, HOST));
+
+	mdnsd_query(d, PEER, QTYPE_A, ans, NULL);
+	assert_true(has(d, PEER));
+	mdnsd_query(d, PEER, QTYPE_A, NULL, NULL);
+	assert_false(has(d, PEER));
+
+	/* No false negatives, and not too many false positives */
+	for (i = 0; i < 100; i++) {
+		snprintf(name, sizeof(name), "host%03d.local.", i);
+		mdnsd_shared(d, name, QTYPE_A, 120);
+	}
+	for (i = 0; i < 1000; i++) {
+		snprintf(name, sizeof(name), "host%03d.local.", i);
+		if (i < 100)
+			assert_true(has(d, name));
+		else if (has(d, name))
+			n++;
+	}
+	printf("False positives: %d of 900\n", n);
+	assert_true(n < 9);
+
+	mdnsd_shutdown(d);
+	mdnsd_free(d);
+}
+
+/* Questions for names we neither publish nor query get no answer */
+static void test_filter_query(__attribute__((__unused__)) void **state)
+{
+	struct in_addr ip = { .s_addr = htonl(0xc6336401) };	/* 198.51.100.1 */
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	mdns_record_t *r;
+	inet_addr_t from;
+
+	assert_non_null(d);
+	r = mdnsd_shared(d, HOST, QTYPE_A, 120);
+	mdnsd_set_ip(d, r, ip);
+	announced(d);
+	peer(&from, 0);
+
+	memset(&pkt, 0, sizeof(pkt));
+	message_qd(&pkt, PEER, QTYPE_A, QCLASS_IN);
+	assert_int_equal(0, mdnsd_in(d, wire(&pkt), &from));
+	assert_null(d->a_now);
+	assert_null(d->a_pause);
+
+	memset(&pkt, 0, sizeof(pkt));
+	message_qd(&pkt, HOST, QTYPE_A, QCLASS_IN);
+	assert_int_equal(0, mdnsd_in(d, wire(&pkt), &from));
+	assert_true(d->a_now || d->a_pause || d->rpending);
+
+	mdnsd_shutdown(d);
+	mdnsd_free(d);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_filter_names),
+		cmocka_unit_test(test_filter_query),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,51 @@
+#!/bin/sh
+# Flap the link mdnsd runs on 20 times.  The netlink events are coalesced
+# and the interface is held down, so this costs a handful of packets, not
+# a goodbye, probe and announcement round per flap.  Once the link stays
+# up, the services are published again.
+#set -x
+
+# shellcheck source=/dev/null
+. "$(dirname "$0")/lib.sh"
+
+# UDP datagrams sent in the server namespace, IPv4 and IPv6, only mdnsd's
+sent()
+{
+	# shellcheck disable=SC2154
+	nsenter --net="$server" -- awk '/^Udp: [0-9]/ { n += $5 } /^Udp6OutDatagrams/ { n += $2 } END { print n }' \
+		/proc/net/snmp /proc/net/snmp6
+}
+
+topo basic
+mdnsd
+discover
+
+# Done probing and announcing
+sleep 3
+before=$(sent)
+
+print "Flapping eth0 20 times ..."
+i=0
+while [ $i -lt 20 ]; do
+	nsenter --net="$server" -- ip link set eth0 down
+	sleep 0.3
+	nsenter --net="$server" -- ip link set eth0 up
+	sleep 0.3
+	i=$((i + 1))
+done
+sleep 1
+
+num=$(($(sent) - before))
+echo "Sent $num packets during 20 flaps"
+[ "$num" -le 6 ] || FAIL "Flapping not dampened, $num packets"
+
+print "Waiting for the hold-down to end ..."
+i=0
+while [ $i -lt 15 ]; do
+	mquery >"$DIR/result"
+	# shellcheck disable=SC2154
+	grep -q "+ _ftp._tcp.local. ($server_addr)" "$DIR/result" && OK
+	i=$((i + 1))
+done
+
+FAIL "Not published again after flapping"
@@ -0,0 +1,94 @@
+/*
+ * Flood the link with mDNS announcements of unique names, from a given
+ * source address.  Used by flood.sh, see README.md
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libmdnsd/mdnsd.h"
+
+static int usage(int rc)
+{
+	fprintf(stderr,
+		"Usage: flood [-c COUNT] [-n NAMES] [-r RATE] ADDRESS\n"
+		"\n"
+		"  -c COUNT  Packets to send, default 10000\n"
+		"  -n NAMES  Unique A records per packet, default 10\n"
+		"  -r RATE   Packets/sec, default 2000\n");
+
+	return rc;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in sin = { .sin_family = AF_INET, .sin_port = htons(5353) };
+	struct sockaddr_in to = { .sin_family = AF_INET, .sin_port = htons(5353) };
+	int count = 10000, names = 10, rate = 2000;
+	struct timespec gap;
+	struct message m;
+	int c, i, j, sd, on = 1;
+
+	while ((c = getopt(argc, argv, "c:hn:r:")) != EOF) {
+		switch (c) {
+		case 'c':
+			count = atoi(optarg);
+			break;
+		case 'h':
+			return usage(0);
+		case 'n':
+			names = atoi(optarg);
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		default:
+			return usage(1);
+		}
+	}
+
+	if (optind >= argc || rate <= 0 || !inet_pton(AF_INET, argv[optind], &sin.sin_addr))
+		return usage(1);
+	inet_pton(AF_INET, "224.0.0.251", &to.sin_addr);
+
+	sd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sd < 0)
+		goto fail;
+	setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+	setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(sd, (struct sockaddr *)&sin, sizeof(sin)))
+		goto fail;
+	if (setsockopt(sd, IPPROTO_IP, IP_MULTICAST_IF, &sin.sin_addr, sizeof(sin.sin_addr)))
+		goto fail;
+
+	gap.tv_sec  = 0;
+	gap.tv_nsec = 1000000000L / rate;
+	for (i = 0; i < count; i++) {
+		memset(&m, 0, sizeof(m));
+		m.header.qr = 1;
+		m.header.aa = 1;
+		for (j = 0; j < names; j++) {
+			struct in_addr ip = { .s_addr = htonl(0x0a000000 + i * names + j) };	/* 10.x.y.z */
+			char name[64];
+
+			snprintf(name, sizeof(name), "flood%07d.local.", i * names + j);
+			message_an(&m, name, QTYPE_A, QCLASS_IN + 32768, 120);
+			message_rdata_ipv4(&m, ip);
+		}
+
+		if (sendto(sd, message_packet(&m), message_packet_len(&m), 0,
+			   (struct sockaddr *)&to, sizeof(to)) < 0)
+			goto fail;
+		nanosleep(&gap, NULL);
+	}
+
+	close(sd);
+	return 0;
+fail:
+	fprintf(stderr, "flood: %s\n", strerror(errno));
+	return 1;
+}
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Another host on the link floods it with announcements of unique names.
+# The flood is shed per source, while mdnsd can still be found.
+#set -x
+
+# shellcheck source=/dev/null
+. "$(dirname "$0")/lib.sh"
+
+flood_addr=192.168.42.2
+
+[ -x ./flood ] || SKIP "Cannot find flood helper"
+
+topo basic
+mdnsd
+
+print "Flooding the link from $flood_addr ..."
+nsenter --net="$server" -- ip addr add "$flood_addr"/24 dev eth0
+nsenter --net="$server" -- ./flood -c 20000 -r 2000 "$flood_addr" &
+echo "$! flood" >> "$DIR/pids"
+sleep 1
+
+print "Browsing _ftp._tcp.local. during the flood ..."
+mquery -t 12 _ftp._tcp.local. >"$DIR/result" 2>"$DIR/shed" || FAIL "Query failed"
+cat "$DIR/shed"
+
+# shellcheck disable=SC2154
+grep -q "+ Troglobit FTP Server._ftp._tcp.local. ($server_addr)" "$DIR/result" \
+	|| FAIL "mdnsd drowned in the flood"
+grep -q "from $flood_addr" "$DIR/shed" || FAIL "Flood not shed"
+grep -q "from $server_addr" "$DIR/shed" && FAIL "mdnsd shed"
+
+OK
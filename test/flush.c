@@ -0,0 +1,182 @@
+#include "unittest.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* White-box: the cache is static, so pull in the library source. */
+#include "libmdnsd/mdnsd.c"
+
+#define HOST "printer.local."
+
+static int added, expired;
+
+static int count(mdns_answer_t *a, __attribute__((__unused__)) void *arg)
+{
+	if (a->ttl)
+		added++;
+	else
+		expired++;
+
+	return 0;
+}
+
+/* One announcement with @n of the host's addresses, cache-flush bit set */
+static void announce(mdns_daemon_t *d, int n)
+{
+	struct in_addr ip;
+	inet_addr_t from;
+	int i;
+
+	peer(&from, 0);
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.header.qr = 1;
+	for (i = 0; i < n; i++) {
+		ip.s_addr = htonl(0xc6336401 + i);	/* 198.51.100.1 + i */
+		message_an(&pkt, HOST, QTYPE_A, QCLASS_IN + 32768, 120);
+		message_rdata_ipv4(&pkt, ip);
+	}
+
+	added = expired = 0;
+	assert_int_equal(0, mdnsd_in(d, wire(&pkt), &from));
+}
+
+/* Pretend the cached entries arrived @usec ago */
+static void age(mdns_daemon_t *d, long usec)
+{
+	struct cached *c = NULL;
+
+	while ((c = _c_next(d, c, HOST, QTYPE_A))) {
+		c->rcvd.tv_sec  -= usec / 1000000;
+		c->rcvd.tv_usec -= usec % 1000000;
+		if (c->rcvd.tv_usec < 0) {
+			c->rcvd.tv_sec--;
+			c->rcvd.tv_usec += 1000000;
+		}
+	}
+}
+
+/* Fast forward to when flushed entries are due, and let mdnsd_out() sweep */
+static void sweep(mdns_daemon_t *d)
+{
+	struct cached *c = NULL;
+	inet_addr_t to;
+
+	if (!d->cflush)
+		return;
+
+	while ((c = _c_next(d, c, HOST, QTYPE_A))) {
+		if (c->ttl <= d->cflush)
+			c->ttl = d->now.tv_sec;
+	}
+	d->cflush = d->now.tv_sec;
+
+	while (mdnsd_out(d, &pkt, &to))
+		;
+}
+
+static int cached(mdns_daemon_t *d)
+{
+	struct cached *c = NULL;
+	int n = 0;
+
+	while ((c = _c_next(d, c, HOST, QTYPE_A)))
+		n++;
+
+	return n;
+}
+
+/*
+ * A host re-announcing its four addresses, each with the cache-flush bit,
+ * must not cause expire/add callback storms, RFC 6762 §10.2.
+ */
+static void test_flush_reannounce(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+
+	assert_non_null(d);
+	mdnsd_query(d, HOST, QTYPE_A, count, NULL);
+
+	announce(d, 4);
+	assert_int_equal(4, added);
+	assert_int_equal(0, expired);
+
+	age(d, 2000000);
+	announce(d, 4);
+	sweep(d);
+	assert_int_equal(0, added);
+	assert_int_equal(0, expired);
+	assert_int_equal(4, cached(d));
+
+	mdnsd_shutdown(d);
+	mdnsd_free(d);
+}
+
+/* Addresses missing from a later announcement go after a grace second */
+static void test_flush_stale(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	struct timeval now;
+
+	assert_non_null(d);
+	mdnsd_query(d, HOST, QTYPE_A, count, NULL);
+
+	announce(d, 4);
+	age(d, 2000000);
+	announce(d, 2);
+	assert_int_equal(0, added);
+	assert_int_equal(0, expired);
+	assert_int_equal(4, cached(d));
+	assert_true(d->cflush > 0);
+
+	/* Not before a full second has passed */
+	now = d->now;
+	d->now.tv_usec += 900000;
+	if (d->now.tv_usec >= 1000000) {
+		d->now.tv_sec++;
+		d->now.tv_usec -= 1000000;
+	}
+	_c_sweep(d);
+	assert_int_equal(0, expired);
+	assert_int_equal(4, cached(d));
+	d->now = now;
+
+	sweep(d);
+	assert_int_equal(0, added);
+	assert_int_equal(2, expired);
+	assert_int_equal(2, cached(d));
+
+	mdnsd_shutdown(d);
+	mdnsd_free(d);
+}
+
+/* Records received in the last second are never flushed */
+static void test_flush_recent(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+
+	assert_non_null(d);
+	mdnsd_query(d, HOST, QTYPE_A, count, NULL);
+
+	announce(d, 4);
+	age(d, 900000);
+	announce(d, 1);
+	assert_int_equal(0, d->cflush);
+
+	sweep(d);
+	assert_int_equal(0, expired);
+	assert_int_equal(4, cached(d));
+
+	mdnsd_shutdown(d);
+	mdnsd_free(d);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_flush_reannounce),
+		cmocka_unit_test(test_flush_stale),
+		cmocka_unit_test(test_flush_recent),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
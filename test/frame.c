@@ -0,0 +1,130 @@
+#include "unittest.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "libmdnsd/mdnsd.h"
+
+#define NSVC 200
+
+/* Publish NSVC services the way conf.c does: PTR, SRV and TXT per instance */
+static void publish(mdns_daemon_t *d)
+{
+	struct in_addr ip = { .s_addr = htonl(0xc0a82a65) };	/* 192.168.42.101 */
+	unsigned char txt[] = "\x0bvendor=Acme\x0dmodel=Example";
+	char inst[128];
+	mdns_record_t *r;
+	int i;
+
+	r = mdnsd_shared(d, "myhost.local.", QTYPE_A, 120);
+	mdnsd_set_ip(d, r, ip);
+
+	for (i = 0; i < NSVC; i++) {
+		snprintf(inst, sizeof(inst), "Service number %03d._http._tcp.local.", i);
+
+		r = mdnsd_shared(d, "_http._tcp.local.", QTYPE_PTR, 120);
+		mdnsd_set_host(d, r, inst);
+		r = mdnsd_shared(d, inst, QTYPE_SRV, 120);
+		mdnsd_set_srv(d, r, 0, 0, 8000 + i, "myhost.local.");
+		r = mdnsd_shared(d, inst, QTYPE_TXT, 4500);
+		mdnsd_set_raw(d, r, (char *)txt, sizeof(txt) - 1);
+	}
+}
+
+/* Send the first announcement round, checking every packet on the way */
+static int announce(mdns_daemon_t *d, int *records)
+{
+	struct message *m;
+	inet_addr_t to;
+	int i, len, packets = 0;
+
+	*records = 0;
+	while (mdnsd_out(d, &pkt, &to)) {
+		len = message_packet_len(&pkt);
+		assert_true(len <= mdnsd_get_frame(d));
+
+		/* Must survive the parser, compression pointers and all */
+		m = wire(&pkt);
+		for (i = 0; i < m->ancount; i++) {
+			if (m->an[i].type == QTYPE_PTR)
+				assert_string_equal("_http._tcp.local.", m->an[i].name);
+			if (m->an[i].type == QTYPE_SRV)
+				assert_string_equal("myhost.local.", m->an[i].known.srv.name);
+		}
+
+		*records += m->ancount;
+		packets++;
+	}
+
+	return packets;
+}
+
+static int run(int mtu, int *records)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	int packets;
+
+	assert_non_null(d);
+	mdnsd_set_mtu(d, mtu);
+	publish(d);
+	packets = announce(d, records);
+	mdnsd_free(d);
+
+	return packets;
+}
+
+static void test_frame_from_mtu(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+
+	assert_non_null(d);
+	assert_int_equal(1000, mdnsd_get_frame(d));
+
+	mdnsd_set_mtu(d, 0);		/* unknown, keep what we have */
+	assert_int_equal(1000, mdnsd_get_frame(d));
+
+	mdnsd_set_mtu(d, 1500);
+	assert_int_equal(1472, mdnsd_get_frame(d));
+
+	mdnsd_set_family(d, AF_INET6);
+	assert_int_equal(1452, mdnsd_get_frame(d));
+
+	mdnsd_set_mtu(d, 65536);	/* loopback, capped by RFC 6762 §17 */
+	assert_int_equal(9000, mdnsd_get_frame(d));
+
+	mdnsd_free(d);
+}
+
+/*
+ * A 200-service announcement round goes out back-to-back, every record
+ * once, in fewer packets when frames follow a 1500 byte MTU.
+ */
+static void test_announce_packets(__attribute__((__unused__)) void **state)
+{
+	int small, large, jumbo, records;
+
+	small = run(1028, &records);	/* the old fixed 1000 byte frame */
+	assert_int_equal(NSVC * 3 + 1, records);
+
+	large = run(1500, &records);
+	assert_int_equal(NSVC * 3 + 1, records);
+
+	jumbo = run(9000, &records);
+	assert_int_equal(NSVC * 3 + 1, records);
+
+	printf("Announcing %d services: %d packets at 1000, %d at 1472, %d at 8972 bytes\n",
+	       NSVC, small, large, jumbo);
+	assert_true(large * 4 < small * 3);
+	assert_true(jumbo < large);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_frame_from_mtu),
+		cmocka_unit_test(test_announce_packets),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,144 @@
+#include "unittest.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* White-box: the known-answer state is static, so pull in the library source. */
+#include "libmdnsd/mdnsd.c"
+#include "whitebox.h"
+
+#define SERVICE "_http._tcp.local."
+#define NINST   100
+
+/*
+ * RFC 6762 §7.2: a query with more known answers than fit in one frame is
+ * sent with TC set, and the rest follow in packets without questions.
+ */
+static void test_known_answers_split(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	inet_addr_t from, to;
+	int i, n, total = 0, packets = 0;
+	char inst[128];
+
+	assert_non_null(d);
+	peer(&from, 1);
+	mdnsd_query(d, SERVICE, QTYPE_PTR, ans, NULL);
+
+	/* Learn a large browse result, one answer per packet */
+	for (i = 0; i < NINST; i++) {
+		memset(&pkt, 0, sizeof(pkt));
+		pkt.header.qr = 1;
+		snprintf(inst, sizeof(inst), "Instance number %03d.%s", i, SERVICE);
+		message_an(&pkt, SERVICE, QTYPE_PTR, QCLASS_IN, 120);
+		message_rdata_name(&pkt, inst);
+		assert_int_equal(0, mdnsd_in(d, wire(&pkt), &from));
+	}
+
+	while ((n = mdnsd_out(d, &pkt, &to))) {
+		struct message *m = wire(&pkt);
+
+		assert_true(message_packet_len(&pkt) <= 1000);
+		assert_int_equal(0, m->header.qr);
+		assert_int_equal(packets == 0 ? 1 : 0, m->qdcount);
+		total += m->ancount;
+		packets++;
+
+		/* Every packet but the last is truncated */
+		if (total < NINST)
+			assert_int_equal(1, m->header.tc);
+		else
+			assert_int_equal(0, m->header.tc);
+	}
+
+	assert_true(packets > 1);
+	assert_int_equal(NINST, total);
+
+	mdnsd_shutdown(d);
+	mdnsd_free(d);
+}
+
+/*
+ * Responder side: answers to a TC query are held, and known answers in
+ * the follow-on packets from the same source suppress them.  A follow-on
+ * with TC set extends the hold.
+ */
+static void test_truncated_query_held(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	const char *names[] = { "a." SERVICE, "b." SERVICE, "c." SERVICE };
+	mdns_record_t *r[3];
+	inet_addr_t from, other, to;
+	struct deferred *dr;
+	int i, n;
+
+	assert_non_null(d);
+	peer(&from, 1);
+	peer(&other, 2);
+
+	for (i = 0; i < 3; i++) {
+		r[i] = mdnsd_shared(d, SERVICE, QTYPE_PTR, 120);
+		mdnsd_set_host(d, r[i], (char *)names[i]);
+	}
+	announced(d);
+
+	/* Truncated query, already knowing a. */
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.header.tc = 1;
+	message_qd(&pkt, SERVICE, QTYPE_PTR, QCLASS_IN);
+	message_an(&pkt, SERVICE, QTYPE_PTR, QCLASS_IN, 120);
+	message_rdata_name(&pkt, (char *)names[0]);
+	assert_int_equal(0, mdnsd_in(d, wire(&pkt), &from));
+
+	assert_null(d->a_now);
+	assert_null(d->a_pause);
+	for (n = 0, dr = d->deferred; dr; dr = dr->next)
+		n++;
+	assert_int_equal(2, n);
+
+	/* Follow-on from someone else must not suppress anything */
+	memset(&pkt, 0, sizeof(pkt));
+	message_an(&pkt, SERVICE, QTYPE_PTR, QCLASS_IN, 120);
+	message_rdata_name(&pkt, (char *)names[1]);
+	assert_int_equal(0, mdnsd_in(d, wire(&pkt), &other));
+
+	/* Follow-on from the querier, knowing b. */
+	assert_int_equal(0, mdnsd_in(d, wire(&pkt), &from));
+	assert_non_null(d->deferred);
+	assert_ptr_equal(r[2], d->deferred->r);
+	assert_null(d->deferred->next);
+
+	/* Nothing goes out until the window closes */
+	assert_int_equal(0, mdnsd_out(d, &pkt, &to));
+	d->deferred->when = d->now;
+
+	/* A truncated follow-on means more known answers, hold on longer */
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.header.tc = 1;
+	message_an(&pkt, SERVICE, QTYPE_PTR, QCLASS_IN, 120);
+	message_rdata_name(&pkt, (char *)names[0]);
+	assert_int_equal(0, mdnsd_in(d, wire(&pkt), &from));
+	assert_non_null(d->deferred);
+	assert_int_equal(0, mdnsd_out(d, &pkt, &to));
+	d->deferred->when = d->now;
+
+	assert_int_equal(1, mdnsd_out(d, &pkt, &to));
+	wire(&pkt);
+	assert_int_equal(1, in.header.qr);
+	assert_int_equal(1, in.ancount);
+	assert_string_equal(names[2], in.an[0].known.ptr.name);
+	assert_null(d->deferred);
+
+	mdnsd_shutdown(d);
+	mdnsd_free(d);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_known_answers_split),
+		cmocka_unit_test(test_truncated_query_held),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
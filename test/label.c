@@ -1,5 +1,6 @@
 #include "unittest.h"
 
+#include <stddef.h>
 #include <stdlib.h>
 
 /* White-box: _lmatch() is static, so pull in the codec source directly. */
@@ -11,23 +12,22 @@
  * step past the terminating 0 and dereference one byte beyond the name.
  * Each root label sits at the end of its own heap buffer so the run under
  * AddressSanitizer faults on any over-read; the result must be a match.
+ * Pointers resolve against the packet being built, _packet[] is the last
+ * member of struct message, so allocate only the first three bytes of it.
  */
 static void test_lmatch_pointer_to_root(__attribute__((__unused__)) void **state)
 {
-	struct message *m = calloc(1, sizeof(*m));
-	unsigned char *buf = malloc(3);
+	struct message *m = calloc(1, offsetof(struct message, _packet) + 3);
 	unsigned char *l1  = malloc(2);
 	unsigned char *l2  = malloc(1);
 
 	assert_non_null(m);
-	assert_non_null(buf);
 	assert_non_null(l1);
 	assert_non_null(l2);
 
-	buf[0] = 0xff;
-	buf[1] = 0xff;
-	buf[2] = 0x00;		/* root label, last byte of the buffer */
-	m->_buf = buf;
+	m->_packet[0] = 0xff;
+	m->_packet[1] = 0xff;
+	m->_packet[2] = 0x00;	/* root label, last byte of the buffer */
 
 	l1[0] = 0xc0;		/* compression pointer, _ldecomp() -> offset 2 */
 	l1[1] = 0x02;
@@ -37,7 +37,6 @@ static void test_lmatch_pointer_to_root(__attribute__((__unused__)) void **state
 
 	free(l2);
 	free(l1);
-	free(buf);
 	free(m);
 }
 
@@ -55,7 +55,7 @@ mdnsd()
 	[ -x "$bin" ] || SKIP "Cannot find mdnsd"
 
 	print "Starting mdnsd ..."
-	nsenter --net="$server" -- "$bin" -H test -n "${SRC}/examples" $ARGS &
+	nsenter --net="$server" -- "$bin" -H test -n "${SERVICES:-${SRC}/examples}" $ARGS &
 	echo "$! mdnsd" >>"${DIR}/pids"
 	sleep 1
 }
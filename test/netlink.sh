@@ -0,0 +1,43 @@
+#!/bin/sh
+# Verify addresses added and removed at runtime are picked up at once,
+# from the netlink events, without waiting for any interface poll.
+#set -x
+
+# shellcheck source=/dev/null
+. "$(dirname "$0")/lib.sh"
+
+topo basic
+mdnsd
+
+print "Adding address 192.168.42.77 while mdnsd is running ..."
+# shellcheck disable=SC2154
+nsenter --net="$server" -- ip addr add 192.168.42.77/24 dev eth0
+sleep 1
+
+mquery -s -t 1 test.local. >"$DIR/result" || FAIL "Not found"
+grep -q "A test.local. .* 192.168.42.77" "$DIR/result" || FAIL "New address not published"
+# shellcheck disable=SC2154
+grep -q "A test.local. .* $server_addr" "$DIR/result" || FAIL "Lost original address"
+
+print "Removing address 192.168.42.77 again ..."
+nsenter --net="$server" -- ip addr del 192.168.42.77/24 dev eth0
+sleep 1
+
+mquery -s -t 1 test.local. >"$DIR/result" || FAIL "Not found"
+grep -q "192.168.42.77" "$DIR/result" && FAIL "Removed address still published"
+grep -q "A test.local. .* $server_addr" "$DIR/result" || FAIL "Lost original address"
+
+print "Adding 2001:db8:42::77, tentative for a few seconds of DAD ..."
+nsenter --net="$server" -- sh -c 'echo 4 >/proc/sys/net/ipv6/conf/eth0/dad_transmits'
+nsenter --net="$server" -- ip -6 addr add 2001:db8:42::77/64 dev eth0
+sleep 1
+
+mquery -s -t 28 test.local. >"$DIR/result"
+grep -q "2001:db8:42::77" "$DIR/result" && FAIL "Tentative address published"
+
+print "Waiting for DAD to complete ..."
+sleep 5
+mquery -s -t 28 test.local. >"$DIR/result" || FAIL "Not found"
+grep -q "AAAA test.local. .* 2001:db8:42::77" "$DIR/result" || FAIL "Address not published after DAD"
+
+OK
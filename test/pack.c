@@ -0,0 +1,170 @@
+#include "unittest.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* White-box: skips the announcements and response delay, so pull in the library source. */
+#include "libmdnsd/mdnsd.c"
+#include "whitebox.h"
+
+#define NTYPE 40
+#define NINST 5
+
+
+/* NTYPE service types, NINST instances each, with service enumeration */
+static void publish(mdns_daemon_t *d)
+{
+	struct in_addr ip = { .s_addr = htonl(0xc0a82a65) };	/* 192.168.42.101 */
+	unsigned char txt[] = "\x0bvendor=Acme\x0dmodel=Example";
+	char type[64], inst[128], big[256];
+	mdns_record_t *r;
+	int i, j;
+
+	/* One instance per type has a lot to say, for the packing to work around */
+	memset(big, 'x', sizeof(big));
+	big[0] = 254;
+
+	r = mdnsd_shared(d, "myhost.local.", QTYPE_A, 120);
+	mdnsd_set_ip(d, r, ip);
+
+	for (i = 0; i < NTYPE; i++) {
+		snprintf(type, sizeof(type), "_svc%02d._tcp.local.", i);
+		r = mdnsd_shared(d, "_services._dns-sd._udp.local.", QTYPE_PTR, 4500);
+		mdnsd_set_host(d, r, type);
+
+		for (j = 0; j < NINST; j++) {
+			snprintf(inst, sizeof(inst), "Service number %02d.%s", j, type);
+
+			r = mdnsd_shared(d, type, QTYPE_PTR, 120);
+			mdnsd_set_host(d, r, inst);
+			r = mdnsd_shared(d, inst, QTYPE_SRV, 120);
+			mdnsd_set_srv(d, r, 0, 0, 8000 + j, "myhost.local.");
+			r = mdnsd_shared(d, inst, QTYPE_TXT, 4500);
+			if (j)
+				mdnsd_set_raw(d, r, (char *)txt, sizeof(txt) - 1);
+			else
+				mdnsd_set_raw(d, r, big, 255);
+		}
+	}
+}
+
+static int smallest;		/* Bytes in the least full packet but the last */
+
+/* Send everything due, returns packets, adds up records and bytes */
+static int sent(mdns_daemon_t *d, int *records, int *bytes)
+{
+	inet_addr_t to;
+	int len, last = 0, packets = 0;
+
+	*records = *bytes = 0;
+	smallest = MAX_PACKET_LEN;
+	d->pause.tv_sec = 0;	/* Skip the 20-120 msec response delay */
+	while (mdnsd_out(d, &pkt, &to)) {
+		len = message_packet_len(&pkt);
+		assert_true(len <= mdnsd_get_frame(d));
+
+		*records += wire(&pkt)->ancount;
+		*bytes += len;
+		packets++;
+
+		if (last && last < smallest)
+			smallest = last;
+		last = len;
+	}
+
+	return packets;
+}
+
+/* Published and done announcing */
+static mdns_daemon_t *setup(void)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+
+	assert_non_null(d);
+	mdnsd_set_mtu(d, 1500);
+	publish(d);
+	announced(d);
+
+	return d;
+}
+
+/* The first announcement round, returns packets */
+static int announce(int *bytes)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	int packets, records;
+
+	assert_non_null(d);
+	mdnsd_set_mtu(d, 1500);
+	publish(d);
+
+	packets = sent(d, &records, bytes);
+	assert_int_equal(1 + NTYPE * (1 + NINST * 3), records);
+	mdnsd_free(d);
+
+	return packets;
+}
+
+/* Packets are filled, a record that does not fit does not end one early */
+static void test_announce(__attribute__((__unused__)) void **state)
+{
+	int packets, bytes;
+
+	packets = announce(&bytes);
+	printf("Announcement: %d packets, %d bytes, least full %d\n", packets, bytes, smallest);
+	assert_true(smallest > 1472 - 64);
+}
+
+/* Goodbyes queue in hash order, yet pack as tight as the announcements */
+static void test_goodbye(__attribute__((__unused__)) void **state)
+{
+	int packets, records, bytes, apackets, abytes;
+	mdns_daemon_t *d = setup();
+
+	mdnsd_shutdown(d);
+	packets = sent(d, &records, &bytes);
+	printf("Goodbye:      %d packets, %d bytes, least full %d\n", packets, bytes, smallest);
+	assert_int_equal(1 + NTYPE * (1 + NINST * 3), records);
+	assert_true(smallest > 1472 - 64);
+	mdnsd_free(d);
+
+	apackets = announce(&abytes);
+	assert_true(packets <= apackets);
+	assert_true(bytes * 100 <= abytes * 101);
+}
+
+/* One query browsing for every service type, answers and additionals */
+static void test_browse(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = setup();
+	int i, packets, records, bytes;
+	inet_addr_t from;
+	char type[64];
+
+	peer(&from, 0);
+	memset(&pkt, 0, sizeof(pkt));
+	for (i = 0; i < NTYPE; i++) {
+		snprintf(type, sizeof(type), "_svc%02d._tcp.local.", i);
+		message_qd(&pkt, type, QTYPE_PTR, QCLASS_IN);
+	}
+	assert_int_equal(0, mdnsd_in(d, wire(&pkt), &from));
+
+	packets = sent(d, &records, &bytes);
+	printf("Browse:       %d packets, %d bytes, least full %d\n", packets, bytes, smallest);
+	assert_int_equal(NTYPE * NINST, records);
+	assert_true(smallest > 1472 - 64);
+
+	mdnsd_shutdown(d);
+	mdnsd_free(d);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_announce),
+		cmocka_unit_test(test_goodbye),
+		cmocka_unit_test(test_browse),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
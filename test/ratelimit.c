@@ -0,0 +1,164 @@
+#include "unittest.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* White-box: the answer queues are static, so pull in the library source. */
+#include "libmdnsd/mdnsd.c"
+#include "whitebox.h"
+
+#define SERVICE "_http._tcp.local."
+#define INST    "Printer." SERVICE
+#define NQUERY  1000
+
+static mdns_record_t *published(mdns_daemon_t *d)
+{
+	mdns_record_t *r;
+
+	r = mdnsd_shared(d, SERVICE, QTYPE_PTR, 120);
+	mdnsd_set_host(d, r, INST);
+	announced(d);
+
+	return r;
+}
+
+static void query(mdns_daemon_t *d, int n, int probe)
+{
+	inet_addr_t from;
+
+	peer(&from, n);
+	memset(&pkt, 0, sizeof(pkt));
+	message_qd(&pkt, SERVICE, QTYPE_PTR, QCLASS_IN);
+	if (probe) {
+		message_ns(&pkt, SERVICE, QTYPE_PTR, QCLASS_IN, 120);
+		message_rdata_name(&pkt, "Other." SERVICE);
+	}
+	assert_int_equal(0, mdnsd_in(d, wire(&pkt), &from));
+}
+
+/*
+ * A flood of queries for one record, from many queriers, puts it on the
+ * wire once per second, RFC 6762 §6.
+ */
+static void test_query_flood(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	struct timeval start, end;
+	mdnsd_stats_t st;
+	int i, sent = 0;
+
+	assert_non_null(d);
+	published(d);
+
+	gettimeofday(&start, 0);
+	for (i = 0; i < NQUERY; i++) {
+		query(d, i, 0);
+		sent += drain(d);
+	}
+	gettimeofday(&end, 0);
+
+	/* One per started second of the flood */
+	assert_in_range(sent, 1, end.tv_sec - start.tv_sec + 1);
+
+	mdnsd_get_stats(d, &st);
+	assert_int_equal(NQUERY - sent, st.ratelimited);
+
+	mdnsd_shutdown(d);
+	mdnsd_free(d);
+}
+
+static void test_interval(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	mdnsd_stats_t st;
+	mdns_record_t *r;
+
+	assert_non_null(d);
+	r = published(d);
+
+	/* Normal queries wait a full second */
+	age(d, r, 900000);
+	query(d, 1, 0);
+	assert_int_equal(0, drain(d));
+
+	age(d, r, 1100000);
+	query(d, 1, 0);
+	assert_int_equal(1, drain(d));
+
+	/* Probe defense only waits 250 msec */
+	age(d, r, 200000);
+	query(d, 2, 1);
+	assert_int_equal(0, drain(d));
+
+	age(d, r, 300000);
+	query(d, 2, 1);
+	assert_int_equal(1, drain(d));
+
+	/* Goodbyes always go out */
+	mdnsd_done(d, r);
+	assert_int_equal(1, drain(d));
+
+	/* Only the two responses held back are counted */
+	mdnsd_get_stats(d, &st);
+	assert_int_equal(2, st.ratelimited);
+
+	mdnsd_shutdown(d);
+	mdnsd_free(d);
+}
+
+/*
+ * Probes are not multicasts of the record: the first announcement of a
+ * unique record follows 250 msec after the last probe, RFC 6762 §8.3,
+ * not a rate limit second later.
+ */
+static void test_announce_after_probe(__attribute__((__unused__)) void **state)
+{
+	struct in_addr ip = { .s_addr = htonl(0xc0a82a65) };	/* 192.168.42.101 */
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	struct timeval probe = { 0 }, announce = { 0 }, *tv;
+	mdnsd_stats_t st;
+	mdns_record_t *r;
+	inet_addr_t to;
+	int probes = 0;
+
+	assert_non_null(d);
+	r = mdnsd_unique(d, "host.local.", QTYPE_A, 120, NULL, NULL);
+	mdnsd_set_ip(d, r, ip);
+
+	while (!announce.tv_sec) {
+		tv = mdnsd_sleep(d);
+		assert_true(tv->tv_sec < 2);
+		usleep(tv->tv_sec * 1000000 + tv->tv_usec);
+
+		while (mdnsd_out(d, &pkt, &to)) {
+			if (wire(&pkt)->qdcount) {
+				probe = d->now;
+				probes++;
+			} else if (in.ancount && !announce.tv_sec) {
+				announce = d->now;
+			}
+		}
+	}
+
+	assert_int_equal(3, probes);
+	assert_in_range(_tvdiff(probe, announce), 200000, 300000);
+
+	/* Nothing was held back from a querier */
+	mdnsd_get_stats(d, &st);
+	assert_int_equal(0, st.ratelimited);
+
+	mdnsd_shutdown(d);
+	mdnsd_free(d);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_query_flood),
+		cmocka_unit_test(test_interval),
+		cmocka_unit_test(test_announce_after_probe),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Verify .service files added, changed and removed at runtime are picked
+# up from the services directory watch, without any SIGHUP, and that a
+# SIGHUP reload keeps what is published.
+#set -x
+
+# shellcheck source=/dev/null
+. "$(dirname "$0")/lib.sh"
+
+topo basic
+
+SERVICES="$DIR/services"
+mkdir -p "$SERVICES"
+cp "$SRC"/examples/*.service "$SERVICES/"
+mdnsd
+discover
+
+print "Adding a service while mdnsd is running ..."
+cat >"$SERVICES/reload.service" <<-EOT
+	name Reload Test
+	type _reload._tcp
+	port 4242
+	txt version=1
+	EOT
+sleep 2
+
+mquery -t 12 _reload._tcp.local. >"$DIR/result" || FAIL "Query failed"
+# shellcheck disable=SC2154
+grep -q "+ Reload Test._reload._tcp.local. ($server_addr)" "$DIR/result" \
+	|| FAIL "New service not published"
+
+print "Changing the service's TXT record ..."
+sed -i 's/version=1/version=2.0/' "$SERVICES/reload.service"
+sleep 2
+
+# mquery shows the size of a TXT record: one length byte + "version=2.0"
+mquery -s -t 16 "Reload Test._reload._tcp.local." >"$DIR/result" || FAIL "Query failed"
+grep -q "with 12 data" "$DIR/result" || FAIL "Changed TXT record not published"
+
+print "Removing the service again ..."
+rm "$SERVICES/reload.service"
+sleep 2
+
+mquery -t 12 _reload._tcp.local. >"$DIR/result"
+grep -q "Reload Test" "$DIR/result" && FAIL "Removed service still published"
+discover
+
+print "Reloading with SIGHUP, nothing changed ..."
+kill -HUP "$(awk '$2 == "mdnsd" { print $1 }' "$DIR/pids")"
+sleep 1
+discover
+
+OK
@@ -0,0 +1,211 @@
+#include "unittest.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* White-box: the response cache is static, so pull in the library source. */
+#include "libmdnsd/mdnsd.c"
+#include "whitebox.h"
+
+#define SERVICE "_http._tcp.local."
+#define INST    "Printer." SERVICE
+#define HOST    "printer.local."
+#define NQUERY  10
+
+static unsigned char first[MAX_PACKET_LEN];
+static int first_len;
+
+/* A service with PTR, SRV, TXT and A records, done announcing */
+static mdns_record_t *published(mdns_daemon_t *d)
+{
+	struct in_addr ip = { .s_addr = htonl(0xc6336401) };	/* 198.51.100.1 */
+	mdns_record_t *r, *srv;
+
+	r = mdnsd_shared(d, HOST, QTYPE_A, 120);
+	mdnsd_set_ip(d, r, ip);
+	r = mdnsd_shared(d, INST, QTYPE_TXT, 4500);
+	mdnsd_set_raw(d, r, "\x07path=/", 7);
+	srv = mdnsd_shared(d, INST, QTYPE_SRV, 120);
+	mdnsd_set_srv(d, srv, 0, 0, 80, HOST);
+	r = mdnsd_shared(d, SERVICE, QTYPE_PTR, 120);
+	mdnsd_set_host(d, r, INST);
+	announced(d);
+
+	return srv;
+}
+
+/* Everyone hears the answer, forget it was just sent */
+static void forget(mdns_daemon_t *d)
+{
+	mdns_record_t *r;
+	int i;
+
+	for (i = 0; i < SPRIME; i++) {
+		for (r = d->published[i]; r; r = r->next)
+			r->last_sent.tv_sec = 0;
+	}
+}
+
+static void query(mdns_daemon_t *d, int n, char *known)
+{
+	inet_addr_t from;
+
+	peer(&from, n);
+	memset(&pkt, 0, sizeof(pkt));
+	message_qd(&pkt, SERVICE, QTYPE_PTR, QCLASS_IN);
+	if (known) {
+		message_an(&pkt, SERVICE, QTYPE_PTR, QCLASS_IN, 120);
+		message_rdata_name(&pkt, known);
+	}
+	assert_int_equal(0, mdnsd_in(d, wire(&pkt), &from));
+}
+
+/* Parse the first response drained */
+static struct message *response(void)
+{
+	memset(&in, 0, sizeof(in));
+	assert_int_equal(0, message_parse(&in, first));
+
+	return &in;
+}
+
+/* Drain everything due, all the same as the first, returns packets */
+static int responses(mdns_daemon_t *d)
+{
+	inet_addr_t to;
+	int n = 0;
+
+	d->pause.tv_sec = 0;	/* Skip the 20-120 msec response delay */
+	while (mdnsd_out(d, &pkt, &to)) {
+		int len = message_packet_len(&pkt);
+
+		if (!first_len) {
+			first_len = len;
+			memcpy(first, message_packet(&pkt), len);
+		} else {
+			assert_int_equal(first_len, len);
+			assert_memory_equal(first, message_packet(&pkt), len);
+		}
+		n++;
+	}
+
+	return n;
+}
+
+/* Identical queries get byte identical responses, built once */
+static void test_browse_storm(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	mdnsd_stats_t st;
+	int i;
+
+	assert_non_null(d);
+	published(d);
+
+	first_len = 0;
+	for (i = 0; i < NQUERY; i++) {
+		forget(d);
+		query(d, i, NULL);
+		assert_int_equal(1, responses(d));
+	}
+
+	mdnsd_get_stats(d, &st);
+	assert_int_equal(1, st.response_misses);
+	assert_int_equal(NQUERY - 1, st.response_hits);
+
+	/* RFC 6763 §12 additional records come along */
+	assert_int_equal(1, response()->ancount);
+	assert_int_equal(3, in.arcount);
+
+	/* Repeat before it goes out, one response only */
+	forget(d);
+	query(d, 1, NULL);
+	query(d, 2, NULL);
+	assert_int_equal(1, d->rpending);
+	assert_int_equal(1, responses(d));
+
+	mdnsd_shutdown(d);
+	mdnsd_free(d);
+}
+
+/* Changing a record invalidates the responses it is part of */
+static void test_invalidate(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	mdns_record_t *srv;
+	mdnsd_stats_t st;
+	int i;
+
+	assert_non_null(d);
+	srv = published(d);
+
+	first_len = 0;
+	forget(d);
+	query(d, 1, NULL);
+	responses(d);
+
+	/* Queued, then changed: goes out the regular way, with the new port */
+	forget(d);
+	query(d, 2, NULL);
+	mdnsd_set_srv(d, srv, 0, 0, 8080, HOST);
+	announced(d);
+	assert_int_equal(0, d->rpending);
+	assert_non_null(d->a_pause);
+
+	forget(d);
+	first_len = 0;
+	query(d, 3, NULL);
+	assert_int_equal(1, responses(d));
+
+	mdnsd_get_stats(d, &st);
+	assert_int_equal(2, st.response_misses);
+	assert_int_equal(1, st.response_hits);
+
+	response();
+	for (i = 0; i < in.arcount; i++) {
+		if (in.ar[i].type == QTYPE_SRV)
+			assert_int_equal(8080, in.ar[i].known.srv.port);
+	}
+
+	mdnsd_shutdown(d);
+	mdnsd_free(d);
+}
+
+/* Known answers are part of the key, and still suppress the answer */
+static void test_known_answer(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	mdnsd_stats_t st;
+
+	assert_non_null(d);
+	published(d);
+
+	forget(d);
+	query(d, 1, INST);
+	assert_int_equal(0, d->rpending);
+	assert_null(d->a_pause);
+
+	first_len = 0;
+	forget(d);
+	query(d, 2, "Other." SERVICE);
+	assert_int_equal(1, d->rpending);
+	responses(d);
+
+	mdnsd_get_stats(d, &st);
+	assert_int_equal(1, st.response_misses);
+	assert_int_equal(0, st.response_hits);
+
+	mdnsd_shutdown(d);
+	mdnsd_free(d);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_browse_storm),
+		cmocka_unit_test(test_invalidate),
+		cmocka_unit_test(test_known_answer),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -86,12 +86,39 @@ static void test_sd2txt_key_only_roundtrip(__attribute__((__unused__)) void **st
 	xht_free(h);
 }
 
+/*
+ * The table walks in keyed hash order, random per process, but the record
+ * must be the same every time, with txtvers first, RFC 6763 §6.7.
+ */
+static void test_sd2txt_order(__attribute__((__unused__)) void **state)
+{
+	const char expect[] = "\x09txtvers=1\x04note\x06path=/\x05rp=lp";
+	xht_t *h = xht_new(11);
+	unsigned char *raw;
+	int len;
+
+	assert_non_null(h);
+	xht_set(h, "rp", "lp");
+	xht_set(h, "path", "/");
+	xht_set(h, "txtvers", "1");
+	xht_set(h, "note", "");
+
+	raw = sd2txt(h, &len);
+	assert_non_null(raw);
+	assert_int_equal(sizeof(expect) - 1, len);
+	assert_memory_equal(expect, raw, len);
+
+	free(raw);
+	xht_free(h);
+}
+
 int main(void)
 {
 	const struct CMUnitTest tests[] = {
 		cmocka_unit_test(test_txt2sd_no_overread),
 		cmocka_unit_test(test_txt2sd_key_only),
 		cmocka_unit_test(test_sd2txt_key_only_roundtrip),
+		cmocka_unit_test(test_sd2txt_order),
 	};
 
 	return cmocka_run_group_tests(tests, NULL, NULL);
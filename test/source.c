@@ -0,0 +1,194 @@
+#include "unittest.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "libmdnsd/mdnsd.h"
+
+#define LEGIT "printer.local."
+#define NFLOOD 100
+
+/* An announcement of one A record, from @from */
+static void announce(mdns_daemon_t *d, const char *name, int n, inet_addr_t *from)
+{
+	struct in_addr ip = { .s_addr = htonl(0x0a000000 + n) };	/* 10.x.y.z */
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.header.qr = 1;
+	message_an(&pkt, (char *)name, QTYPE_A, QCLASS_IN, 120);
+	message_rdata_ipv4(&pkt, ip);
+
+	assert_int_equal(0, mdnsd_in(d, wire(&pkt), from));
+}
+
+/* No limits by default */
+static void test_unlimited(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	inet_addr_t from;
+	int i;
+
+	assert_non_null(d);
+	peer(&from, 1);
+	for (i = 0; i < 1000; i++)
+		assert_true(mdnsd_admit(d, &from));
+
+	mdnsd_free(d);
+}
+
+/* A flooding host is shed after its burst, others are not */
+static void test_rate(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	mdnsd_source_t list[4];
+	inet_addr_t flood, legit;
+	mdnsd_stats_t st;
+	int i, n = 0;
+
+	assert_non_null(d);
+	mdnsd_set_source_limit(d, 1, 10, 0);
+	peer(&flood, 1);
+	peer(&legit, 2);
+
+	for (i = 0; i < NFLOOD; i++) {
+		if (mdnsd_admit(d, &flood))
+			n++;
+	}
+	assert_in_range(n, 10, 11);
+	assert_true(mdnsd_admit(d, &legit));
+
+	mdnsd_get_stats(d, &st);
+	assert_int_equal(NFLOOD - n, st.shed);
+
+	assert_int_equal(1, mdnsd_get_offenders(d, list, 4));
+	assert_int_equal(NFLOOD, list[0].packets);
+	assert_int_equal(NFLOOD - n, list[0].dropped);
+	assert_true(inet_same_addr(&list[0].addr, &flood));
+
+	mdnsd_free(d);
+}
+
+/* A host can only put so much in the cache, the rest of the link still can */
+static void test_records(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	inet_addr_t flood, legit;
+	mdnsd_source_t list[4];
+	char name[64];
+	int i, n = 0;
+
+	assert_non_null(d);
+	mdnsd_set_source_limit(d, 0, 0, 20);
+	peer(&flood, 1);
+	peer(&legit, 2);
+
+	for (i = 0; i < NFLOOD; i++) {
+		snprintf(name, sizeof(name), "flood%03d.local.", i);
+		announce(d, name, i, &flood);
+	}
+	announce(d, LEGIT, 0, &legit);
+
+	for (i = 0; i < NFLOOD; i++) {
+		snprintf(name, sizeof(name), "flood%03d.local.", i);
+		if (mdnsd_list(d, name, QTYPE_A, NULL))
+			n++;
+	}
+	assert_int_equal(20, n);
+	assert_non_null(mdnsd_list(d, LEGIT, QTYPE_A, NULL));
+
+	assert_int_equal(1, mdnsd_get_offenders(d, list, 4));
+	assert_int_equal(NFLOOD - 20, list[0].declined);
+	assert_int_equal(20, list[0].records);
+
+	/* Refreshing what is already cached is not more */
+	announce(d, "flood000.local.", 0, &flood);
+	mdnsd_get_offenders(d, list, 4);
+	assert_int_equal(NFLOOD - 20, list[0].declined);
+
+	mdnsd_free(d);
+}
+
+/* A new source taking over a slot does not get a full burst */
+static void test_evict_tokens(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	inet_addr_t from;
+	int i;
+
+	assert_non_null(d);
+	mdnsd_set_source_limit(d, 1, 10, 0);
+
+	/* Many more hosts than the table holds */
+	for (i = 0; i < 200; i++) {
+		peer(&from, i);
+		assert_true(mdnsd_admit(d, &from));
+	}
+
+	for (i = 200; i < 210; i++) {
+		peer(&from, i);
+		assert_true(mdnsd_admit(d, &from));
+		assert_false(mdnsd_admit(d, &from));
+	}
+
+	mdnsd_free(d);
+}
+
+/* A host's record count outlives a full source table */
+static void test_records_kept(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	inet_addr_t flood, other;
+	mdnsd_source_t list[64];
+	char name[64];
+	int i, n;
+
+	assert_non_null(d);
+	mdnsd_set_source_limit(d, 0, 0, 20);
+	peer(&flood, 1);
+
+	for (i = 0; i < NFLOOD; i++) {
+		snprintf(name, sizeof(name), "flood%03d.local.", i);
+		announce(d, name, i, &flood);
+	}
+
+	/* Every other host on the link, each with one record */
+	for (i = 2; i < 250; i++) {
+		peer(&other, i);
+		snprintf(name, sizeof(name), "host%03d.local.", i);
+		announce(d, name, i, &other);
+	}
+
+	/* Hosts that could not be tracked could not fill the cache either */
+	for (i = 2, n = 0; i < 250; i++) {
+		snprintf(name, sizeof(name), "host%03d.local.", i);
+		if (mdnsd_list(d, name, QTYPE_A, NULL))
+			n++;
+	}
+	assert_in_range(n, 1, 247);
+
+	/* Still over quota */
+	announce(d, "flood100.local.", 100, &flood);
+	assert_null(mdnsd_list(d, "flood100.local.", QTYPE_A, NULL));
+
+	n = mdnsd_get_offenders(d, list, 64);
+	assert_true(n > 0);
+	assert_true(inet_same_addr(&list[0].addr, &flood));
+	assert_int_equal(20, list[0].records);
+	assert_int_equal(NFLOOD - 20 + 1, list[0].declined);
+
+	mdnsd_free(d);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_unlimited),
+		cmocka_unit_test(test_rate),
+		cmocka_unit_test(test_records),
+		cmocka_unit_test(test_evict_tokens),
+		cmocka_unit_test(test_records_kept),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,129 @@
+#include "unittest.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* White-box: the store is static, so pull in the library source. */
+#include "libmdnsd/mdnsd.c"
+
+#define INST "Printer._ipp._tcp.local."
+#define TXT  "\x0bvendor=Acme"
+
+/* A service like conf.c publishes it, returns its TXT record */
+static mdns_record_t *publish(mdns_daemon_t *d)
+{
+	mdns_record_t *r;
+
+	r = mdnsd_shared(d, "_ipp._tcp.local.", QTYPE_PTR, 120);
+	mdnsd_set_host(d, r, INST);
+	r = mdnsd_shared(d, INST, QTYPE_SRV, 120);
+	mdnsd_set_srv(d, r, 0, 0, 631, "printer.local.");
+	r = mdnsd_shared(d, INST, QTYPE_TXT, 4500);
+	mdnsd_set_raw(d, r, TXT, sizeof(TXT) - 1);
+
+	return r;
+}
+
+/* The same records in two contexts are one copy in the store */
+static void test_store_shared(__attribute__((__unused__)) void **state)
+{
+	mdnsd_store_t *s = mdnsd_store_new();
+	mdns_daemon_t *d[2];
+	mdns_record_t *r[2];
+	int i;
+
+	assert_non_null(s);
+	for (i = 0; i < 2; i++) {
+		d[i] = mdnsd_new(QCLASS_IN, 1000);
+		assert_non_null(d[i]);
+		assert_int_equal(0, mdnsd_set_store(d[i], s));
+		publish(d[i]);
+		r[i] = mdnsd_find(d[i], INST, QTYPE_SRV);
+		assert_non_null(r[i]);
+	}
+
+	/* _ipp._tcp.local., INST, printer.local. and the TXT */
+	assert_int_equal(4, s->count);
+	assert_ptr_equal(r[0]->rr.name, r[1]->rr.name);
+	assert_ptr_equal(r[0]->rr.rdname, r[1]->rr.rdname);
+	assert_ptr_equal(r[0]->wname, r[1]->wname);
+	assert_ptr_equal(r[0]->wrdname, r[1]->wrdname);
+	assert_ptr_equal(mdnsd_find(d[0], INST, QTYPE_TXT)->rr.name, r[0]->rr.name);
+
+	/* Still there for the other context */
+	mdnsd_free(d[0]);
+	assert_int_equal(4, s->count);
+	assert_string_equal(INST, r[1]->rr.name);
+
+	mdnsd_free(d[1]);
+	assert_int_equal(0, s->count);
+	mdnsd_store_free(s);
+}
+
+/* An update only frees the old rdata when no context uses it */
+static void test_store_update(__attribute__((__unused__)) void **state)
+{
+	mdnsd_store_t *s = mdnsd_store_new();
+	mdns_daemon_t *d[2];
+	mdns_record_t *r[2];
+	unsigned char *old;
+	int i;
+
+	assert_non_null(s);
+	for (i = 0; i < 2; i++) {
+		d[i] = mdnsd_new(QCLASS_IN, 1000);
+		assert_non_null(d[i]);
+		assert_int_equal(0, mdnsd_set_store(d[i], s));
+		r[i] = publish(d[i]);
+	}
+	old = r[0]->rr.rdata;
+
+	/* Same data again, same copy */
+	mdnsd_set_raw(d[0], r[0], TXT, sizeof(TXT) - 1);
+	assert_ptr_equal(old, r[0]->rr.rdata);
+	assert_int_equal(4, s->count);
+
+	mdnsd_set_raw(d[0], r[0], "\x0bvendor=Else", 12);
+	assert_ptr_equal(old, r[1]->rr.rdata);
+	assert_memory_equal(TXT, r[1]->rr.rdata, sizeof(TXT) - 1);
+	assert_int_equal(5, s->count);
+
+	mdnsd_set_raw(d[1], r[1], "\x0bvendor=Else", 12);
+	assert_ptr_equal(r[0]->rr.rdata, r[1]->rr.rdata);
+	assert_int_equal(4, s->count);
+
+	for (i = 0; i < 2; i++)
+		mdnsd_free(d[i]);
+	mdnsd_store_free(s);
+}
+
+/* Records keep their data in the store they were published with */
+static void test_store_busy(__attribute__((__unused__)) void **state)
+{
+	mdnsd_store_t *s = mdnsd_store_new();
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+
+	assert_non_null(s);
+	assert_non_null(d);
+	publish(d);
+
+	errno = 0;
+	assert_int_equal(-1, mdnsd_set_store(d, s));
+	assert_int_equal(EBUSY, errno);
+	assert_int_equal(1, s->refs);
+	assert_int_equal(0, s->count);
+
+	mdnsd_free(d);
+	mdnsd_store_free(s);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_store_shared),
+		cmocka_unit_test(test_store_update),
+		cmocka_unit_test(test_store_busy),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,128 @@
+#include "unittest.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* White-box: the unicast queue is static, so pull in the library source. */
+#include "libmdnsd/mdnsd.c"
+#include "whitebox.h"
+
+#define SERVICE "_http._tcp.local."
+#define INST    "Printer." SERVICE
+
+/* An announced PTR record, last multicast @ago seconds ago */
+static mdns_record_t *published(mdns_daemon_t *d, long ago)
+{
+	mdns_record_t *r;
+
+	r = mdnsd_shared(d, SERVICE, QTYPE_PTR, 120);
+	mdnsd_set_host(d, r, INST);
+	announced(d);
+	age(d, r, ago * 1000000);
+
+	return r;
+}
+
+static void qu_query(mdns_daemon_t *d, const inet_addr_t *from)
+{
+	memset(&pkt, 0, sizeof(pkt));
+	message_qd(&pkt, SERVICE, QTYPE_PTR, QCLASS_IN | QCLASS_QU);
+	assert_int_equal(0, mdnsd_in(d, wire(&pkt), from));
+}
+
+/* RFC 6762 §5.4: recently multicast, so the QU question gets a unicast reply */
+static void test_qu_unicast_reply(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	inet_addr_t from, to;
+	struct timeval sent;
+	mdns_record_t *r;
+
+	assert_non_null(d);
+	peer(&from, 1);
+	r = published(d, 10);
+	sent = r->last_sent;
+
+	qu_query(d, &from);
+	qu_query(d, &from);	/* Repeat must not queue a second reply */
+	assert_null(d->a_now);
+	assert_null(d->a_pause);
+	assert_non_null(d->uanswers);
+	assert_null(d->uanswers->next);
+
+	assert_int_equal(1, mdnsd_out(d, &pkt, &to));
+	assert_true(inet_same_addr(&from, &to));
+	assert_int_equal(5353, inet_port(&to));
+
+	wire(&pkt);
+	assert_int_equal(1, in.header.qr);
+	assert_int_equal(0, in.id);
+	assert_int_equal(0, in.qdcount);
+	assert_int_equal(1, in.ancount);
+	assert_string_equal(INST, in.an[0].known.ptr.name);
+
+	/* Only multicast counts as recently sent */
+	assert_int_equal(sent.tv_sec, r->last_sent.tv_sec);
+	assert_int_equal(0, mdnsd_out(d, &pkt, &to));
+
+	mdnsd_shutdown(d);
+	mdnsd_free(d);
+}
+
+/* Not multicast within a quarter TTL, so everyone gets the answer */
+static void test_qu_stale_multicast(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	inet_addr_t from;
+	mdns_record_t *r;
+
+	assert_non_null(d);
+	peer(&from, 1);
+	r = published(d, 31);
+
+	qu_query(d, &from);
+	assert_null(d->uanswers);
+	assert_ptr_equal(r, d->a_pause);
+
+	mdnsd_shutdown(d);
+	mdnsd_free(d);
+}
+
+/* Querier side, the QU bit is set on the first query only */
+static void test_qu_first_query(__attribute__((__unused__)) void **state)
+{
+	mdns_daemon_t *d = mdnsd_new(QCLASS_IN, 1000);
+	inet_addr_t to;
+
+	assert_non_null(d);
+	mdnsd_set_unicast_query(d, true);
+	mdnsd_query(d, SERVICE, QTYPE_PTR, ans, NULL);
+
+	assert_int_equal(1, mdnsd_out(d, &pkt, &to));
+	wire(&pkt);
+	assert_int_equal(1, in.qdcount);
+	assert_int_equal(QCLASS_IN, in.qd[0].class);
+	assert_int_equal(1, in.qd[0].unicast);
+
+	/* Force the retry */
+	d->qlist->nexttry = d->checkqlist = d->now.tv_sec;
+	assert_int_equal(1, mdnsd_out(d, &pkt, &to));
+	wire(&pkt);
+	assert_int_equal(1, in.qdcount);
+	assert_int_equal(QCLASS_IN, in.qd[0].class);
+	assert_int_equal(0, in.qd[0].unicast);
+
+	mdnsd_shutdown(d);
+	mdnsd_free(d);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_qu_unicast_reply),
+		cmocka_unit_test(test_qu_stale_multicast),
+		cmocka_unit_test(test_qu_first_query),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
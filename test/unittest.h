@@ -3,3 +3,12 @@
 #include <setjmp.h>
 #include <cmocka.h>
 #include "libmdnsd/xht.h"
+#include "libmdnsd/mdnsd.h"
+
+/* util.c, for the tests that go through the wire format */
+extern struct message pkt;
+extern struct message in;
+
+int             ans(mdns_answer_t *a, void *arg);
+void            peer(inet_addr_t *from, int n);
+struct message *wire(struct message *m);
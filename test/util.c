@@ -0,0 +1,35 @@
+/* Fixtures shared by the unit tests, see unittest.h */
+#include "unittest.h"
+
+#include <arpa/inet.h>
+#include <string.h>
+
+struct message pkt;	/* too big for the stack, along with the others */
+struct message in;
+
+int ans(__attribute__((__unused__)) mdns_answer_t *a, __attribute__((__unused__)) void *arg)
+{
+	return 0;
+}
+
+/* 203.0.113.x, TEST-NET-3 */
+void peer(inet_addr_t *from, int n)
+{
+	memset(from, 0, sizeof(*from));
+	from->ss_family = AF_INET;
+	((struct sockaddr_in *)from)->sin_addr.s_addr = htonl(0xcb007100 + (n % 250) + 1);
+	((struct sockaddr_in *)from)->sin_port = htons(5353);
+}
+
+/* Round-trip a built message through the parser, as if it came off the wire */
+struct message *wire(struct message *m)
+{
+	static unsigned char buf[MAX_PACKET_LEN];
+	int len = message_packet_len(m);
+
+	memcpy(buf, message_packet(m), len);
+	memset(&in, 0, sizeof(in));
+	assert_int_equal(0, message_parse(&in, buf));
+
+	return &in;
+}
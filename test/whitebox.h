@@ -0,0 +1,47 @@
+/*
+ * Fixtures for the white-box tests, the ones that #include mdnsd.c to
+ * reach its internals.  Include right after it.
+ */
+#ifndef TEST_WHITEBOX_H_
+#define TEST_WHITEBOX_H_
+
+/* Everything published so far is done probing and announcing */
+static inline void announced(mdns_daemon_t *d)
+{
+	mdns_record_t *r;
+	int i;
+
+	for (i = 0; i < SPRIME; i++) {
+		for (r = d->published[i]; r; r = r->next)
+			r->tries = 4;
+	}
+	d->a_publish = NULL;
+}
+
+/* Back-date the last multicast of @r by @usec */
+static inline void age(mdns_daemon_t *d, mdns_record_t *r, long usec)
+{
+	gettimeofday(&d->now, 0);
+	r->last_sent = d->now;
+	r->last_sent.tv_sec  -= usec / 1000000;
+	r->last_sent.tv_usec -= usec % 1000000;
+	if (r->last_sent.tv_usec < 0) {
+		r->last_sent.tv_sec--;
+		r->last_sent.tv_usec += 1000000;
+	}
+}
+
+/* Send everything due, skipping the response delay, returns packets */
+static inline int drain(mdns_daemon_t *d)
+{
+	inet_addr_t to;
+	int n = 0;
+
+	d->pause.tv_sec = 0;	/* Skip the 20-120 msec response delay */
+	while (mdnsd_out(d, &pkt, &to))
+		n++;
+
+	return n;
+}
+
+#endif /* TEST_WHITEBOX_H_ */